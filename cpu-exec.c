@@ -44,6 +44,10 @@ const int has_llvm_engine = 1;
 
 int generate_llvm = 0;
 int execute_llvm = 0;
+/* With dual_exec_llvm, blocks translated to LLVM keep a complete TCG
+ * translation as well, and execute_llvm may be flipped between blocks (e.g.
+ * by a before_block_exec_invalidate_opt callback) to pick which one runs. */
+int dual_exec_llvm = 0;
 extern bool panda_tb_chaining;
 
 extern bool panda_exit_loop;
@@ -180,7 +184,9 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
 
     cpu->can_do_io = !use_icount;
 
-    panda_callbacks_before_block_exec(cpu, itb);
+    if (panda_cb_any(PANDA_CB_BEFORE_BLOCK_EXEC)) {
+        panda_callbacks_before_block_exec(cpu, itb);
+    }
 
     // NB: This is where we did this in panda1
     panda_bb_invalidate_done = false;
@@ -199,7 +205,9 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
     cpu->can_do_io = 1;
     last_tb = (TranslationBlock *)(ret & ~TB_EXIT_MASK);
 
-    panda_callbacks_after_block_exec(cpu, itb);
+    if (panda_cb_any(PANDA_CB_AFTER_BLOCK_EXEC)) {
+        panda_callbacks_after_block_exec(cpu, itb);
+    }
 
     tb_exit = ret & TB_EXIT_MASK;
     trace_exec_tb_exit(last_tb, tb_exit);
@@ -406,7 +414,10 @@ static inline TranslationBlock *tb_find(CPUState *cpu,
 #endif
     /* See if we can patch the calling TB. */
 #ifdef CONFIG_SOFTMMU
-    if (rr_mode != RR_REPLAY && panda_tb_chaining) { 
+    /* In replay, only TBs carrying the instruction budget check may be
+     * chained to; otherwise we'd run straight past logged interrupts. */
+    if ((rr_mode != RR_REPLAY || (tb->cflags & CF_RR_CHAIN))
+            && panda_tb_chaining) {
 #endif
     if (last_tb && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
         if (!have_tb_lock) {
@@ -770,6 +781,9 @@ int cpu_exec(CPUState *cpu)
             debug_checkpoint(cpu);
             detect_infinite_loops();
             rr_maybe_progress();
+            /* Before this iteration logs anything, so that replays from the
+             * keyframe see the same interrupt_request transitions. */
+            rr_maybe_keyframe();
 
             /* Replay skipped calls from the I/O thread here. */
             if (rr_in_replay()) {
@@ -81,6 +81,7 @@ void tlb_flush(CPUState *cpu)
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
     tlb_flush_count++;
+    panda_v2p_cache_flush();
 }
 
 static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
@@ -103,6 +104,7 @@ static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
     }
 
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    panda_v2p_cache_flush();
 }
 
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
@@ -158,6 +160,7 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     }
 
     tb_flush_jmp_cache(cpu, addr);
+    panda_v2p_cache_flush_page(addr);
 }
 
 void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
@@ -203,6 +206,7 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
     va_end(argp);
 
     tb_flush_jmp_cache(cpu, addr);
+    panda_v2p_cache_flush_page(addr);
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -274,8 +278,8 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 {
-    if (tlb_entry->addr_write == (vaddr | TLB_NOTDIRTY)) {
-        tlb_entry->addr_write = vaddr;
+    if ((tlb_entry->addr_write & ~TLB_PANDA_WATCH) == (vaddr | TLB_NOTDIRTY)) {
+        tlb_entry->addr_write &= ~TLB_NOTDIRTY;
     }
 }
 
@@ -410,6 +414,12 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     } else {
         te->addr_write = -1;
     }
+
+    if (unlikely(panda_memcb_watching) &&
+        panda_memcb_watch_page(cpu, vaddr, paddr)) {
+        if (te->addr_read != -1) te->addr_read |= TLB_PANDA_WATCH;
+        if (te->addr_write != -1) te->addr_write |= TLB_PANDA_WATCH;
+    }
 }
 
 /* Add a new TLB entry, but without specifying the memory
@@ -647,7 +657,7 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
     }
 
     /* Notice an IO access, or a notdirty page.  */
-    if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
+    if (unlikely(tlb_addr & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH))) {
         /* There's really nothing that can be done to
            support this apart from stop-the-world.  */
         goto stop_the_world;
@@ -678,6 +688,22 @@ static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
 
 #define MMUSUFFIX _mmu
 
+/* PANDA: a before_mem_read/write callback asked for the access not to be
+ * made yet (panda_retry_mem_access). Stop before the instruction making it,
+ * which then runs again from the start of a new block. As when a
+ * watchpoint is hit in replay, take it off the instruction count, since it
+ * will be counted again. */
+static void QEMU_NORETURN panda_exit_before_access(CPUState *cpu,
+                                                   uintptr_t retaddr)
+{
+    panda_retry_access = false;
+    cpu_restore_state(cpu, retaddr);
+    if (rr_mode != RR_OFF) {
+        cpu->rr_guest_instr_count--;
+    }
+    cpu_loop_exit_noexc(cpu);
+}
+
 #define DATA_SIZE 1
 #include "softmmu_template.h"
 
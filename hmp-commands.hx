@@ -1830,6 +1830,14 @@ ETEXI
         .cmd = hmp_panda_list_plugins,
     },
 
+    {
+        .name       = "cb_profile",
+        .args_type  = "cmd:s,period:i?",
+        .params     = "on [period]|off|reset|show",
+        .help       = "profile the time spent in panda plugin callbacks",
+        .cmd = hmp_panda_cb_profile,
+    },
+
     {
         .name       = "end_replay",
         .args_type  = "",
@@ -783,6 +783,8 @@ void vbe_ioport_write_data(void *opaque, uint32_t addr, uint32_t val)
                 if (!(val & VBE_DISPI_NOCLEARMEM)) {
                     memset(s->vram_ptr, 0,
                            s->vbe_regs[VBE_DISPI_INDEX_YRES] * s->vbe_line_offset);
+                    memory_region_set_dirty(&s->vram, 0,
+                           s->vbe_regs[VBE_DISPI_INDEX_YRES] * s->vbe_line_offset);
                 }
             } else {
                 s->bank_offset = 0;
@@ -238,6 +238,7 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_RR_CHAIN    0x80000 /* Replay: check instr budget on entry */
 
     uint16_t invalid;
 
@@ -453,6 +454,7 @@ extern bool exit_request;
 
 extern int generate_llvm;
 extern int execute_llvm;
+extern int dual_exec_llvm;
 extern const int has_llvm_engine;
 
 #endif
@@ -1251,6 +1251,13 @@ void memory_global_dirty_log_start(void);
  */
 void memory_global_dirty_log_stop(void);
 
+/**
+ * memory_global_dirty_log_enabled: whether dirty logging for all regions is
+ * on, i.e. memory_global_dirty_log_start() was called more recently than
+ * memory_global_dirty_log_stop()
+ */
+bool memory_global_dirty_log_enabled(void);
+
 void mtree_info(fprintf_function mon_printf, void *f, bool flatview);
 
 /**
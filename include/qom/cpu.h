@@ -390,6 +390,9 @@ struct CPUState {
     uint32_t can_do_io;
     int32_t exception_index; /* used by m68k TCG */
     uint64_t rr_guest_instr_count;
+    // Replay TB chaining: chained TBs exit to the main loop rather than
+    // run past this instruction count (next logged interrupt/main loop event)
+    uint64_t rr_instr_limit;
     uint64_t panda_guest_pc;
 
     // Used for rr reverse debugging
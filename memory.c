@@ -2292,6 +2292,11 @@ void memory_global_dirty_log_start(void)
     memory_region_transaction_commit();
 }
 
+bool memory_global_dirty_log_enabled(void)
+{
+    return global_dirty_log;
+}
+
 void memory_global_dirty_log_stop(void)
 {
     global_dirty_log = false;
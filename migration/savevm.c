@@ -1279,12 +1279,13 @@ done:
     return ret;
 }
 
-static int qemu_save_device_state(QEMUFile *f)
+/* Save the state of all devices but not RAM, in a form qemu_loadvm_state
+ * can read back. */
+int qemu_save_device_state(QEMUFile *f)
 {
     SaveStateEntry *se;
 
-    qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
-    qemu_put_be32(f, QEMU_VM_FILE_VERSION);
+    qemu_savevm_state_header(f);
 
     cpu_synchronize_all_states();
 
@@ -1,6 +1,7 @@
 #ifndef __PANDA_CALLBACK_SUPPORT_H__
 #define __PANDA_CALLBACK_SUPPORT_H__
 
+#include "panda/plugin.h"
 #include "panda/rr/rr_log_all.h"
 
 // exec.c
@@ -8,6 +9,7 @@ void panda_callbacks_before_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf,
 void panda_callbacks_after_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write);
 
 // cpu-exec.c
+void panda_cb_tables_reclaim(void);
 void panda_callbacks_before_block_exec(CPUState *cpu, TranslationBlock *tb);
 void panda_callbacks_after_block_exec(CPUState *cpu, TranslationBlock *tb);
 void panda_callbacks_before_block_translate(CPUState *cpu, target_ulong pc);
@@ -18,6 +20,16 @@ bool panda_callbacks_after_find_fast(CPUState *cpu, TranslationBlock *tb, bool p
 bool panda_callbacks_insn_translate(CPUState *env, target_ulong pc);
 bool panda_callbacks_after_insn_translate(CPUState *env, target_ulong pc);
 // softmmu_template.h
+// Each of these is called only if one of the callback types in its mask has
+// an enabled callback.
+#define PANDA_CBS_BEFORE_MEM_READ \
+    (PANDA_CB_BIT(PANDA_CB_VIRT_MEM_BEFORE_READ) | PANDA_CB_BIT(PANDA_CB_PHYS_MEM_BEFORE_READ))
+#define PANDA_CBS_AFTER_MEM_READ \
+    (PANDA_CB_BIT(PANDA_CB_VIRT_MEM_AFTER_READ) | PANDA_CB_BIT(PANDA_CB_PHYS_MEM_AFTER_READ))
+#define PANDA_CBS_BEFORE_MEM_WRITE \
+    (PANDA_CB_BIT(PANDA_CB_VIRT_MEM_BEFORE_WRITE) | PANDA_CB_BIT(PANDA_CB_PHYS_MEM_BEFORE_WRITE))
+#define PANDA_CBS_AFTER_MEM_WRITE \
+    (PANDA_CB_BIT(PANDA_CB_VIRT_MEM_AFTER_WRITE) | PANDA_CB_BIT(PANDA_CB_PHYS_MEM_AFTER_WRITE))
 void panda_callbacks_before_mem_read(CPUState *env, target_ulong pc, target_ulong addr,
                                      uint32_t data_size, void *ram_ptr);
 void panda_callbacks_after_mem_read(CPUState *env, target_ulong pc, target_ulong addr,
@@ -26,6 +38,22 @@ void panda_callbacks_before_mem_write(CPUState *env, target_ulong pc, target_ulo
                                       uint32_t data_size, uint64_t result, void *ram_ptr);
 void panda_callbacks_after_mem_write(CPUState *env, target_ulong pc, target_ulong addr,
                                      uint32_t data_size, uint64_t val, void *ram_ptr);
+// set by panda_retry_mem_access()
+extern bool panda_retry_access;
+
+// memcb watch regions (see panda_memcb_watch)
+extern bool panda_memcb_watching;
+extern bool panda_memcb_watch_per_asid;
+bool panda_memcb_watch_page(CPUState *cpu, target_ulong vaddr, hwaddr paddr);
+bool panda_memcb_watched(CPUState *cpu, target_ulong addr, uint32_t size);
+
+// Whether the memory callbacks see an access, made through the PANDA
+// memory helpers, of size bytes at addr.
+static inline bool panda_memcb_wanted(CPUState *cpu, target_ulong addr,
+                                      uint32_t size) {
+    return panda_use_memcb || likely(!panda_memcb_watching) ||
+           panda_memcb_watched(cpu, addr, size);
+}
 // target-i386/misc_helper.c
 void panda_callbacks_cpuid(CPUState *env);
 // translate-all.c
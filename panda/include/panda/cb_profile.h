@@ -0,0 +1,55 @@
+#ifndef __PANDA_CB_PROFILE_H__
+#define __PANDA_CB_PROFILE_H__
+
+#include "qemu/timer.h"
+#include "qemu/fprintf-fn.h"
+#include "panda/plugin.h"
+#include "panda/common.h"
+
+/*
+ * Callback profiler.
+ *
+ * While it is on, every callback invocation is counted, and one in every
+ * panda_cb_profile_period of them (a power of two) is timed in host ticks.
+ * The time spent in each callback is estimated from its samples. Turn it on
+ * with -panda-arg general:cb_profile=<period> or the cb_profile monitor
+ * command.
+ */
+
+extern bool panda_cb_profiling;
+extern uint64_t panda_cb_profile_period;
+
+// Makes call, a call through plist->entry, counting and sampling it when
+// profiling.
+#define PANDA_CB_CALL(plist, call)                                         \
+    do {                                                                   \
+        if (unlikely(panda_cb_profiling) &&                                \
+            ((plist)->calls++ & (panda_cb_profile_period - 1)) == 0) {     \
+            int64_t t0_ = cpu_get_host_ticks();                            \
+            call;                                                          \
+            (plist)->cycles += cpu_get_host_ticks() - t0_;                 \
+            (plist)->samples++;                                            \
+        } else {                                                           \
+            call;                                                          \
+        }                                                                  \
+    } while (0)
+
+// Reads the cb_profile general argument.
+void panda_cb_profile_configure(void);
+
+// Starts profiling, sampling one in period calls (rounded up to a power of
+// two), or stops it.
+void panda_cb_profile_start(uint64_t period);
+void panda_cb_profile_stop(void);
+
+// Discards the counts gathered so far.
+void panda_cb_profile_reset(void);
+
+// Keeps the counts of plugin's callbacks, which are being unregistered.
+void panda_cb_profile_retire(void *plugin);
+
+// Prints the estimated time spent in each plugin's callbacks of each type,
+// costliest first.
+void panda_cb_profile_report(FILE *f, fprintf_function pr);
+
+#endif
@@ -14,11 +14,28 @@ typedef struct Checkpoint {
 
     size_t memfd_usage;
 
+    // memfd holds RAM pages followed, at dev_offset, by device state.
+    // Full checkpoints (parent == NULL) store an image of all of RAM indexed
+    // by ram_addr, with holes for zero pages. Incremental ones store the
+    // pages dirtied since parent, the i-th of which is page number pages[i].
+    struct Checkpoint *parent;
+    unsigned depth; // number of incremental checkpoints back to a full one
+    uint64_t *pages;
+    uint64_t num_pages;
+    off_t dev_offset;
+
+    double create_time; // seconds taken to create
+
     QLIST_ENTRY(Checkpoint) next;
 } Checkpoint;
 
-#define MAX_CHECKPOINTS 256
-extern Checkpoint* checkpoints[MAX_CHECKPOINTS];
+// Every this many checkpoints a full one is taken, bounding how many
+// incremental checkpoints a restore has to apply. 1 makes all of them full.
+extern unsigned panda_checkpoint_full_interval;
+
+// Once checkpoints take up more than this many bytes, older ones are
+// evicted, keeping them dense near the current position. 0 means no limit.
+extern size_t panda_checkpoint_budget;
 
 /*void* search_checkpoints(uint64_t target_instr);*/
 size_t get_num_checkpoints(void);
@@ -27,3 +44,40 @@ Checkpoint* get_checkpoint(int num);
 void* panda_checkpoint(void);
 void panda_restore_by_num(int num);
 void panda_restore(void *opaque);
+
+// Keyframes are checkpoints written to <name>-rr-keyframes while recording
+// (-record-keyframes), so a replay can start from one (-replay-from). The
+// file is a header, then for each keyframe its page numbers, those pages
+// and its device state, and finally an index of RR_keyframe sorted by
+// instruction count.
+#define RR_KEYFRAME_MAGIC "PANDArrk"
+#define RR_KEYFRAME_VERSION 2
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_keyframes;
+    uint64_t index_pos;
+    uint64_t ram_size;   // last_ram_offset() of the recorded machine
+} RR_keyframe_header;
+
+typedef struct {
+    uint64_t guest_instr_count;
+    uint64_t nondet_log_position;
+    // full keyframes store all nonzero pages, the others only those
+    // dirtied since the previous keyframe
+    uint32_t full;
+    // panda_current_interrupt_request, which replay only updates when the
+    // log says it changed
+    int32_t interrupt_request;
+    uint64_t num_pages;
+    uint64_t pages_pos;  // page numbers, followed by the pages
+    uint64_t dev_pos;
+    uint64_t dev_size;
+} RR_keyframe;
+
+bool panda_keyframes_open(const char *path);
+void panda_keyframe(void);
+void panda_keyframes_close(void);
+bool panda_keyframe_restore(const char *path, uint64_t instr_count,
+                            RR_keyframe *keyframe);
@@ -71,6 +71,31 @@ static inline int panda_physical_memory_rw(hwaddr addr, uint8_t *buf, int len,
     return MEMTX_OK;
 }
 
+/**
+ * @brief Returns the guest physical page mapped at guest virtual page
+ * \p page, or -1 if there is none. Equivalent to `cpu_get_phys_page_debug`,
+ * but answered from a software translation cache when possible.
+ */
+hwaddr panda_virt_to_phys_page(CPUState *env, target_ulong page);
+
+/**
+ * @brief Drops all entries of the translation cache. Called on TLB flushes
+ * and asid changes.
+ */
+void panda_v2p_cache_flush(void);
+
+/**
+ * @brief Called when the TLB entry of guest virtual page \p addr is flushed.
+ * Drops all entries, since \p addr may be part of a large page.
+ */
+void panda_v2p_cache_flush_page(target_ulong addr);
+
+/**
+ * @brief Counters of the translation cache: \p walks is the number of
+ * page table walks performed, \p avoided the number served from the cache.
+ */
+void panda_v2p_cache_stats(uint64_t *walks, uint64_t *avoided);
+
 /**
  * @brief Translates guest virtual addres \p addr to a guest physical address.
  */
@@ -78,7 +103,7 @@ static inline hwaddr panda_virt_to_phys(CPUState *env, target_ulong addr) {
     target_ulong page;
     hwaddr phys_addr;
     page = addr & TARGET_PAGE_MASK;
-    phys_addr = cpu_get_phys_page_debug(env, page);
+    phys_addr = panda_virt_to_phys_page(env, page);
     if (phys_addr == -1) {
         // no physical page mapped
         return -1;
@@ -99,7 +124,7 @@ static inline int panda_virtual_memory_rw(CPUState *env, target_ulong addr,
 
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
-        phys_addr = cpu_get_phys_page_debug(env, page);
+        phys_addr = panda_virt_to_phys_page(env, page);
         if (phys_addr == -1) {
             // no physical page mapped
             return -1;
@@ -136,6 +161,23 @@ static inline int panda_virtual_memory_write(CPUState *env, target_ulong addr,
     return panda_virtual_memory_rw(env, addr, buf, len, 1);
 }
 
+/**
+ * @brief One read of a panda_virtual_memory_read_vec batch. \p ret receives
+ * what panda_virtual_memory_read would have returned for it.
+ */
+typedef struct {
+    target_ulong addr;
+    uint8_t *buf;
+    int len;
+    int ret;
+} PandaVirtRead;
+
+/**
+ * @brief Performs the \p n reads of \p reads in one pass, translating each
+ * guest page they touch once. Returns the number of reads that failed.
+ */
+int panda_virtual_memory_read_vec(CPUState *env, PandaVirtRead *reads, int n);
+
 /**
  * @brief Determines if guest is currently executes in kernel mode.
  */
@@ -16,20 +16,21 @@ PANDAENDCOMMENT */
 #define __PANDA_HELPER_IMPL_H__
 
 #include "panda/plugin.h"
+#include "panda/cb_profile.h"
 
 void helper_panda_insn_exec(target_ulong pc) {
     // PANDA instrumentation: before basic block
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_INSN_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.insn_exec(first_cpu, pc);
+    PANDA_CB_FOREACH(plist, PANDA_CB_INSN_EXEC) {
+        PANDA_CB_CALL(plist, plist->entry.insn_exec(first_cpu, pc));
     }
 }
 
 void helper_panda_after_insn_exec(target_ulong pc) {
     // PANDA instrumentation: after basic block
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_AFTER_INSN_EXEC]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.after_insn_exec(first_cpu, pc);
+    PANDA_CB_FOREACH(plist, PANDA_CB_AFTER_INSN_EXEC) {
+        PANDA_CB_CALL(plist, plist->entry.after_insn_exec(first_cpu, pc));
     }
 }
 
@@ -651,6 +651,10 @@ struct _panda_cb_list {
     panda_cb_list *next;
     panda_cb_list *prev;
     bool enabled;
+    // kept by the callback profiler; see panda/cb_profile.h
+    uint64_t calls;
+    uint64_t samples;
+    uint64_t cycles;
 };
 panda_cb_list* panda_cb_list_next(panda_cb_list* plist);
 void panda_enable_plugin(void *plugin);
@@ -682,17 +686,53 @@ void panda_enable_precise_pc(void);
 void panda_disable_precise_pc(void);
 void panda_enable_memcb(void);
 void panda_disable_memcb(void);
+// Watches [addr .. addr+size-1], a range of virtual addresses in address
+// space asid (or in every address space, with PANDA_WATCH_ANY_ASID) or of
+// physical addresses. While memcb is disabled and some range is watched,
+// the memory callbacks see just the accesses to watched ranges, and
+// accesses to other pages stay on the TLB fast path. Callbacks see the
+// accesses to the ranges watched by every plugin. Returns an id for
+// panda_memcb_unwatch.
+#define PANDA_WATCH_ANY_ASID ((target_ulong)-1)
+int panda_memcb_watch(void *plugin, bool physical, uint64_t addr,
+                      uint64_t size, target_ulong asid);
+void panda_memcb_unwatch(int id);
 void panda_enable_llvm(void);
 void panda_disable_llvm(void);
 void panda_enable_llvm_helpers(void);
 void panda_disable_llvm_helpers(void);
 void panda_enable_tb_chaining(void);
 void panda_disable_tb_chaining(void);
+// With LLVM enabled, also keep each block's TCG translation runnable, so
+// that setting execute_llvm between blocks picks one or the other.
+void panda_enable_llvm_dual_exec(void);
+void panda_disable_llvm_dual_exec(void);
+// From a virt/phys_mem_before_read/write callback: don't make the access
+// yet. The current block stops before the instruction making it, and
+// execution resumes from that instruction in a new block.
+void panda_retry_mem_access(void);
 void panda_memsavep(FILE *f);
 
 extern bool panda_update_pc;
 extern bool panda_use_memcb;
 extern panda_cb_list *panda_cbs[PANDA_CB_LAST];
+
+// The enabled callbacks of each type, as a NULL-terminated array rebuilt
+// whenever a callback is registered, enabled or disabled. This is what
+// dispatch iterates; panda_cbs holds every registered callback.
+extern panda_cb_list **panda_cb_tables[PANDA_CB_LAST];
+// Bit PANDA_CB_BIT(type) is set if any callback of that type is enabled.
+extern uint64_t panda_cbs_enabled;
+
+#define PANDA_CB_BIT(type) (1ULL << (type))
+
+#define PANDA_CB_FOREACH(plist, type)                                   \
+    for (panda_cb_list **cb_it_ = panda_cb_tables[type];               \
+         ((plist) = *cb_it_) != NULL; cb_it_++)
+
+static inline bool panda_cb_any(panda_cb_type type) {
+    return panda_cbs_enabled & PANDA_CB_BIT(type);
+}
 extern bool panda_plugins_to_unload[MAX_PANDA_PLUGINS];
 extern bool panda_plugin_to_unload;
 extern bool panda_tb_chaining;
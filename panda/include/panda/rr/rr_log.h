@@ -142,6 +142,7 @@ typedef struct RR_log_t {
 
     char* name; // file name
     FILE* fp;   // file pointer for log
+    struct RR_zlog *zlog; // set if the log is compressed (see rr_zlog.h)
     unsigned long long
         size; // for a log being opened for read, this will be the size in bytes
     uint64_t bytes_read;
@@ -188,7 +189,23 @@ static inline void rr_maybe_progress(void) {
     }
 }
 
+// Defined in rr_log.c. UINT64_MAX unless recording with -record-keyframes.
+extern uint64_t rr_next_keyframe;
+extern void rr_take_keyframe(void);
+// Last interrupt_request written to or read from the log; see rr_log.c.
+extern int panda_current_interrupt_request;
+// Called at the top of the cpu_exec loop while recording, before anything
+// is logged for the next block.
+static inline void rr_maybe_keyframe(void) {
+    if (unlikely(rr_get_guest_instr_count() >= rr_next_keyframe)) {
+        rr_take_keyframe();
+    }
+}
+
 extern void rr_fill_queue(void);
+extern void rr_nondet_log_seek(uint64_t pos);
+extern uint64_t rr_record_log_position(void);
+extern void rr_update_instr_limit(void);
 extern RR_log_entry *rr_queue_tail;
 static inline uint64_t rr_num_instr_before_next_interrupt(void) {
     if (!rr_queue_tail) rr_fill_queue();
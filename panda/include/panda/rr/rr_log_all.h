@@ -301,6 +301,31 @@ static inline bool rr_in_record(void) { return rr_mode == RR_RECORD; }
 static inline bool rr_off(void) { return rr_mode == RR_OFF; }
 static inline bool rr_on(void) { return !rr_off(); }
 
+// Allow TB chaining during replay (-replay-chaining). Chained TBs are
+// translated with CF_RR_CHAIN and leave the chain once the next logged
+// event handled by the main loop is due (see cpu->rr_instr_limit).
+extern bool rr_replay_chaining;
+static inline bool rr_replay_chaining_enabled(void) {
+#ifdef TARGET_PPC
+    // PPC pending interrupt entries are consumed from the main loop but do
+    // not terminate the replay queue, so they can't bound a chain.
+    return false;
+#else
+    return rr_in_replay() && rr_replay_chaining;
+#endif
+}
+
+// Write the nondet log as compressed chunks (-record-compress). Replay
+// detects the format by itself.
+extern bool rr_record_compress;
+
+// Write a keyframe every this many instructions while recording
+// (-record-keyframes), 0 for none. See panda/checkpoint.h.
+extern uint64_t rr_keyframe_interval;
+// Start replays from the last keyframe at or before this instruction
+// (-replay-from).
+extern uint64_t rr_replay_from;
+
 // Convenience routines that perform appropriate action based on rr_mode setting
 #define RR_CONVENIENCE(name, arg_type)                                  \
     static inline void rr_ ## name ## _at(RR_callsite_id call_site,     \
@@ -0,0 +1,77 @@
+#ifndef __RR_ZLOG_H_
+#define __RR_ZLOG_H_
+
+/* Compressed container for the nondet log.
+
+   The log is stored as a sequence of independently zlib-compressed chunks,
+   followed by a directory giving the guest instruction count at which each
+   chunk starts. Chunks always begin on a log entry boundary.
+
+   The header is valid from the start of a recording, with dir_pos 0 until
+   the directory is written at the end. Each chunk is preceded by a frame
+   describing it, so if the recording never finished, readers rebuild the
+   directory by scanning the frames and replay up to the last complete
+   chunk.
+
+   Readers see the same byte stream as an uncompressed -rr-nondet.log
+   (including the leading 8 byte instruction count), so file positions,
+   and thus checkpoint positions, are identical in both formats.
+   rr_zlog_fopen_read() hides the difference behind an ordinary seekable
+   read-only FILE.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define RR_ZLOG_MAGIC "PANDArrz"
+#define RR_ZLOG_VERSION 2
+#define RR_ZLOG_CHUNK_SIZE (4 << 20)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t last_instr;  // same as the header of an uncompressed log
+    uint64_t size;        // size of the uncompressed log
+    uint64_t dir_pos;     // file position of the chunk directory, or 0
+    uint32_t num_chunks;
+    uint32_t reserved;
+} RR_zlog_header;
+
+typedef struct {
+    uint64_t instr;     // guest instr count of the first entry in the chunk
+    uint64_t pos;       // uncompressed log position of the chunk
+    uint64_t file_pos;  // file position of the compressed data
+    uint32_t zsize;
+    uint32_t size;
+} RR_zlog_chunk;
+
+// Precedes the compressed data of each chunk.
+typedef struct {
+    uint64_t instr;       // guest instr count of the first entry in the chunk
+    uint64_t last_instr;  // guest instr count of the last entry in the chunk
+    uint32_t zsize;
+    uint32_t size;
+} RR_zlog_frame;
+
+typedef struct RR_zlog RR_zlog;
+
+// Record. Writes go through rr_zlog_write() between rr_zlog_entry() calls.
+RR_zlog *rr_zlog_open_write(FILE *fp, uint32_t chunk_size);
+void rr_zlog_entry(RR_zlog *zlog, uint64_t instr);
+void rr_zlog_write(RR_zlog *zlog, const void *ptr, size_t len);
+// Position in the uncompressed log of the next byte written.
+uint64_t rr_zlog_tell(RR_zlog *zlog);
+// Flushes the last chunk, writes directory and header. Doesn't close fp.
+void rr_zlog_close_write(RR_zlog *zlog, uint64_t last_instr);
+
+// Replay. Opens path, which may be compressed or not. For compressed logs
+// *zlog (if non-NULL) is set to the handle behind the returned FILE, which
+// stays valid until that FILE is closed; otherwise it is set to NULL.
+FILE *rr_zlog_fopen_read(const char *path, RR_zlog **zlog);
+// Position of the last chunk starting at or before instr.
+uint64_t rr_zlog_find_instr(RR_zlog *zlog, uint64_t instr);
+const RR_zlog_header *rr_zlog_get_header(RR_zlog *zlog);
+
+#endif
@@ -760,6 +760,16 @@ inline Value* TCGLLVMContextPrivate::generateQemuMemOp(bool ld,
 #endif // CONFIG_SOFTMMU
 }
 
+/* With dual_exec_llvm, the TCG ops of each instruction update panda_guest_pc
+ * and rr_guest_instr_count for the sake of the TCG translation. The LLVM
+ * translation does that at each insn_start already. */
+static bool isPandaCountStore(int64_t offset)
+{
+    return dual_exec_llvm &&
+        (offset == -ENV_OFFSET + offsetof(CPUState, panda_guest_pc) ||
+         offset == -ENV_OFFSET + offsetof(CPUState, rr_guest_instr_count));
+}
+
 int TCGLLVMContextPrivate::generateOperation(int opc, const TCGOp *op,
     const TCGArg *args)
 {
@@ -1011,6 +1021,7 @@ int TCGLLVMContextPrivate::generateOperation(int opc, const TCGOp *op,
 
 #define __ST_OP(opc_name, memBits, regBits)                         \
     case opc_name:  {                                               \
+        if (isPandaCountStore(args[2])) break;                      \
         TCGTemp &temp = m_tcgContext->temps[args[0]];               \
         assert(getValue(args[0])->getType() == intType(regBits));   \
         assert(!m_tcgContext->temps[args[1]].name                   \
@@ -1555,7 +1566,8 @@ void TCGLLVMContextPrivate::generateCode(TCGContext *s, TranslationBlock *tb)
 
     tb->llvm_function = m_tbFunction;
 
-    if(execute_llvm || qemu_loglevel_mask(CPU_LOG_LLVM_ASM)) {
+    if(execute_llvm || dual_exec_llvm
+            || qemu_loglevel_mask(CPU_LOG_LLVM_ASM)) {
         tb->llvm_tc_ptr = (uint8_t*)
                 m_executionEngine->getPointerToFunction(m_tbFunction);
         tb->llvm_tc_end = tb->llvm_tc_ptr +
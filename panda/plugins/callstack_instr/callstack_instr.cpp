@@ -20,6 +20,7 @@ PANDAENDCOMMENT */
 #include <cstdlib>
 
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <vector>
 #include <algorithm>
@@ -75,8 +76,18 @@ struct stack_entry {
     instr_type kind;
 };
 
+// A thread's shadow stack: return addresses, and the entry points of the
+// functions they return from.
+struct callstack {
+    std::vector<stack_entry> calls;
+    std::vector<target_ulong> functions;
+};
+
 #define MAX_STACK_DIFF 5000
 
+// How often (in blocks) to look for stacks to reclaim
+#define RECLAIM_INTERVAL (1 << 20)
+
 csh cs_handle_32;
 csh cs_handle_64;
 
@@ -88,18 +99,38 @@ std::map<target_ulong,std::set<target_ulong>> stacks_seen;
 // the original code easily
 #ifdef USE_STACK_HEURISTIC
 typedef std::pair<target_ulong,target_ulong> stackid;
-target_ulong cached_sp = 0;
-target_ulong cached_asid = 0;
 #else
 typedef target_ulong stackid;
 #endif
 
 // stackid -> shadow stack
-std::map<stackid, std::vector<stack_entry>> callstacks;
-// stackid -> function entry points
-std::map<stackid, std::vector<target_ulong>> function_stacks;
-// EIP -> instr_type
-std::map<target_ulong, instr_type> call_cache;
+std::map<stackid, callstack> callstacks;
+
+// The stack used by the last block. It stays valid until the ASID changes
+// or, with the stack heuristic, the stack pointer leaves its region.
+static callstack *cur_stack = NULL;
+static target_ulong cur_asid;
+#ifdef USE_STACK_HEURISTIC
+static target_ulong cur_sp;
+#endif
+
+// Limits on the shadow stacks; 0 means unlimited
+static uint32_t max_depth;
+static uint32_t max_stacks;
+
+static uint64_t blocks_executed;
+
+// TB -> type of its last instruction, for blocks ending in a call or ret.
+// Keyed by TB rather than pc, since the same virtual address holds different
+// code in different address spaces. The pc and size catch TBs that reuse a
+// slot without going through after_block_translate, like the truncated
+// copies made by cpu_exec_nocache.
+struct tb_info {
+    target_ulong pc;
+    uint16_t size;
+    instr_type kind;
+};
+std::unordered_map<TranslationBlock *, tb_info> call_cache;
 int last_ret_size = 0;
 
 static inline bool in_kernelspace(CPUArchState* env) {
@@ -122,55 +153,93 @@ static inline target_ulong get_stack_pointer(CPUArchState* env) {
 #endif
 }
 
-static stackid get_stackid(CPUArchState* env) {
+static inline target_ulong stack_distance(target_ulong a, target_ulong b) {
+    return (a > b) ? a - b : b - a;
+}
+
 #ifdef USE_STACK_HEURISTIC
-    target_ulong asid;
+// Find the closest stack we've seen in asid, or start a new one at sp
+static target_ulong get_stack_base(target_ulong asid, target_ulong sp) {
+    auto &stackset = stacks_seen[asid];
+    target_ulong stack = sp;
+    target_ulong diff = MAX_STACK_DIFF;
 
+    auto it = stackset.lower_bound(sp);
+    if (it != stackset.end() && stack_distance(*it, sp) < diff) {
+        stack = *it;
+        diff = stack_distance(*it, sp);
+    }
+    if (it != stackset.begin()) {
+        --it;
+        if (stack_distance(*it, sp) < diff) {
+            stack = *it;
+        }
+    }
+    if (stack == sp) {
+        stackset.insert(sp);
+    }
+    return stack;
+}
+#endif
+
+static callstack *get_callstack(CPUArchState* env) {
+#ifdef USE_STACK_HEURISTIC
     // Track all kernel-mode stacks together
+    target_ulong asid;
     if (in_kernelspace(env))
         asid = 0;
     else
         asid = panda_current_asid(ENV_GET_CPU(env));
 
-    // Invalidate cached stack pointer on ASID change
-    if (cached_asid == 0 || cached_asid != asid) {
-        cached_sp = 0;
-        cached_asid = asid;
+    target_ulong sp = get_stack_pointer(env);
+    if (cur_stack && asid == cur_asid &&
+            stack_distance(sp, cur_sp) < MAX_STACK_DIFF) {
+        return cur_stack;
     }
+    cur_sp = get_stack_base(asid, sp);
+    stackid id = std::make_pair(asid, cur_sp);
+#else
+    target_ulong asid = panda_current_asid(ENV_GET_CPU(env));
+    if (cur_stack && asid == cur_asid) {
+        return cur_stack;
+    }
+    stackid id = asid;
+#endif
 
-    target_ulong sp = get_stack_pointer(env);
+    cur_asid = asid;
+    cur_stack = &callstacks[id];
+    return cur_stack;
+}
 
-    // We can short-circuit the search in most cases
-    if (std::abs(sp - cached_sp) < MAX_STACK_DIFF) {
-        return std::make_pair(asid, cached_sp);
+// Once there are more than max_stacks stacks, drop the empty ones. An empty
+// stack holds nothing a later lookup would miss, and exited threads and
+// processes mostly leave empty stacks behind once their frames are popped.
+// Stacks with calls on them are kept however long they've been idle, since
+// a thread may sleep for most of a replay.
+static void reclaim_stacks(void) {
+    if (max_stacks && callstacks.size() > max_stacks) {
+        for (auto it = callstacks.begin(); it != callstacks.end(); ) {
+            callstack &s = it->second;
+            if (&s != cur_stack && s.calls.empty()) {
+#ifdef USE_STACK_HEURISTIC
+                stacks_seen[it->first.first].erase(it->first.second);
+#endif
+                it = callstacks.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
     }
+}
 
-    auto &stackset = stacks_seen[asid];
-    if (stackset.empty()) {
-        stackset.insert(sp);
-        cached_sp = sp;
-        return std::make_pair(asid,sp);
+static inline instr_type get_tb_type(TranslationBlock *tb) {
+    auto it = call_cache.find(tb);
+    if (it == call_cache.end() || it->second.pc != tb->pc ||
+            it->second.size != tb->size) {
+        return INSTR_UNKNOWN;
     }
-    else {
-        // Find the closest stack pointer we've seen
-        auto lb = std::lower_bound(stackset.begin(), stackset.end(), sp);
-        target_ulong stack1 = *lb;
-        lb--;
-        target_ulong stack2 = *lb;
-        target_ulong stack = (std::abs(stack1 - sp) < std::abs(stack2 - sp)) ? stack1 : stack2;
-        int diff = std::abs(stack-sp);
-        if (diff < MAX_STACK_DIFF) {
-            return std::make_pair(asid,stack);
-        }
-        else {
-            stackset.insert(sp);
-            cached_sp = sp;
-            return std::make_pair(asid,sp);
-        }
-    }
-#else
-    return panda_current_asid(ENV_GET_CPU(env));
-#endif
+    return it->second.kind;
 }
 
 instr_type disas_block(CPUArchState* env, target_ulong pc, int size) {
@@ -235,15 +304,28 @@ done2:
 int after_block_translate(CPUState *cpu, TranslationBlock *tb) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
 
-    call_cache[tb->pc] = disas_block(env, tb->pc, tb->size);
+    instr_type kind = disas_block(env, tb->pc, tb->size);
+    if (kind == INSTR_UNKNOWN) {
+        call_cache.erase(tb);
+    }
+    else {
+        tb_info info = {tb->pc, tb->size, kind};
+        call_cache[tb] = info;
+    }
 
     return 1;
 }
 
 int before_block_exec(CPUState *cpu, TranslationBlock *tb) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    std::vector<stack_entry> &v = callstacks[get_stackid(env)];
-    std::vector<target_ulong> &w = function_stacks[get_stackid(env)];
+
+    if ((++blocks_executed & (RECLAIM_INTERVAL - 1)) == 0) {
+        reclaim_stacks();
+    }
+
+    callstack *s = get_callstack(env);
+    std::vector<stack_entry> &v = s->calls;
+    std::vector<target_ulong> &w = s->functions;
     if (v.empty()) return 1;
 
     // Search up to 10 down
@@ -265,18 +347,29 @@ int before_block_exec(CPUState *cpu, TranslationBlock *tb) {
 
 int after_block_exec(CPUState* cpu, TranslationBlock *tb) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    instr_type tb_type = call_cache[tb->pc];
+    instr_type tb_type = get_tb_type(tb);
 
     if (tb_type == INSTR_CALL) {
+        callstack *s = get_callstack(env);
+
+        // Calls that never return (longjmp, exceptions, missed rets) would
+        // otherwise grow the stack forever; forget the oldest quarter.
+        if (max_depth && s->calls.size() >= max_depth) {
+            size_t drop = std::max(max_depth / 4, 1U);
+            s->calls.erase(s->calls.begin(), s->calls.begin() + drop);
+            s->functions.erase(s->functions.begin(),
+                               s->functions.begin() + drop);
+        }
+
         stack_entry se = {tb->pc+tb->size,tb_type};
-        callstacks[get_stackid(env)].push_back(se);
+        s->calls.push_back(se);
 
         // Also track the function that gets called
         target_ulong pc, cs_base;
         uint32_t flags;
         // This retrieves the pc in an architecture-neutral way
         cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-        function_stacks[get_stackid(env)].push_back(pc);
+        s->functions.push_back(pc);
 
         PPP_RUN_CB(on_call, cpu, pc);
     }
@@ -294,7 +387,7 @@ int after_block_exec(CPUState* cpu, TranslationBlock *tb) {
  */
 uint32_t get_callers(target_ulong callers[], uint32_t n, CPUState* cpu) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    std::vector<stack_entry> &v = callstacks[get_stackid(env)];
+    std::vector<stack_entry> &v = get_callstack(env)->calls;
 
     n = std::min((uint32_t)v.size(), n);
     for (uint32_t i=0; i<n; i++) { callers[i] = v[n-1-i].pc; }
@@ -309,7 +402,7 @@ uint32_t get_callers(target_ulong callers[], uint32_t n, CPUState* cpu) {
 Panda__CallStack *pandalog_callstack_create() {
     assert(pandalog);
     CPUArchState* env = (CPUArchState*)first_cpu->env_ptr;
-    std::vector<stack_entry> &v = callstacks[get_stackid(env)];
+    std::vector<stack_entry> &v = get_callstack(env)->calls;
 
     Panda__CallStack *cs = (Panda__CallStack *)malloc(sizeof(Panda__CallStack));
     *cs = PANDA__CALL_STACK__INIT;
@@ -336,7 +429,7 @@ void pandalog_callstack_free(Panda__CallStack *cs) {
  */
 uint32_t get_functions(target_ulong functions[], uint32_t n, CPUState* cpu) {
     CPUArchState* env = (CPUArchState*)cpu->env_ptr;
-    std::vector<target_ulong> &v = function_stacks[get_stackid(env)];
+    std::vector<target_ulong> &v = get_callstack(env)->functions;
 
     n = std::min((uint32_t)v.size(), n);
     for (uint32_t i=0; i<n; i++) { functions[i] = v[n-1-i]; }
@@ -397,6 +490,13 @@ bool init_plugin(void *self) {
     cs_option(cs_handle_64, CS_OPT_DETAIL, CS_OPT_ON);
 #endif
 
+    panda_arg_list *args = panda_get_args("callstack_instr");
+    max_depth = panda_parse_uint32_opt(args, "max_depth", 4096,
+            "maximum number of calls kept on one shadow stack (0: no limit)");
+    max_stacks = panda_parse_uint32_opt(args, "max_stacks", 1024,
+            "number of shadow stacks above which empty ones are dropped (0: no limit)");
+    panda_free_args(args);
+
     panda_cb pcb;
 
     panda_enable_memcb();
@@ -413,6 +513,8 @@ bool init_plugin(void *self) {
 }
 
 void uninit_plugin(void *self) {
+    printf("callstack_instr: %" PRIu64 " blocks, %zu stacks\n",
+            blocks_executed, callstacks.size());
 }
 
 /* vim: set tabstop=4 softtabstop=4 expandtab ft=cpp: */
@@ -53,16 +53,22 @@ void after_init(CPUState* env) {
     panda_arg_list *args = panda_get_args("checkpoint");
 
     const char* avail_space = panda_parse_string_opt(args, "space", "6G", "Available disk/RAM space for storing checkpoints");
+    panda_checkpoint_full_interval = panda_parse_uint32_opt(args, "full_interval", 16,
+            "Take a full checkpoint every this many; the others only store pages dirtied since the previous one");
+    if (panda_checkpoint_full_interval == 0)
+        panda_checkpoint_full_interval = 1;
     uint64_t space_bytes;
     parse_option_size("space", avail_space, &space_bytes, NULL );
 
-    // Get approx size of each checkpoint
+    // Get approx size of each checkpoint. Incremental ones are usually small
+    // compared to a full one, so budget ram_size per full_interval.
     printf("Avail space %lx, ram_size %lx\n", space_bytes, ram_size);
     if (space_bytes < ram_size){
         fprintf(stderr, "Not enough RAM for a checkpoint!\n");
         abort();
     }
-    uint64_t num_checkpoints = space_bytes/ram_size;
+    panda_checkpoint_budget = space_bytes;
+    uint64_t num_checkpoints = space_bytes/ram_size * panda_checkpoint_full_interval;
     printf("Number of checkpoints allowed:  %lu\n", num_checkpoints);
     checkpoint_instr_size = rr_nondet_log->last_prog_point.guest_instr_count/num_checkpoints;
     if (checkpoint_instr_size < 500000)
@@ -0,0 +1,83 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+// This needs to be defined before anything is included in order to get
+// the PRIx64 macro
+#define __STDC_FORMAT_MACROS
+
+#include "panda/plugin.h"
+
+#include <stdio.h>
+
+bool init_plugin(void *);
+void uninit_plugin(void *);
+
+static uint64_t start, end;
+static target_ulong asid;
+static uint64_t reads, writes;
+
+static bool in_range(CPUState *env, target_ulong addr, target_ulong size) {
+    if (asid != PANDA_WATCH_ANY_ASID && panda_current_asid(env) != asid) {
+        return false;
+    }
+    return addr < end && start < addr + size;
+}
+
+static int mem_read(CPUState *env, target_ulong pc, target_ulong addr,
+                    target_ulong size, void *buf) {
+    if (in_range(env, addr, size)) reads++;
+    return 0;
+}
+
+static int mem_write(CPUState *env, target_ulong pc, target_ulong addr,
+                     target_ulong size, void *buf) {
+    if (in_range(env, addr, size)) writes++;
+    return 0;
+}
+
+bool init_plugin(void *self) {
+    panda_arg_list *args = panda_get_args("memwatch");
+    start = panda_parse_uint64_req(args, "addr", "start of the range to watch");
+    end = start + panda_parse_uint64_opt(args, "size", TARGET_PAGE_SIZE, "size of the range to watch");
+    bool phys = panda_parse_bool_opt(args, "phys", "addr is a physical address");
+    asid = panda_parse_ulong_opt(args, "asid", PANDA_WATCH_ANY_ASID, "only watch the range in this address space");
+    bool global = panda_parse_bool_opt(args, "global", "see every access and filter them here, instead of watching the range");
+    panda_free_args(args);
+
+    panda_cb pcb;
+    if (phys) {
+        // physical addresses are the same in every address space
+        asid = PANDA_WATCH_ANY_ASID;
+        pcb.phys_mem_after_read = mem_read;
+        panda_register_callback(self, PANDA_CB_PHYS_MEM_AFTER_READ, pcb);
+        pcb.phys_mem_after_write = mem_write;
+        panda_register_callback(self, PANDA_CB_PHYS_MEM_AFTER_WRITE, pcb);
+    } else {
+        pcb.virt_mem_after_read = mem_read;
+        panda_register_callback(self, PANDA_CB_VIRT_MEM_AFTER_READ, pcb);
+        pcb.virt_mem_after_write = mem_write;
+        panda_register_callback(self, PANDA_CB_VIRT_MEM_AFTER_WRITE, pcb);
+    }
+
+    if (global) {
+        panda_enable_memcb();
+    } else {
+        panda_memcb_watch(self, phys, start, end - start, asid);
+    }
+    return true;
+}
+
+void uninit_plugin(void *self) {
+    printf("memwatch: [0x%" PRIx64 ", 0x%" PRIx64 "): %" PRIu64 " reads, %"
+           PRIu64 " writes\n", start, end, reads, writes);
+}
@@ -227,9 +227,17 @@ static void fill_osimodule(CPUState *env, OsiModule *m, target_ptr_t vma_addr) {
 	target_ptr_t vma_dentry;
 	target_ptr_t mm_addr, start_brk, brk, start_stack;
 
-	vma_start = get_vma_start(env, vma_addr);
-	vma_end = get_vma_end(env, vma_addr);
-	vma_vm_file = get_vma_vm_file(env, vma_addr);
+	// The three fields share a page most of the time: read them in one pass.
+	PandaVirtRead reads[] = {
+		{ vma_addr + ki.vma.vm_start_offset, (uint8_t *)&vma_start, sizeof(vma_start), 0 },
+		{ vma_addr + ki.vma.vm_end_offset, (uint8_t *)&vma_end, sizeof(vma_end), 0 },
+		{ vma_addr + ki.vma.vm_file_offset, (uint8_t *)&vma_vm_file, sizeof(vma_vm_file), 0 },
+	};
+	panda_virtual_memory_read_vec(env, reads, 3);
+	// same fallback as the IMPLEMENT_OFFSET_GET getters
+	if (reads[0].ret != 0) vma_start = 0;
+	if (reads[1].ret != 0) vma_end = 0;
+	if (reads[2].ret != 0) vma_vm_file = (target_ptr_t)NULL;
 
 	// Fill everything but m->name and m->file.
 	m->modd = vma_addr;
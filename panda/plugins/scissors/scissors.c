@@ -4,12 +4,18 @@
  * to control beginning and end of new replay. Output goes to
  * a new replay named "scissors" by default (-panda-arg scissors:name
  * to change)
+ *
+ * With -panda-arg scissors:segments=N the range is instead cut into N
+ * back-to-back replays, name-0 .. name-(N-1), in a single pass, so that
+ * they can be analyzed in parallel. Their start and end instruction
+ * counts in the original replay are listed in name-segments.
  */
 
 #include <stdio.h>
 
 #include "panda/plugin.h"
 #include "panda/rr/rr_log.h"
+#include "panda/rr/rr_zlog.h"
 
 #include "migration/migration.h"
 #include "include/exec/address-spaces.h"
@@ -33,6 +39,13 @@ static uint64_t end_count;
 static char nondet_name[128];
 static char snp_name[128];
 
+static char base_name[128];
+static uint32_t num_segments = 1;
+static uint32_t segment = 0;
+static uint64_t range_start;
+static uint64_t range_end;
+static FILE *manifest = NULL;
+
 static FILE *oldlog = NULL;
 static FILE *newlog = NULL;
 
@@ -47,7 +60,15 @@ static RR_prog_point pp_last_copied_log_entry;
 static bool snipping = false;
 static bool done = false;
 
-static RR_prog_point copy_entry(void);
+// Buffer through which log entries are copied: copy_buf[0] is at position
+// copy_pos in the old log, the first copy_len bytes are valid, entries
+// before copy_off have been looked at and those from copy_out on are yet
+// to be written.
+#define COPY_BUF_SIZE (4 << 20)
+static uint8_t *copy_buf = NULL;
+static size_t copy_cap, copy_len, copy_off, copy_out;
+static long copy_pos;
+
 static void sassert(bool condition, int which);
 
 static void sassert(bool condition, int which) {
@@ -65,141 +86,91 @@ static INLINEIT size_t rr_fwrite(void *ptr, size_t size, size_t nmemb, FILE *f)
     return result;
 }
 
-static INLINEIT size_t rr_fread(void *ptr, size_t size, size_t nmemb, FILE *f) {
-    size_t result = fread(ptr, size, nmemb, f);
-    sassert(result == nmemb, 2);
-    return result;
-}
-
-static INLINEIT void rr_fcopy(void *ptr, size_t size, size_t nmemb, FILE *oldlog, FILE *newlog) {
-    rr_fread(ptr, size, nmemb, oldlog);
-    rr_fwrite(ptr, size, nmemb, newlog);
-}
-
-static INLINEIT RR_log_entry *alloc_new_entry(void) 
-{
-    static RR_log_entry *new_entry = NULL;
-    if(!new_entry) new_entry = g_new(RR_log_entry, 1);
-    memset(new_entry, 0, sizeof(RR_log_entry));
-    return new_entry;
-}
-
 static INLINEIT bool rr_log_is_empty(void) {
     if (rr_nondet_log_type == REPLAY){
-        long pos = ftell(oldlog);
-        return pos == rr_nondet_log_size;
+        return copy_pos + copy_off >= rr_nondet_log_size;
     } else {
         return false;
     }
 }
 
-// Returns guest instr count (in old replay counting mode)
-static RR_prog_point copy_entry(void) {
-    // Code copied from rr_log.c.
-    // Copy entry.
-    RR_log_entry *item = alloc_new_entry();
-
-    long pos = ftell(oldlog);
-
-    rr_fread(&(item->header.prog_point.guest_instr_count), sizeof(item->header.prog_point.guest_instr_count), 1, oldlog);
-
-    if (item->header.prog_point.guest_instr_count > end_count) {
-        // We don't want to copy this one.
-        fseek(oldlog, pos, SEEK_SET);
-        return item->header.prog_point;
-    }
-
-    //ph Fix up instruction count
-    RR_prog_point original_prog_point = item->header.prog_point;
-    item->header.prog_point.guest_instr_count -= actual_start_count;
-    rr_fwrite(&item->header.prog_point, sizeof(item->header.prog_point), 1, newlog);
-
-#define RR_COPY_ITEM(field) rr_fcopy(&(field), sizeof(field), 1, oldlog, newlog)
-    //rw only read 1 byte for kind and callsite_loc even though it's an enum, due to mz's optimization (see rr_log.h)
-    rr_fcopy(&(item->header.kind), 1, 1, oldlog, newlog);
-    rr_fcopy(&(item->header.callsite_loc), 1, 1, oldlog, newlog);
-
-    //mz read the rest of the item
-    switch (item->header.kind) {
+// Size of the log entry at p, or 0 if it doesn't fit in avail bytes.
+// Follows the format read by rr_log.c.
+static size_t entry_size(const uint8_t *p, size_t avail) {
+    RR_log_entry item;
+    size_t size = sizeof(item.header.prog_point.guest_instr_count) + 2;
+    if (avail < size) return 0;
+
+#define RR_SIZE_ITEM(field) size += sizeof(field)
+#define RR_SIZE_BUF_ITEM(field, len_field)                                  \
+    do {                                                                    \
+        if (avail < size + sizeof(field)) return 0;                         \
+        memcpy(&(field), p + size, sizeof(field));                          \
+        size += sizeof(field) + (field).len_field;                          \
+    } while (0)
+    //rw kind and callsite_loc are stored in 1 byte each (see rr_log.h)
+    switch (p[sizeof(item.header.prog_point.guest_instr_count)]) {
         case RR_INPUT_1:
-            RR_COPY_ITEM(item->variant.input_1);
+            RR_SIZE_ITEM(item.variant.input_1);
             break;
         case RR_INPUT_2:
-            RR_COPY_ITEM(item->variant.input_2);
+            RR_SIZE_ITEM(item.variant.input_2);
             break;
         case RR_INPUT_4:
-            RR_COPY_ITEM(item->variant.input_4);
+            RR_SIZE_ITEM(item.variant.input_4);
             break;
         case RR_INPUT_8:
-            RR_COPY_ITEM(item->variant.input_8);
+            RR_SIZE_ITEM(item.variant.input_8);
             break;
         case RR_INTERRUPT_REQUEST:
-            RR_COPY_ITEM(item->variant.interrupt_request);
+            RR_SIZE_ITEM(item.variant.interrupt_request);
             break;
         case RR_PENDING_INTERRUPTS:
-            RR_COPY_ITEM(item->variant.pending_interrupts);
+            RR_SIZE_ITEM(item.variant.pending_interrupts);
             break;
         case RR_EXCEPTION:
-            RR_COPY_ITEM(item->variant.exception_index);
+            RR_SIZE_ITEM(item.variant.exception_index);
             break;
         case RR_EXIT_REQUEST:
-            RR_COPY_ITEM(item->variant.exit_request);
+            RR_SIZE_ITEM(item.variant.exit_request);
             break;
         case RR_SKIPPED_CALL: {
-            RR_skipped_call_args *args = &item->variant.call_args;
+            RR_skipped_call_args *args = &item.variant.call_args;
             //mz read kind first!
-            rr_fcopy(&args->kind, 1, 1, oldlog, newlog);
+            if (avail < size + 1) return 0;
+            uint8_t kind = p[size];
+            size += 1;
 
-            switch(args->kind) {
+            switch (kind) {
                 case RR_CALL_CPU_MEM_RW:
-                    RR_COPY_ITEM(args->variant.cpu_mem_rw_args);
-                    args->variant.cpu_mem_rw_args.buf =
-                        g_malloc(args->variant.cpu_mem_rw_args.len);
-                    rr_fcopy(args->variant.cpu_mem_rw_args.buf, 1,
-                            args->variant.cpu_mem_rw_args.len,
-                            oldlog, newlog);
+                    RR_SIZE_BUF_ITEM(args->variant.cpu_mem_rw_args, len);
                     break;
                 case RR_CALL_CPU_MEM_UNMAP:
-                    RR_COPY_ITEM(args->variant.cpu_mem_unmap);
-                    args->variant.cpu_mem_unmap.buf =
-                        g_malloc(args->variant.cpu_mem_unmap.len);
-                    rr_fcopy(args->variant.cpu_mem_unmap.buf, 1,
-                                args->variant.cpu_mem_unmap.len,
-                                oldlog, newlog);
+                    RR_SIZE_BUF_ITEM(args->variant.cpu_mem_unmap, len);
                     break;
                 case RR_CALL_MEM_REGION_CHANGE:
-                    RR_COPY_ITEM(args->variant.mem_region_change_args);
-                    args->variant.mem_region_change_args.name =
-                        g_malloc0(args->variant.mem_region_change_args.len + 1);
-                    rr_fcopy(args->variant.mem_region_change_args.name, 1,
-                            args->variant.mem_region_change_args.len,
-                            oldlog, newlog);
+                    RR_SIZE_BUF_ITEM(args->variant.mem_region_change_args, len);
                     break;
                 case RR_CALL_HD_TRANSFER:
-                    RR_COPY_ITEM(args->variant.hd_transfer_args);
+                    RR_SIZE_ITEM(args->variant.hd_transfer_args);
                     break;
                 case RR_CALL_NET_TRANSFER:
-                    RR_COPY_ITEM(args->variant.net_transfer_args);
+                    RR_SIZE_ITEM(args->variant.net_transfer_args);
                     break;
                 case RR_CALL_HANDLE_PACKET:
-                    RR_COPY_ITEM(args->variant.handle_packet_args);
-                    args->variant.handle_packet_args.buf =
-                        g_malloc(args->variant.handle_packet_args.size);
-                    rr_fcopy(args->variant.handle_packet_args.buf,
-                            args->variant.handle_packet_args.size, 1,
-                            oldlog, newlog);
+                    RR_SIZE_BUF_ITEM(args->variant.handle_packet_args, size);
                     break;
                 case RR_CALL_SERIAL_READ:
-                    RR_COPY_ITEM(args->variant.serial_read_args);
+                    RR_SIZE_ITEM(args->variant.serial_read_args);
                     break;
                 case RR_CALL_SERIAL_RECEIVE:
-                    RR_COPY_ITEM(args->variant.serial_receive_args);
+                    RR_SIZE_ITEM(args->variant.serial_receive_args);
                     break;
                 case RR_CALL_SERIAL_SEND:
-                    RR_COPY_ITEM(args->variant.serial_send_args);
+                    RR_SIZE_ITEM(args->variant.serial_send_args);
                     break;
                 case RR_CALL_SERIAL_WRITE:
-                    RR_COPY_ITEM(args->variant.serial_write_args);
+                    RR_SIZE_ITEM(args->variant.serial_write_args);
                     break;
                 default:
                     //mz unimplemented
@@ -208,18 +179,88 @@ static RR_prog_point copy_entry(void) {
         } break;
         case RR_END_OF_LOG:
             //mz nothing to read
-            //ph We don't copy RR_END_OF_LOG here; write out afterwards.
             break;
         default:
             //mz unimplemented
             sassert(0, 4);
     }
+#undef RR_SIZE_ITEM
+#undef RR_SIZE_BUF_ITEM
+
+    return avail < size ? 0 : size;
+}
+
+// Writes out the entries copied so far and reads in more of the old log
+// after the ones not yet looked at. Returns false at the end of the log.
+static bool refill_copy_buf(void) {
+    rr_fwrite(copy_buf + copy_out, 1, copy_off - copy_out, newlog);
+    memmove(copy_buf, copy_buf + copy_off, copy_len - copy_off);
+    copy_pos += copy_off;
+    copy_len -= copy_off;
+    copy_off = copy_out = 0;
+
+    if (copy_len == copy_cap) {
+        // an entry bigger than the whole buffer
+        copy_cap *= 2;
+        copy_buf = g_realloc(copy_buf, copy_cap);
+    }
+    size_t n = fread(copy_buf + copy_len, 1, copy_cap - copy_len, oldlog);
+    copy_len += n;
+    return n > 0;
+}
+
+// Starts copying the old log from position pos.
+static void seek_copy(long pos) {
+    if (!copy_buf) {
+        copy_cap = COPY_BUF_SIZE;
+        copy_buf = g_malloc(copy_cap);
+    }
+    fseek(oldlog, pos, SEEK_SET);
+    copy_pos = pos;
+    copy_len = copy_off = copy_out = 0;
+}
+
+// Copies entries to the new log, rebasing their instruction counts, until
+// one at or after end_count has been copied or the next one is past it.
+// Entries are parsed in place in a large buffer and written out in runs.
+// Returns the guest instr count (in old replay counting mode) of the last
+// entry looked at.
+static RR_prog_point copy_entries(RR_prog_point prog_point) {
+    while (prog_point.guest_instr_count < end_count && !rr_log_is_empty()) {
+        size_t size = entry_size(copy_buf + copy_off, copy_len - copy_off);
+        if (size == 0) {
+            if (!refill_copy_buf()) break;
+            continue;
+        }
+
+        uint8_t *p = copy_buf + copy_off;
+        memcpy(&prog_point.guest_instr_count, p,
+               sizeof(prog_point.guest_instr_count));
+        if (prog_point.guest_instr_count > end_count) {
+            // We don't want to copy this one.
+            break;
+        }
+
+        if (p[sizeof(prog_point.guest_instr_count)] == RR_END_OF_LOG) {
+            //ph We don't copy RR_END_OF_LOG here; write out afterwards.
+            rr_fwrite(copy_buf + copy_out, 1, copy_off - copy_out, newlog);
+            copy_out = copy_off + size;
+        } else {
+            //ph Fix up instruction count
+            uint64_t instr = prog_point.guest_instr_count - actual_start_count;
+            memcpy(p, &instr, sizeof(instr));
+        }
+        copy_off += size;
+    }
 
-    return original_prog_point;
+    rr_fwrite(copy_buf + copy_out, 1, copy_off - copy_out, newlog);
+    seek_copy(copy_pos + copy_off);
+    return prog_point;
 }
 
 static void start_snip(uint64_t count) {
-    sassert((oldlog = fopen(rr_nondet_log->name, "r")), 8);
+    // The cut replay is written uncompressed whatever the original's format.
+    sassert((oldlog = rr_zlog_fopen_read(rr_nondet_log->name, NULL)), 8);
     rr_nondet_log_type = rr_nondet_log->type;
     rr_nondet_log_size = rr_nondet_log->size;
     sassert(fread(&orig_last_prog_point, sizeof(RR_prog_point), 1, oldlog) == 1, 9);
@@ -247,12 +288,11 @@ static void start_snip(uint64_t count) {
     fwrite(&prog_point.guest_instr_count,
            sizeof(prog_point.guest_instr_count), 1, newlog);
     
-    fseek(oldlog, ftell(rr_nondet_log->fp), SEEK_SET);
-    
-    // If there are items in the queue, then start copying the log
-    // from there
+    // The replay's own file pointer belongs to the prefetch thread; bytes_read
+    // is the position of the next entry to be queued. If there are items in
+    // the queue, then start copying the log from there
     RR_log_entry *item = rr_get_queue_head();
-    if (item != NULL) fseek(oldlog, item->header.file_pos, SEEK_SET);
+    seek_copy(item != NULL ? item->header.file_pos : rr_nondet_log->bytes_read);
     
     //rw: For some reason I need to add an interrupt entry at the beginning of the log?
     RR_log_entry temp;
@@ -267,10 +307,7 @@ static void start_snip(uint64_t count) {
     fwrite(&temp.header.callsite_loc, 1, 1, newlog);
     fwrite(&temp.variant.pending_interrupts, sizeof(temp.variant.pending_interrupts), 1, newlog);
 
-    while (prog_point.guest_instr_count < end_count && !rr_log_is_empty()) {
-        prog_point = copy_entry();
-    }
-    pp_last_copied_log_entry = prog_point;
+    pp_last_copied_log_entry = copy_entries(prog_point);
     
     snipping = true;
     printf("Continuing with replay.\n");
@@ -287,10 +324,8 @@ static void end_snip(void) {
     end_count = prog_point.guest_instr_count;
     if (pp.guest_instr_count < end_count) {
         printf ("because actual end snip point differs from that requested on cmd line, we need to copy a few additional nd-log entries...\n");
-        while (pp.guest_instr_count < end_count && !rr_log_is_empty()) {
-            printf ("copied also log entry @ instr %" PRId64 "\n", pp.guest_instr_count);
-            pp = copy_entry();
-        }
+        pp = copy_entries(pp);
+        printf ("copied log entries up to instr %" PRId64 "\n", pp.guest_instr_count);
     }
     
 
@@ -311,10 +346,34 @@ static void end_snip(void) {
     fwrite(&prog_point.guest_instr_count,
             sizeof(prog_point.guest_instr_count), 1, newlog);
     fclose(newlog);
+    fclose(oldlog);
+
+    if (manifest) {
+        fprintf(manifest, "%s-%u %" PRIu64 " %" PRIu64 "\n", base_name,
+                segment, actual_start_count, end_count);
+        fflush(manifest);
+    }
 
     done = true;
 }
 
+// Selects segment i of the range, i.e. sets the counts and file names the
+// next snip will use.
+static void set_segment(uint32_t i) {
+    segment = i;
+    start_count = range_start + (range_end - range_start) / num_segments * i;
+    end_count = (i + 1 == num_segments) ? range_end :
+        range_start + (range_end - range_start) / num_segments * (i + 1);
+
+    if (num_segments > 1) {
+        snprintf(nondet_name, 128, "%s-%u-rr-nondet.log", base_name, i);
+        snprintf(snp_name, 128, "%s-%u-rr-snp", base_name, i);
+    } else {
+        snprintf(nondet_name, 128, "%s-rr-nondet.log", base_name);
+        snprintf(snp_name, 128, "%s-rr-snp", base_name);
+    }
+}
+
 
 bool request_start_snip = false;
 bool snip_started = false;
@@ -338,10 +397,29 @@ void check_end_snip(CPUState *env) {
     request_end_snip = false;
     snip_ended = true;
     end_snip();
+
+    if (segment + 1 < num_segments) {
+        // The next segment starts right where this one ended.
+        set_segment(segment + 1);
+        snipping = done = false;
+        snip_ended = false;
+        start_snip(rr_get_guest_instr_count());
+    }
 }
 
 
 int before_block_exec(CPUState *env, TranslationBlock *tb) {
+    static bool range_set = false;
+    if (!range_set) {
+        // Splitting needs the length of the replay, which is only known
+        // once it has started.
+        if (range_end == UINT64_MAX && num_segments > 1) {
+            range_end = rr_nondet_log->last_prog_point.guest_instr_count;
+        }
+        set_segment(0);
+        range_set = true;
+    }
+
     uint64_t count = rr_get_guest_instr_count();
     if (!snipping && count+tb->icount > start_count) {
         panda_exit_loop = true;
@@ -350,7 +428,7 @@ int before_block_exec(CPUState *env, TranslationBlock *tb) {
     if (snipping && !done && count > end_count) {
         panda_exit_loop = true;
         request_end_snip = true;
-        rr_end_replay_requested = 1;
+        if (segment + 1 == num_segments) rr_end_replay_requested = 1;
     }
     return 0;
 }
@@ -366,23 +444,43 @@ bool init_plugin(void *self) {
     panda_register_callback(self, PANDA_CB_TOP_LOOP, pcb);
 
 
-    start_count = 0;
-    end_count = UINT64_MAX;
+    range_start = 0;
+    range_end = UINT64_MAX;
     const char *name = "scissors";
 
     panda_arg_list *args = panda_get_args("scissors");
     if (args != NULL) {
         name = panda_parse_string_req(args, "name", "name of the scissored replay");
-        start_count = panda_parse_uint64_opt(args, "start", 0, "starting instruction count");
-        end_count = panda_parse_uint64_opt(args, "end", UINT64_MAX, "ending instruction count");
+        range_start = panda_parse_uint64_opt(args, "start", 0, "starting instruction count");
+        range_end = panda_parse_uint64_opt(args, "end", UINT64_MAX, "ending instruction count");
+        num_segments = panda_parse_uint32_opt(args, "segments", 1, "number of consecutive replays to cut the range into");
+    }
+    if (num_segments == 0) num_segments = 1;
+
+    // Plugins are loaded before the replay begins, so if the recording has
+    // keyframes it can start from the last one before the range instead of
+    // replaying everything up to it.
+    if (rr_replay_from == 0) {
+        rr_replay_from = range_start;
     }
 
-    snprintf(nondet_name, 128, "%s-rr-nondet.log", name);
-    snprintf(snp_name, 128, "%s-rr-snp", name);
+    snprintf(base_name, 128, "%s", name);
+    set_segment(0);
+
+    if (num_segments > 1) {
+        char manifest_name[160];
+        snprintf(manifest_name, sizeof(manifest_name), "%s-segments", name);
+        manifest = fopen(manifest_name, "w");
+        if (manifest == NULL) {
+            perror("scissors: can't open segment list");
+            return false;
+        }
+    }
 
     return true;
 }
 
 void uninit_plugin(void *self) {
     if (snipping && !done) end_snip();
+    if (manifest) fclose(manifest);
 }
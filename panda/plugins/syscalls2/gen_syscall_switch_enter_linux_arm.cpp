@@ -3860,7 +3860,7 @@ void syscall_enter_switch_linux_arm(CPUState *cpu, target_ptr_t pc) {
 	}
 	PPP_RUN_CB(on_all_sys_enter, cpu, pc, ctx.no);
 	PPP_RUN_CB(on_all_sys_enter2, cpu, pc, call, &ctx);
-	running_syscalls[std::make_pair(ctx.retaddr, ctx.asid)] = ctx;
+	running_syscalls_add(&ctx);
 #endif
 }
 
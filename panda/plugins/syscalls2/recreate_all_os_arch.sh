@@ -15,5 +15,5 @@ function activate_pyenv() {
 }
 
 activate_pyenv
-./syscall_parser.py --generate-info -o ./ -t linux:arm -t linux:x86 -t windows_7:x86 -t windows_xpsp2:x86 -t windows_xpsp3:x86 -t windows_2000:x86
+./syscall_parser.py --generate-info -o ./ -t linux:arm -t linux:x86 -t linux:x64 -t windows_7:x86 -t windows_xpsp2:x86 -t windows_xpsp3:x86 -t windows_2000:x86
 
@@ -43,12 +43,21 @@ KNOWN_ARCH = {
         'rt_callno_reg': 'env->regs[R_EAX]',    # register holding syscall number at runtime
         'rt_sp_reg': 'env->regs[R_ESP]',        # register holding stack pointer at runtime
         'qemu_target': 'TARGET_I386',           # qemu target name for this arch - used in guards
+        'table_driven': False,                  # decoded from syscall info instead of a generated switch
+    },
+    'x64': {
+        'bits': 64,
+        'rt_callno_reg': 'env->regs[R_EAX]',    # register holding syscall number at runtime
+        'rt_sp_reg': 'env->regs[R_ESP]',        # register holding stack pointer at runtime
+        'qemu_target': 'TARGET_X86_64',         # qemu target name for this arch - used in guards
+        'table_driven': True,                   # decoded from syscall info instead of a generated switch
     },
     'arm': {
         'bits': 32,
         'rt_callno_reg': 'env->regs[7]',        # register holding syscall number at runtime
         'rt_sp_reg': 'env->regs[13]',           # register holding stack pointer at runtime
         'qemu_target': 'TARGET_ARM',            # qemu target name for this arch - used in guards
+        'table_driven': False,                  # decoded from syscall info instead of a generated switch
     },
 }
 
@@ -101,6 +110,7 @@ class Argument(object):
             'PUNICODE_STRING', 'PVOID', 'PWSTR'
         ],
         's32': ['int', 'long', '__s32', 'LONG'],
+        'long': ['long', 'size_t', 'ssize_t', 'off_t', 'aio_context_t', 'union semun'],
         'u16': ['old_uid_t', 'uid_t', 'mode_t', 'gid_t', 'pid_t', 'USHORT'],
         'ptr': ['cap_user_data_t', 'cap_user_header_t', '__sighandler_t', '...'],
     }
@@ -147,6 +157,10 @@ class Argument(object):
             # Warn but assume it's a 32-bit argument
             logging.debug("%s not of known type, assuming 32-bit", self.raw)
             self.type = 'U32'
+
+        # long-sized integers are as wide as pointers
+        if self.arch_bits == 64 and self.type in ['U32', 'S32'] and any([re.search(r'\b%s\b' % x, self.raw) for x in Argument.types['long']]):
+            self.type = 'U64' if self.type == 'U32' else 'S64'
         #print('\t', self.type)
 
     def __repr__(self):
@@ -164,6 +178,8 @@ class Argument(object):
             return 'int32_t'
         elif self.type == 'U64':
             return 'uint64_t'
+        elif self.type == 'S64':
+            return 'int64_t'
         elif self.type == 'U16':
             return 'uint16_t'
         assert False, 'Unknown type for argument %s: %s' % (self.name, self.type)
@@ -180,7 +196,7 @@ class Argument(object):
             runtime value to it.
         '''
         ctype = self.ctype
-        ctype_bits = int(filter(str.isdigit, ctype))
+        ctype_bits = int("".join(filter(str.isdigit, ctype)))
         assert ctype_bits in [32, 64], 'Invalid number of bits for type %s' % ctype
         ctype_get = 'get_%d' % ctype_bits if ctype.startswith('uint') else 'get_s%d' % ctype_bits
         return "{0} arg{1} = {2}(cpu, {1});".format(ctype, self.no, ctype_get)
@@ -302,10 +318,13 @@ if __name__ == '__main__':
     # XXX:
     # Add some check for system calls having the same name but
     # requiring different arguments.
+    # Table-driven architectures get no per-syscall callbacks, so they are
+    # left out of the per-arch lists.
+    switch_arch = {arch: conf for arch, conf in KNOWN_ARCH.items() if not conf['table_driven']}
     global_context = {
-        'architectures': KNOWN_ARCH,
+        'architectures': switch_arch,
         'syscalls': {target: [] for target in args.target}, # per target system call list
-        'syscalls_arch': {arch: {} for arch in KNOWN_ARCH}, # per arch system call list
+        'syscalls_arch': {arch: {} for arch in switch_arch}, # per arch system call list
         'global_max_syscall_args': 0,
         'global_max_syscall_no': 0,
         'global_max_syscall_generic_no': 0,
@@ -321,7 +340,7 @@ if __name__ == '__main__':
         assert os.path.isfile(protofile_name), 'Missing prototype file %s' % protofile_name
 
         syscalls = global_context['syscalls'][_target]
-        syscalls_arch = global_context['syscalls_arch'][_arch]
+        syscalls_arch = global_context['syscalls_arch'].get(_arch, {})
         target_context = {
             'arch': _arch,
             'os': _os,
@@ -355,19 +374,21 @@ if __name__ == '__main__':
                 global_context['global_max_syscall_generic_no'], target_context['max_syscall_generic_no'])
 
         # Render per-target output files.
-        j2tpl = j2env.get_template('syscall_switch_enter.tpl')
-        with open(os.path.join(args.outdir, "%s_syscall_switch_enter_%s_%s.cpp" % (args.prefix, _os, _arch)), "wb+") as of:
-            logging.info("Writing %s", of.name)
-            of.write(j2tpl.render(target_context))
-        j2tpl = j2env.get_template('syscall_switch_return.tpl')
-        with open(os.path.join(args.outdir, "%s_syscall_switch_return_%s_%s.cpp" % (args.prefix, _os, _arch)), "wb+") as of:
-            logging.info("Writing %s", of.name)
-            of.write(j2tpl.render(target_context))
+        # Table-driven targets are decoded using their syscall info alone.
+        if not KNOWN_ARCH[_arch]['table_driven']:
+            j2tpl = j2env.get_template('syscall_switch_enter.tpl')
+            with open(os.path.join(args.outdir, "%s_syscall_switch_enter_%s_%s.cpp" % (args.prefix, _os, _arch)), "w+") as of:
+                logging.info("Writing %s", of.name)
+                of.write(j2tpl.render(target_context))
+            j2tpl = j2env.get_template('syscall_switch_return.tpl')
+            with open(os.path.join(args.outdir, "%s_syscall_switch_return_%s_%s.cpp" % (args.prefix, _os, _arch)), "w+") as of:
+                logging.info("Writing %s", of.name)
+                of.write(j2tpl.render(target_context))
 
         # Generate syscall info dynamic libraries.
-        if args.generate_info:
+        if args.generate_info or KNOWN_ARCH[_arch]['table_driven']:
             j2tpl = j2env.get_template('syscall_info.tpl')
-            with open(os.path.join(args.outdir, "%s_syscall_info_%s_%s.c" % (args.prefix, _os, _arch)), "wb+") as of:
+            with open(os.path.join(args.outdir, "%s_syscall_info_%s_%s.c" % (args.prefix, _os, _arch)), "w+") as of:
                 logging.info("Writing %s", of.name)
                 of.write(j2tpl.render(target_context))
 
@@ -375,7 +396,7 @@ if __name__ == '__main__':
     for tpl, ext in GENERATED_FILES:
         j2tpl = j2env.get_template(tpl)
         of_name = '%s_%s%s' % (args.prefix, os.path.splitext(os.path.basename(tpl))[0], ext)
-        with open(os.path.join(args.outdir, of_name), 'wb+') as of:
+        with open(os.path.join(args.outdir, of_name), 'w+') as of:
             logging.info("Writing %s", of.name)
             of.write(j2tpl.render(global_context))
 
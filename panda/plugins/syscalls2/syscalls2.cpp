@@ -23,12 +23,16 @@ PANDAENDCOMMENT */
 #include <string>
 #include <algorithm>
 #include <memory>
+#include <unordered_map>
 #include <vector>
 #include <iostream>
 
 #include "syscalls2.h"
 #include "syscalls2_info.h"
 
+extern const syscall_info_t *syscall_info;
+extern const syscall_meta_t *syscall_meta;
+
 bool translate_callback(CPUState *cpu, target_ulong pc);
 int exec_callback(CPUState *cpu, target_ulong pc);
 
@@ -55,14 +59,20 @@ target_long get_return_val_arm(CPUState *cpu);
 uint32_t get_return_32_windows_x86(CPUState *cpu, uint32_t argnum);
 uint64_t get_return_64_windows_x86(CPUState *cpu, uint32_t argnum);
 uint64_t get_64_linux_x86(CPUState *cpu, uint32_t argnum);
+uint64_t get_64_linux_x64(CPUState *cpu, uint32_t argnum);
 uint64_t get_64_linux_arm(CPUState *cpu, uint32_t argnum);
 uint64_t get_64_windows_x86(CPUState *cpu, uint32_t argnum);
 uint32_t get_32_linux_x86(CPUState *cpu, uint32_t argnum);
+uint32_t get_32_linux_x64(CPUState *cpu, uint32_t argnum);
 uint32_t get_32_linux_arm(CPUState *cpu, uint32_t argnum);
 uint32_t get_32_windows_x86(CPUState *cpu, uint32_t argnum);
 target_ulong calc_retaddr_windows_x86(CPUState *cpu, target_ulong pc);
 target_ulong calc_retaddr_linux_x86(CPUState *cpu, target_ulong pc);
+target_ulong calc_retaddr_linux_x64(CPUState *cpu, target_ulong pc);
 target_ulong calc_retaddr_linux_arm(CPUState *cpu, target_ulong pc);
+static int syscall_insn_kind(CPUState *cpu, target_ulong pc);
+void syscall_enter_table_linux_x64(CPUState *cpu, target_ulong pc);
+void syscall_return_table_linux_x64(CPUState *cpu, target_ulong pc, const syscall_ctx_t *ctx);
 
 enum ProfileType {
     PROFILE_LINUX_X86,
@@ -71,9 +81,19 @@ enum ProfileType {
     PROFILE_WINDOWS_XPSP2_X86,
     PROFILE_WINDOWS_XPSP3_X86,
     PROFILE_WINDOWS_7_X86,
+    PROFILE_LINUX_X64,
     PROFILE_LAST
 };
 
+// Kinds of system call instructions.
+enum SyscallInsn {
+    SYSCALL_INSN_NONE,
+    SYSCALL_INSN_INT,       // int 0x80 / int 0x2e
+    SYSCALL_INSN_SYSCALL,
+    SYSCALL_INSN_SYSENTER,
+    SYSCALL_INSN_SWI,       // arm
+};
+
 struct Profile {
     void         (*enter_switch)(CPUState *, target_ulong);
     void         (*return_switch)(CPUState *, target_ulong, const syscall_ctx_t *);
@@ -90,6 +110,7 @@ struct Profile {
     int          windows_return_addr_register;
     int          windows_arg_offset;
     int          syscall_interrupt_number;
+    bool         table_driven;  // decoded from the syscall info, see syscall_enter_table_*
 };
 
 Profile profiles[PROFILE_LAST] = {
@@ -109,6 +130,7 @@ Profile profiles[PROFILE_LAST] = {
         .windows_return_addr_register = -1,
         .windows_arg_offset = -1,
         .syscall_interrupt_number = 0x80,
+        .table_driven = false,
     },
     {
         .enter_switch = syscall_enter_switch_linux_arm,
@@ -126,6 +148,7 @@ Profile profiles[PROFILE_LAST] = {
         .windows_return_addr_register = -1,
         .windows_arg_offset = -1,
         .syscall_interrupt_number = 0x80,
+        .table_driven = false,
     },
     {
         .enter_switch = syscall_enter_switch_windows_2000_x86,
@@ -147,6 +170,7 @@ Profile profiles[PROFILE_LAST] = {
 #endif
         .windows_arg_offset = 0,
         .syscall_interrupt_number = 0x2E,
+        .table_driven = false,
     },
     {
         .enter_switch = syscall_enter_switch_windows_xpsp2_x86,
@@ -168,6 +192,7 @@ Profile profiles[PROFILE_LAST] = {
 #endif
         .windows_arg_offset = 8,
         .syscall_interrupt_number = 0x80,
+        .table_driven = false,
     },
     {
         .enter_switch = syscall_enter_switch_windows_xpsp3_x86,
@@ -189,6 +214,7 @@ Profile profiles[PROFILE_LAST] = {
 #endif
         .windows_arg_offset = 8,
         .syscall_interrupt_number = 0x80,
+        .table_driven = false,
     },
     {
         .enter_switch = syscall_enter_switch_windows_7_x86,
@@ -210,6 +236,25 @@ Profile profiles[PROFILE_LAST] = {
 #endif
         .windows_arg_offset = 8,
         .syscall_interrupt_number = 0x80,
+        .table_driven = false,
+    },
+    {
+        .enter_switch = syscall_enter_table_linux_x64,
+        .return_switch = syscall_return_table_linux_x64,
+        .get_return_val = get_return_val_x86,
+        .calc_retaddr = calc_retaddr_linux_x64,
+        .get_32 = get_32_linux_x64,
+        .get_s32 = get_s32_generic,
+        .get_64 = get_64_linux_x64,
+        .get_s64 = get_s64_generic,
+        .get_return_32 = get_32_linux_x64,
+        .get_return_s32 = get_return_s32_generic,
+        .get_return_64 = get_64_linux_x64,
+        .get_return_s64 = get_return_s64_generic,
+        .windows_return_addr_register = -1,
+        .windows_arg_offset = -1,
+        .syscall_interrupt_number = 0x80,
+        .table_driven = true,
     }
 };
 
@@ -255,10 +300,8 @@ target_ulong calc_retaddr_windows_x86(CPUState* cpu, target_ulong pc) {
 
 target_ulong calc_retaddr_linux_x86(CPUState* cpu, target_ulong pc) {
 #if defined(TARGET_I386)
-    unsigned char buf[2] = {};
-    panda_virtual_memory_rw(cpu, pc, buf, 2, 0);
-    // Check if the instruction is syscall (0F 05) or  sysenter (0F 34)
-    if ((buf[0]== 0x0F && buf[1] == 0x05) || (buf[0]== 0x0F && buf[1] == 0x34)) {
+    int kind = syscall_insn_kind(cpu, pc);
+    if (kind == SYSCALL_INSN_SYSCALL || kind == SYSCALL_INSN_SYSENTER) {
         // For Linux system calls using sysenter, we need to look on the stack.
         // https://reverseengineering.stackexchange.com/questions/2869/how-to-use-sysenter-under-linux
         target_ulong ret = 0x0;
@@ -268,8 +311,7 @@ target_ulong calc_retaddr_linux_x86(CPUState* cpu, target_ulong pc) {
         assert(ret != 0x0);
         return ret;
     }
-    // Check if the instruction is int 0x80 (CD 80)
-    else if (buf[0]== 0xCD && buf[1] == 0x80) {
+    else if (kind == SYSCALL_INSN_INT) {
         return pc+2;
     }
     // shouldn't happen
@@ -282,6 +324,16 @@ target_ulong calc_retaddr_linux_x86(CPUState* cpu, target_ulong pc) {
 #endif
 }
 
+target_ulong calc_retaddr_linux_x64(CPUState* cpu, target_ulong pc) {
+#if defined(TARGET_X86_64)
+    // syscall (0F 05) returns to the next instruction
+    return pc+2;
+#else
+    // shouldn't happen
+    assert (1==0);
+#endif
+}
+
 target_ulong calc_retaddr_linux_arm(CPUState* cpu, target_ulong pc) {
 #if defined(TARGET_ARM)
     // Normal syscalls: return addr is stored in LR
@@ -332,6 +384,21 @@ uint32_t get_linux_x86_argnum(CPUState *cpu, uint32_t argnum) {
     return 0;
 }
 
+#if defined(TARGET_X86_64)
+// x86_64 linux passes arguments in rdi, rsi, rdx, r10, r8 and r9
+static const int linux_x64_arg_regs[] = { R_EDI, R_ESI, R_EDX, 10, 8, 9 };
+#endif
+
+static inline uint64_t get_linux_x64_argnum(CPUState *cpu, uint32_t argnum) {
+#if defined(TARGET_X86_64)
+    CPUArchState *env = (CPUArchState*)cpu->env_ptr;
+    assert (argnum < 6);
+    return env->regs[linux_x64_arg_regs[argnum]];
+#else
+    return 0;
+#endif
+}
+
 static uint32_t get_win_syscall_arg(CPUState* cpu, int nr) {
 #if defined(TARGET_I386)
     // At sysenter on Windows7, args start at env->regs[R_EDX]+8
@@ -350,6 +417,9 @@ uint32_t get_32_linux_x86 (CPUState *cpu, uint32_t argnum) {
     assert (argnum < 6);
     return (uint32_t) get_linux_x86_argnum(cpu, argnum);
 }
+uint32_t get_32_linux_x64 (CPUState *cpu, uint32_t argnum) {
+    return (uint32_t) get_linux_x64_argnum(cpu, argnum);
+}
 uint32_t get_32_linux_arm (CPUState *cpu, uint32_t argnum) {
 #ifdef TARGET_ARM
     CPUArchState *env = (CPUArchState*)cpu->env_ptr;
@@ -368,6 +438,10 @@ uint64_t get_64_linux_x86(CPUState *cpu, uint32_t argnum) {
     return (((uint64_t) get_linux_x86_argnum(cpu, argnum)) << 32) | (get_linux_x86_argnum(cpu, argnum));
 }
 
+uint64_t get_64_linux_x64(CPUState *cpu, uint32_t argnum) {
+    return get_linux_x64_argnum(cpu, argnum);
+}
+
 uint64_t get_64_linux_arm(CPUState *cpu, uint32_t argnum) {
 #ifdef TARGET_ARM
     CPUArchState *env = (CPUArchState*)cpu->env_ptr;
@@ -467,6 +541,30 @@ void registerExecPreCallback(void (*callback)(CPUState*, target_ulong)){
  */
 context_map_t running_syscalls;
 
+/**
+ * @brief Number of entries of running_syscalls per hashed return address.
+ * A zero count lets tb_check_syscall_return skip the asid computation and
+ * the map lookup, which is the case for nearly every block executed.
+ */
+#define PENDING_RETURNS_BITS 12
+static uint32_t pending_returns[1 << PENDING_RETURNS_BITS];
+
+static inline uint32_t &pending_returns_at(target_ulong pc) {
+    return pending_returns[(pc ^ (pc >> PENDING_RETURNS_BITS)) &
+                           ((1 << PENDING_RETURNS_BITS) - 1)];
+}
+
+void running_syscalls_add(const syscall_ctx_t *ctx) {
+    auto r = running_syscalls.insert(std::make_pair(
+            std::make_pair(ctx->retaddr, ctx->asid), *ctx));
+    if (r.second) {
+        pending_returns_at(ctx->retaddr)++;
+    } else {
+        // the previous call never returned; replace it
+        r.first->second = *ctx;
+    }
+}
+
 #if defined(TARGET_PPC)
 #else
 /**
@@ -474,26 +572,81 @@ context_map_t running_syscalls;
  * matches the return address of an executing system call.
  */
 static int tb_check_syscall_return(CPUState *cpu, TranslationBlock *tb) {
-    auto k = std::make_pair(tb->pc, panda_current_asid(cpu));
-    size_t ctx_count = running_syscalls.count(k);
-    if (ctx_count > 0) {
-        assert(ctx_count == 1);
-        syscall_ctx_t &ctx = running_syscalls[k];
-        syscalls_profile->return_switch(cpu, tb->pc, &ctx);
-        running_syscalls.erase(k);
+    uint32_t &pending = pending_returns_at(tb->pc);
+    if (likely(pending == 0)) {
+        return 0;
+    }
+    auto it = running_syscalls.find(std::make_pair(tb->pc, panda_current_asid(cpu)));
+    if (it != running_syscalls.end()) {
+        syscalls_profile->return_switch(cpu, tb->pc, &it->second);
+        running_syscalls.erase(it);
+        pending--;
     }
     return 0;
 }
 #endif
 
+// Returns the info of system call no, or NULL if there is none.
+static inline const syscall_info_t *syscall_table_lookup(int no) {
+    if (syscall_meta == NULL || no < 0 || (uint32_t)no > syscall_meta->max_generic ||
+            syscall_info[no].name == NULL) {
+        return NULL;
+    }
+    return &syscall_info[no];
+}
+
+/**
+ * @brief Table-driven counterpart of the generated system call switches,
+ * used for 64-bit linux. The argument kinds and sizes come from the system
+ * call info, and the arguments are only copied into the context when an
+ * on_all_sys_enter2 or on_all_sys_return2 callback will read them. There
+ * are no per-syscall callbacks for this profile.
+ */
+void syscall_enter_table_linux_x64(CPUState *cpu, target_ulong pc) {
+#if defined(TARGET_X86_64)
+    CPUArchState *env = (CPUArchState*)cpu->env_ptr;
+    // int 0x80 and sysenter come from 32-bit processes and use the 32-bit
+    // system call numbers, which this profile doesn't describe
+    if (syscall_insn_kind(cpu, pc) != SYSCALL_INSN_SYSCALL) {
+        return;
+    }
+    syscall_ctx_t ctx;
+    ctx.no = env->regs[R_EAX];
+    ctx.asid = panda_current_asid(cpu);
+    ctx.retaddr = calc_retaddr(cpu, pc);
+    const syscall_info_t *call = syscall_table_lookup(ctx.no);
+    if (call == NULL) {
+        PPP_RUN_CB(on_unknown_sys_enter, cpu, pc, ctx.no);
+    } else if (PPP_CHECK_CB(on_all_sys_enter2) || PPP_CHECK_CB(on_all_sys_return2)) {
+        for (int i = 0; i < call->nargs; i++) {
+            uint64_t arg = env->regs[linux_x64_arg_regs[i]];
+            memcpy(ctx.args[i], &arg, call->argsz[i]);
+        }
+    }
+    PPP_RUN_CB(on_all_sys_enter, cpu, pc, ctx.no);
+    PPP_RUN_CB(on_all_sys_enter2, cpu, pc, call, &ctx);
+    running_syscalls_add(&ctx);
+#endif
+}
+
+void syscall_return_table_linux_x64(CPUState *cpu, target_ulong pc, const syscall_ctx_t *ctx) {
+#if defined(TARGET_X86_64)
+    const syscall_info_t *call = syscall_table_lookup(ctx->no);
+    if (call == NULL) {
+        PPP_RUN_CB(on_unknown_sys_return, cpu, pc, ctx->no);
+    }
+    PPP_RUN_CB(on_all_sys_return, cpu, pc, ctx->no);
+    PPP_RUN_CB(on_all_sys_return2, cpu, pc, call, ctx);
+#endif
+}
+
 #ifdef DEBUG
 static std::map<target_ulong,target_ulong> syscallCounter;
-static uint32_t impossibleToReadPCs = 0;
 #endif
 
-// Check if the instruction is sysenter (0F 34),
-// syscall (0F 05) or int 0x80 (CD 80)
-int isCurrentInstructionASyscall(CPUState *cpu, target_ulong pc) {
+// Decodes the instruction at pc. Returns its SYSCALL_INSN_* kind, or -1 if
+// it couldn't be read.
+static int decode_syscall_insn(CPUState *cpu, target_ulong pc) {
 #if defined(TARGET_I386)
     unsigned char buf[2] = {};
 
@@ -504,18 +657,18 @@ int isCurrentInstructionASyscall(CPUState *cpu, target_ulong pc) {
 
     // Check if the instruction is syscall (0F 05)
     if (buf[0]== 0x0F && buf[1] == 0x05) {
-        return true;
+        return SYSCALL_INSN_SYSCALL;
     }
     // Check if the instruction is int 0x80 (CD 80)
     else if (buf[0]== 0xCD && buf[1] == syscalls_profile->syscall_interrupt_number) {
-        return true;
+        return SYSCALL_INSN_INT;
     }
     // Check if the instruction is sysenter (0F 34)
     else if (buf[0]== 0x0F && buf[1] == 0x34) {
-        return true;
+        return SYSCALL_INSN_SYSENTER;
     }
     else {
-        return false;
+        return SYSCALL_INSN_NONE;
     }
 #elif defined(TARGET_ARM)
     unsigned char buf[4] = {};
@@ -523,40 +676,80 @@ int isCurrentInstructionASyscall(CPUState *cpu, target_ulong pc) {
     // Check for ARM mode syscall
     CPUArchState *env = (CPUArchState*)cpu->env_ptr;
     if(env->thumb == 0) {
-        panda_virtual_memory_rw(cpu, pc, buf, 4, 0);
+        if (panda_virtual_memory_rw(cpu, pc, buf, 4, 0) < 0) {
+            return -1;
+        }
         // EABI
         if ( ((buf[3] & 0x0F) ==  0x0F)  && (buf[2] == 0) && (buf[1] == 0) && (buf[0] == 0) ) {
-            return true;
+            return SYSCALL_INSN_SWI;
         }
 #if defined(CAPTURE_ARM_OABI)
         else if (((buf[3] & 0x0F) == 0x0F)  && (buf[2] == 0x90)) {  // old ABI
-            return true;
+            return SYSCALL_INSN_SWI;
         }
 #endif
     }
     else {
-        panda_virtual_memory_rw(cpu, pc, buf, 2, 0);
+        if (panda_virtual_memory_rw(cpu, pc, buf, 2, 0) < 0) {
+            return -1;
+        }
         // check for Thumb mode syscall
         if (buf[1] == 0xDF && buf[0] == 0){
-            return true;
+            return SYSCALL_INSN_SWI;
         }
     }
-    return false;
+    return SYSCALL_INSN_NONE;
 #elif defined(TARGET_PPC)
-    return false;
+    return SYSCALL_INSN_NONE;
 #endif
 }
 
-// This will only be called for instructions where the
-// translate_callback returned true
-int exec_callback(CPUState *cpu, target_ulong pc) {
-    int res = isCurrentInstructionASyscall(cpu,pc);
-#ifdef DEBUG
-    if(res < 0){
-        impossibleToReadPCs++;
+/**
+ * @brief Kinds of the system call instructions seen by translate_callback.
+ * PANDA runs every insn_exec callback for any instruction instrumented by
+ * some plugin, so exec_callback still has to tell system calls apart, and
+ * calc_retaddr needs the kind; this map gives them the answer without
+ * reading guest memory.
+ *
+ * It is keyed by the physical address of the instruction: all the TBs
+ * executing an instruction were translated from the same bytes, since
+ * writing to them invalidates the TBs, and translate_callback keeps the
+ * entry in sync whenever they are translated again.
+ */
+static std::unordered_map<hwaddr, uint8_t> syscall_insns;
+
+// Key of the instruction at pc in syscall_insns, or -1 if it's not mapped.
+static inline hwaddr syscall_insn_key(CPUState *cpu, target_ulong pc) {
+    hwaddr key = panda_virt_to_phys(cpu, pc);
+#if defined(TARGET_ARM)
+    // the same bytes decode differently in thumb mode
+    if (key != (hwaddr)-1 && ((CPUArchState*)cpu->env_ptr)->thumb) {
+        key |= 1;
     }
 #endif
-    if(res == 1){
+    return key;
+}
+
+static int syscall_insn_kind(CPUState *cpu, target_ulong pc) {
+    hwaddr key = syscall_insn_key(cpu, pc);
+    if (key == (hwaddr)-1) {
+        return decode_syscall_insn(cpu, pc);
+    }
+    auto it = syscall_insns.find(key);
+    return (it == syscall_insns.end()) ? SYSCALL_INSN_NONE : it->second;
+}
+
+// Check if the instruction is sysenter (0F 34),
+// syscall (0F 05) or int 0x80 (CD 80)
+int isCurrentInstructionASyscall(CPUState *cpu, target_ulong pc) {
+    int kind = decode_syscall_insn(cpu, pc);
+    return (kind < 0) ? -1 : (kind != SYSCALL_INSN_NONE);
+}
+
+// This will only be called for instructions where the
+// translate_callback of some plugin returned true
+int exec_callback(CPUState *cpu, target_ulong pc) {
+    if (syscall_insn_kind(cpu, pc) > SYSCALL_INSN_NONE) {
         // run any code we need to update our state
         for(const auto callback : preExecCallbacks){
             callback(cpu, pc);
@@ -570,10 +763,18 @@ int exec_callback(CPUState *cpu, target_ulong pc) {
 }
 
 bool translate_callback(CPUState* cpu, target_ulong pc){
-    return isCurrentInstructionASyscall(cpu, pc) == 1;
+    int kind = decode_syscall_insn(cpu, pc);
+    hwaddr key = syscall_insn_key(cpu, pc);
+    if (key != (hwaddr)-1) {
+        if (kind > SYSCALL_INSN_NONE) {
+            syscall_insns[key] = kind;
+        } else {
+            syscall_insns.erase(key);
+        }
+    }
+    return kind > SYSCALL_INSN_NONE;
 }
 
-
 bool init_plugin(void *self) {
 // Don't bother if we're not on a supported target
 #if defined(TARGET_I386) || defined(TARGET_ARM)
@@ -583,17 +784,24 @@ bool init_plugin(void *self) {
     }
     else if (panda_os_familyno == OS_LINUX) {
         if (panda_os_bits != 32) {
+#if defined(TARGET_X86_64)
+            std::cerr << PANDA_MSG "using profile for linux x86 64-bit" << std::endl;
+            syscalls_profile = &profiles[PROFILE_LINUX_X64];
+#else
             std::cerr << PANDA_MSG "no support for 64-bit linux" << std::endl;
             return false;
+#endif
         }
+        else {
 #if defined(TARGET_I386)
-        std::cerr << PANDA_MSG "using profile for linux x86 32-bit" << std::endl;
-        syscalls_profile = &profiles[PROFILE_LINUX_X86];
+            std::cerr << PANDA_MSG "using profile for linux x86 32-bit" << std::endl;
+            syscalls_profile = &profiles[PROFILE_LINUX_X86];
 #endif
 #if defined(TARGET_ARM)
-        std::cerr << PANDA_MSG "using profile for linux arm" << std::endl;
-        syscalls_profile = &profiles[PROFILE_LINUX_ARM];
+            std::cerr << PANDA_MSG "using profile for linux arm" << std::endl;
+            syscalls_profile = &profiles[PROFILE_LINUX_ARM];
 #endif
+        }
     }
     else if (panda_os_familyno == OS_WINDOWS) {
         if (panda_os_bits != 32) {
@@ -637,8 +845,9 @@ bool init_plugin(void *self) {
     pcb.before_block_exec = tb_check_syscall_return;
     panda_register_callback(self, PANDA_CB_BEFORE_BLOCK_EXEC, pcb);
 
-    // load system call info
-    if (panda_parse_bool_opt(plugin_args, "load-info", "Load systemcall information for the selected os.")) {
+    // load system call info, which table-driven profiles can't do without
+    if (panda_parse_bool_opt(plugin_args, "load-info", "Load systemcall information for the selected os.") ||
+            syscalls_profile->table_driven) {
         if (load_syscall_info() < 0) return false;
     }
 
@@ -660,9 +869,6 @@ void uninit_plugin(void *self) {
         std::cout << asid_count.first << "=" << asid_count.second <<", ";
     }
     std::cout<< std::endl;
-    if(impossibleToReadPCs){
-        std::cout << PANDA_MSG "DEBUG some instructions couldn't be read on insn_exec: " << impossibleToReadPCs << std::endl;
-    }
 #endif
 }
 
@@ -5,6 +5,10 @@ typedef struct syscall_ctx syscall_ctx_t;
 typedef std::map<std::pair<target_ptr_t, target_ptr_t>, syscall_ctx_t> context_map_t;
 extern context_map_t running_syscalls;
 
+// Adds ctx to running_syscalls. Its return is processed when the block at
+// ctx->retaddr next executes in ctx->asid.
+void running_syscalls_add(const syscall_ctx_t *ctx);
+
 // grep -hE '^.*syscall_(enter|return)_switch_[^(]*\(' *.cpp | sed 's/ {$/;/' >> syscalls2.h
 void syscall_enter_switch_linux_arm(CPUState *cpu, target_ptr_t pc);
 void syscall_enter_switch_linux_x86(CPUState *cpu, target_ptr_t pc);
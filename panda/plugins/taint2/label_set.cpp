@@ -1,10 +1,9 @@
-extern "C" {
-#include <sys/mman.h>
-}
-
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 
-#include <map>
+#include <algorithm>
+#include <list>
 #include <vector>
 #include <set>
 #include <unordered_set>
@@ -13,113 +12,259 @@ extern "C" {
 
 #include "label_set.h"
 
-template<typename T>
-class ArenaAlloc {
-private:
-    uint8_t *next = NULL;
-    std::vector<std::pair<uint8_t *, size_t>> blocks;
-    size_t next_block_size = 1 << 15;
-
-    void alloc_block() {
-        //printf("taint2: allocating block of size %lu\n", next_block_size);
-        next = (uint8_t *)mmap(NULL, next_block_size, PROT_READ | PROT_WRITE,
-                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        assert(next);
-        blocks.push_back(std::make_pair(next, next_block_size));
-        next_block_size <<= 1;
-    }
-
-    T *alloc_imp() {
-        assert(blocks.size() > 0);
-        std::pair<uint8_t *, size_t>& block = blocks.back();
-        if (next + sizeof(T) > block.first + block.second) {
-            alloc_block();
-            assert(next != NULL);
+// Owns every LabelSet: the hash-consing table, the memoized unions and the
+// statistics reported by label_set_stats().
+class LabelSetStore {
+  private:
+    struct SetHash {
+        size_t operator()(const LabelSet *ls) const { return ls->hash; }
+    };
+
+    struct SetEqual {
+        bool operator()(const LabelSet *a, const LabelSet *b) const {
+            return a->hash == b->hash && a->count == b->count &&
+                a->base == b->base && a->words == b->words &&
+                memcmp(a->data, b->data, data_size(a)) == 0;
+        }
+    };
+
+    typedef std::pair<LabelSetP, LabelSetP> UnionKey;
+
+    struct UnionKeyHash {
+        size_t operator()(const UnionKey &k) const {
+            return k.first->hash * 31 + k.second->hash;
+        }
+    };
+
+    struct UnionEntry {
+        LabelSetP result;
+        std::list<UnionKey>::iterator lru;
+    };
+
+    std::unordered_set<LabelSet *, SetHash, SetEqual> sets;
+
+    // Memoized unions, keyed by (min, max) pointer; lru holds the keys, most
+    // recently used first. An entry holds a reference on all three sets.
+    std::unordered_map<UnionKey, UnionEntry, UnionKeyHash> unions;
+    std::list<UnionKey> lru;
+    size_t union_cache_size = 1 << 20;
+
+    // label_set_by_id points into ids; free_ids are ids of freed sets
+    std::vector<LabelSetP> ids;
+    std::vector<uint32_t> free_ids;
+
+    // scratch space for building sets, reused to avoid allocation on lookups
+    std::vector<uint32_t> labels;
+    std::vector<uint64_t> scratch;
+
+    LabelSetStats stats = {};
+
+    static size_t data_size(const LabelSet *ls) {
+        return (ls->words ? ls->words : ls->count) * sizeof(uint32_t);
+    }
+
+    // Builds the set of the (sorted, unique) labels in scratch.
+    LabelSet *build(const std::vector<uint32_t> &l) {
+        uint32_t n = l.size();
+        uint32_t words = 0;
+        if (n > 1) {
+            uint64_t span = (uint64_t)l.back() - l.front() + 1;
+            // a bitmap only if it's smaller than the array
+            if ((span + 31) / 32 < n) words = (span + 31) / 32;
         }
+        uint32_t data_words = words ? words : n;
+        size_t bytes = sizeof(LabelSet) + data_words * sizeof(uint32_t);
+        scratch.resize((bytes + 7) / 8);
 
-        T *result = new(next) T;
-        next += sizeof(T);
+        LabelSet *ls = (LabelSet *)scratch.data();
+        ls->count = n;
+        ls->words = words;
+        ls->set_id = 0;
+        ls->refs = 0;
+        ls->marked = false;
+        if (words) {
+            ls->base = l.front();
+            memset(ls->data, 0, words * sizeof(uint32_t));
+            for (uint32_t label : l) {
+                uint32_t bit = label - ls->base;
+                ls->data[bit / 32] |= 1U << (bit % 32);
+            }
+        } else {
+            ls->base = 0;
+            if (n) memcpy(ls->data, l.data(), n * sizeof(uint32_t));
+        }
+
+        uint64_t h = ((uint64_t)ls->base << 32 | n) * 0x9e3779b97f4a7c15ULL;
+        for (uint32_t i = 0; i < data_words; i++) {
+            h = (h ^ ls->data[i]) * 0x9e3779b97f4a7c15ULL;
+            h ^= h >> 32;
+        }
+        ls->hash = h;
+        return ls;
+    }
+
+    // Returns the unique copy of the set in scratch.
+    LabelSetP intern(LabelSet *ls) {
+        auto it = sets.find(ls);
+        if (it != sets.end()) return *it;
+
+        size_t bytes = sizeof(LabelSet) + data_size(ls);
+        LabelSet *result = (LabelSet *)malloc(bytes);
+        assert(result);
+        memcpy(result, ls, bytes);
+        if (free_ids.empty()) {
+            result->set_id = ids.size();
+            ids.push_back(result);
+            label_set_by_id = ids.data();
+        } else {
+            result->set_id = free_ids.back();
+            free_ids.pop_back();
+            ids[result->set_id] = result;
+        }
+        sets.insert(result);
+        stats.set_bytes += bytes;
+        if (result->words) stats.bitmap_sets++;
         return result;
     }
 
-public:
-    ArenaAlloc() {
-        alloc_block();
+    void release(LabelSet *ls) {
+        stats.set_bytes -= sizeof(LabelSet) + data_size(ls);
+        if (ls->words) stats.bitmap_sets--;
+        ids[ls->set_id] = nullptr;
+        free_ids.push_back(ls->set_id);
+        free(ls);
     }
 
-    const T *alloc() {
-        return alloc_imp();
+    void drop_union(std::unordered_map<UnionKey, UnionEntry, UnionKeyHash>::iterator it) {
+        it->first.first->refs--;
+        it->first.second->refs--;
+        it->second.result->refs--;
+        lru.erase(it->second.lru);
+        unions.erase(it);
     }
 
-    const T *alloc(T &old) {
-        T *result = alloc_imp();
-        result->swap(old);
-        return result;
+    void evict() {
+        while (union_cache_size && unions.size() > union_cache_size) {
+            drop_union(unions.find(lru.back()));
+            stats.cache_evictions++;
+        }
     }
 
-    ~ArenaAlloc() {
-        for (auto&& block : blocks) {
-            munmap(block.first, block.second);
+  public:
+    LabelSetStore() : ids(1, nullptr) {
+        label_set_by_id = ids.data();
+    }
+
+    ~LabelSetStore() {
+        for (LabelSet *ls : sets) {
+            free(ls);
         }
     }
-};
 
-static ArenaAlloc<std::set<uint32_t>> LSA;
+    LabelSetP singleton(uint32_t label) {
+        labels.assign(1, label);
+        return intern(build(labels));
+    }
 
-namespace std {
-template<>
-class hash<set<uint32_t>> {
-  public:
-    size_t operator()(const set<uint32_t> &labels) const {
-        uint64_t result = 0;
-        for (uint32_t l : labels) {
-            result ^= l;
-            result = result << 11 | result >> 53;
+    LabelSetP set_union(LabelSetP ls1, LabelSetP ls2) {
+        stats.unions++;
+        UnionKey key(std::min(ls1, ls2), std::max(ls1, ls2));
+        auto it = unions.find(key);
+        if (it != unions.end()) {
+            stats.cache_hits++;
+            lru.splice(lru.begin(), lru, it->second.lru);
+            return it->second.result;
         }
+
+        labels.clear();
+        std::set_union(ls1->begin(), ls1->end(), ls2->begin(), ls2->end(),
+                       std::back_inserter(labels));
+        LabelSetP result = intern(build(labels));
+
+        key.first->refs++;
+        key.second->refs++;
+        result->refs++;
+        lru.push_front(key);
+        unions.insert(std::make_pair(key, UnionEntry{result, lru.begin()}));
+        evict();
         return result;
     }
-};
 
-template<>
-class hash<pair<LabelSetP, LabelSetP>> {
-  public:
-    size_t operator()(const pair<LabelSetP, LabelSetP> &labels) const {
-        return hash<LabelSetP>()(labels.first) ^
-            (hash<LabelSetP>()(labels.second) << (sizeof(LabelSetP) / 2));
+    void ref(LabelSetP ls) {
+        ls->refs++;
     }
-};
-}
 
-static std::unordered_set<std::set<uint32_t>> label_sets;
-LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
-    static std::unordered_map<std::pair<LabelSetP, LabelSetP>, LabelSetP> memoized_unions;
+    void unref(LabelSetP ls) {
+        assert(ls->refs > 0);
+        ls->refs--;
+    }
 
-    if (ls1 == ls2) {
-        return ls1;
-    } else if (ls1 && ls2) {
-        LabelSetP min = std::min(ls1, ls2);
-        LabelSetP max = std::max(ls1, ls2);
-        std::pair<LabelSetP, LabelSetP> minmax(min, max);
-
-        {
-            auto it = memoized_unions.find(minmax);
-            if (it != memoized_unions.end()) {
-                return it->second;
+    void mark(LabelSetP ls) {
+        ls->marked = true;
+    }
+
+    void set_union_cache_size(size_t entries) {
+        union_cache_size = entries;
+        evict();
+    }
+
+    size_t sweep() {
+        // forget unions involving sets that may go away, which also drops
+        // the references those unions held
+        for (auto it = unions.begin(); it != unions.end();) {
+            auto next = std::next(it);
+            if (!it->first.first->marked || !it->first.second->marked ||
+                    !it->second.result->marked) {
+                drop_union(it);
             }
+            it = next;
         }
 
-        std::set<uint32_t> temp(*min);
-        for (auto l : *max) {
-            temp.insert(l);
+        size_t freed = 0;
+        for (auto it = sets.begin(); it != sets.end();) {
+            LabelSet *ls = *it;
+            if (!ls->marked && ls->refs == 0) {
+                it = sets.erase(it);
+                release(ls);
+                freed++;
+            } else {
+                ls->marked = false;
+                ++it;
+            }
         }
+        stats.collections++;
+        stats.sets_freed += freed;
+        return freed;
+    }
 
-        // insert returns a pair <iterator, bool>; second is whether it happened
-        // first is iterator to new/existing element
-        auto it = label_sets.insert(temp).first;
-        const std::set<uint32_t> *result = &(*it);
+    size_t count() {
+        return sets.size();
+    }
 
-        memoized_unions.insert(std::make_pair(minmax, result));
-        return result;
+    LabelSetStats get_stats() {
+        LabelSetStats s = stats;
+        s.sets = sets.size();
+        // node: next pointer, value and cached hash; plus the bucket array
+        s.table_bytes = sets.size() * 3 * sizeof(void *) +
+            sets.bucket_count() * sizeof(void *);
+        s.cache_entries = unions.size();
+        s.cache_bytes = unions.size() *
+            (sizeof(std::pair<UnionKey, UnionEntry>) + 2 * sizeof(void *) +
+             sizeof(UnionKey) + 2 * sizeof(void *)) +
+            unions.bucket_count() * sizeof(void *);
+        return s;
+    }
+};
+
+LabelSetP *label_set_by_id;
+
+static LabelSetStore store;
+
+LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
+    if (ls1 == ls2) {
+        return ls1;
+    } else if (ls1 && ls2) {
+        return store.set_union(ls1, ls2);
     } else if (ls1) {
         return ls1;
     } else if (ls2) {
@@ -128,12 +273,45 @@ LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2) {
 }
 
 LabelSetP label_set_singleton(uint32_t label) {
-    std::set<uint32_t> temp;
-    temp.insert(label);
-    return LSA.alloc(temp);
+    return store.singleton(label);
+}
+
+void label_set_iter(LabelSetP ls, void (*leaf)(uint32_t, void *), void *user) {
+    if (!ls) return;
+    for (uint32_t l : *ls) {
+        leaf(l, user);
+    }
 }
 
 std::set<uint32_t> label_set_render_set(LabelSetP ls) {
-    if (ls) return *ls;
+    if (ls) return std::set<uint32_t>(ls->begin(), ls->end());
     else return std::set<uint32_t>();
 }
+
+void label_set_ref(LabelSetP ls) {
+    if (ls) store.ref(ls);
+}
+
+void label_set_unref(LabelSetP ls) {
+    if (ls) store.unref(ls);
+}
+
+void label_set_set_union_cache_size(size_t entries) {
+    store.set_union_cache_size(entries);
+}
+
+void label_set_mark(LabelSetP ls) {
+    if (ls) store.mark(ls);
+}
+
+size_t label_set_sweep() {
+    return store.sweep();
+}
+
+size_t label_set_count() {
+    return store.count();
+}
+
+LabelSetStats label_set_stats() {
+    return store.get_stats();
+}
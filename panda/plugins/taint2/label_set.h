@@ -15,17 +15,164 @@ PANDAENDCOMMENT */
 #ifndef __LABEL_SET_H_
 #define __LABEL_SET_H_
 
+#include <cstddef>
 #include <cstdint>
+#include <iterator>
 #include <set>
 
+// An immutable set of taint labels. Label sets are hash-consed: there is
+// exactly one LabelSet for any given set of labels, so sets can be compared
+// by pointer. Small or sparse sets are stored as a sorted array of labels;
+// sets drawn from a dense range of labels as a bitmap over that range.
+//
+// Iterating over a LabelSet yields its labels in increasing order, just like
+// the std::set it replaces.
+class LabelSet {
+  public:
+    class const_iterator {
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef uint32_t value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const uint32_t *pointer;
+        typedef uint32_t reference;
+
+        const_iterator(const LabelSet *set, uint32_t i) : set(set), i(i) {}
+
+        uint32_t operator*() const
+        {
+            return set->words ? set->base + i : set->data[i];
+        }
+
+        const_iterator &operator++()
+        {
+            i = set->words ? set->next_bit(i + 1) : i + 1;
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator old = *this;
+            ++*this;
+            return old;
+        }
+
+        bool operator==(const const_iterator &other) const
+        {
+            return set == other.set && i == other.i;
+        }
+
+        bool operator!=(const const_iterator &other) const
+        {
+            return !(*this == other);
+        }
+
+      private:
+        const LabelSet *set;
+        uint32_t i; // array index, or bitmap bit
+    };
+    typedef const_iterator iterator;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    const_iterator begin() const
+    {
+        return const_iterator(this, words ? next_bit(0) : 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(this, words ? words * 32 : count);
+    }
+
+    // Small integer identifying this set while it is alive; see
+    // label_set_from_id().
+    uint32_t id() const { return set_id; }
+
+  private:
+    friend class LabelSetStore;
+
+    size_t hash;
+    uint32_t set_id;
+    uint32_t count;
+    uint32_t base;  // bitmap only: label of bit 0
+    uint32_t words; // size of the bitmap in 32-bit words; 0 for an array
+    mutable uint32_t refs; // references held by the union cache and pins
+    mutable bool marked;   // reachable from shadow memory; see label_set_mark
+    uint32_t data[];
+
+    uint32_t next_bit(uint32_t i) const
+    {
+        while (i < words * 32) {
+            uint32_t w = data[i / 32] >> (i % 32);
+            if (w) return i + __builtin_ctz(w);
+            i = (i | 31) + 1;
+        }
+        return words * 32;
+    }
+};
+
 extern "C" {
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const LabelSet *LabelSetP;
 
 LabelSetP label_set_union(LabelSetP ls1, LabelSetP ls2);
 LabelSetP label_set_singleton(uint32_t label);
 }
 
+// Live label sets by id. Id 0 stands for the empty set (NULL), and ids of
+// freed sets are reused, so they stay dense enough to be stored in shadow
+// memory in place of pointers.
+extern LabelSetP *label_set_by_id;
+
+static inline uint32_t label_set_to_id(LabelSetP ls)
+{
+    return ls ? ls->id() : 0;
+}
+
+static inline LabelSetP label_set_from_id(uint32_t id)
+{
+    return label_set_by_id[id];
+}
+
 void label_set_iter(LabelSetP ls, void (*leaf)(uint32_t, void *), void *user);
 std::set<uint32_t> label_set_render_set(LabelSetP ls);
 
+// Pins ls so that label_set_sweep() never frees it, e.g. because its
+// address has been handed out as an identifier.
+void label_set_ref(LabelSetP ls);
+void label_set_unref(LabelSetP ls);
+
+// Maximum number of memoized unions; least recently used ones are dropped
+// beyond that. 0 means unlimited.
+void label_set_set_union_cache_size(size_t entries);
+
+// Garbage collection. Label sets stored in shadow memory are not reference
+// counted, as TaintData is copied around freely. Instead, the caller marks
+// every set still in use with label_set_mark() and then calls
+// label_set_sweep(), which frees the unmarked sets that aren't pinned and
+// returns how many it freed. This must only be done while no LabelSetP is
+// held outside shadow memory, i.e. between basic blocks.
+void label_set_mark(LabelSetP ls);
+size_t label_set_sweep();
+
+// Number of live label sets.
+size_t label_set_count();
+
+struct LabelSetStats {
+    uint64_t sets;           // live label sets
+    uint64_t bitmap_sets;    // ... of which are stored as bitmaps
+    uint64_t set_bytes;      // memory used by the label sets themselves
+    uint64_t table_bytes;    // approx. memory used by the hash-consing table
+    uint64_t cache_entries;  // memoized unions
+    uint64_t cache_bytes;    // approx. memory used by the union cache
+    uint64_t unions;         // label_set_union calls with two distinct sets
+    uint64_t cache_hits;
+    uint64_t cache_evictions;
+    uint64_t collections;
+    uint64_t sets_freed;
+};
+
+LabelSetStats label_set_stats();
+
 #endif
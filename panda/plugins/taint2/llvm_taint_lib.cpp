@@ -44,6 +44,7 @@ PANDAENDCOMMENT */
 #include "llvm_taint_lib.h"
 #include "taint_ops.h"
 #include "taint2.h"
+#include "taint_trace.h"
 
 extern "C" {
 #include "libgen.h"
@@ -106,6 +107,7 @@ static void taint_branch_run(Shad *shad, uint64_t src, uint64_t size)
 {
     // this arg should be the register number
     Addr a = make_laddr(src / MAXREGSIZE, 0);
+    TAINT_TRACE(TT_BRANCH, shad, NULL, NULL, src, size);
     PPP_RUN_CB(on_branch2, a, size);
 }
 
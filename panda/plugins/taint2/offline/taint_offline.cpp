@@ -0,0 +1,422 @@
+/*
+ * taint_offline.cpp
+ * Offline taint propagation from a taint op trace.
+ *
+ * Runs the taint ops recorded by taint2's trace option against fresh shadow
+ * memory, without replaying the guest. One thread reads and decodes the
+ * trace while another applies the ops, so propagation isn't held up by I/O.
+ * Label sets aren't thread safe, so there is a single propagation thread.
+ *
+ * Labels can be changed on the way in: a label map file holds lines of the
+ * form "old new", or "old -" to drop a label. With -u, labels that aren't
+ * in the map are dropped too. A dropped label is never applied.
+ *
+ * Only label sets (and taint compute numbers) are propagated; controlled bit
+ * masks need the LLVM instructions, which aren't in the trace. Bytes that
+ * taint2 detainted because of their control bits are deleted in the trace
+ * itself, so that is replayed as it happened.
+ *
+ * usage: taint_offline [-m label_map] [-u] [-b] [-d] trace
+ *   -b  print tainted branches
+ *   -d  print the tainted bytes of RAM at the end
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "shad.h"
+#include "taint_trace.h"
+
+bool track_taint_state = false;
+uint32_t max_tcn = 0;
+uint32_t max_taintset_card = 0;
+
+void taint_state_changed(Shad *shad, uint64_t addr, uint64_t size) {}
+
+struct Rec {
+    uint8_t op;
+    uint8_t shad[3];
+    uint64_t arg[TAINT_TRACE_MAX_ARGS];
+};
+
+typedef std::vector<Rec> Batch;
+
+static const size_t BATCH_SIZE = 1 << 14;
+static const size_t MAX_BATCHES = 8;
+
+// Decoded batches on their way from the reader to the propagation thread.
+// An empty batch marks the end of the trace.
+class BatchQueue {
+  public:
+    void put(Batch *b) {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return batches.size() < MAX_BATCHES; });
+        batches.push_back(b);
+        not_empty.notify_one();
+    }
+
+    Batch *get() {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return !batches.empty(); });
+        Batch *b = batches.front();
+        batches.pop_front();
+        not_full.notify_one();
+        return b;
+    }
+
+  private:
+    std::mutex mutex;
+    std::condition_variable not_full, not_empty;
+    std::deque<Batch *> batches;
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Decodes the record at p, which holds n bytes. Returns its length, or 0 if
+// it doesn't fit.
+static size_t decode(const uint8_t *p, size_t n, Rec &r) {
+    if (n < 2) return 0;
+    r.op = p[0] & 0xf;
+    r.shad[0] = p[0] >> 4;
+    r.shad[1] = p[1] & 0xf;
+    r.shad[2] = p[1] >> 4;
+    if (r.op >= TT_NUM_OPS) {
+        fprintf(stderr, "corrupt trace: opcode %u\n", r.op);
+        exit(1);
+    }
+    size_t i = 2;
+    for (unsigned a = 0; a < taint_trace_nargs[r.op]; a++) {
+        uint64_t v = 0;
+        unsigned shift = 0;
+        do {
+            if (i == n) return 0;
+            v |= (uint64_t)(p[i] & 0x7f) << shift;
+            shift += 7;
+        } while (p[i++] & 0x80);
+        r.arg[a] = v;
+    }
+    return i;
+}
+
+static void read_trace(FILE *f, BatchQueue *queue) {
+    std::vector<uint8_t> buf(1 << 22);
+    size_t len = 0;
+    Batch *batch = new Batch;
+    batch->reserve(BATCH_SIZE);
+    for (;;) {
+        size_t got = fread(buf.data() + len, 1, buf.size() - len, f);
+        if (got == 0) break;
+        len += got;
+        size_t pos = 0, used;
+        Rec r;
+        while ((used = decode(buf.data() + pos, len - pos, r))) {
+            pos += used;
+            batch->push_back(r);
+            if (batch->size() == BATCH_SIZE) {
+                queue->put(batch);
+                batch = new Batch;
+                batch->reserve(BATCH_SIZE);
+            }
+        }
+        memmove(buf.data(), buf.data() + pos, len - pos);
+        len -= pos;
+    }
+    if (len) fprintf(stderr, "trace truncated, %zu bytes left over\n", len);
+    if (!batch->empty()) queue->put(batch);
+    queue->put(new Batch);
+}
+
+static Shad *shads[TT_NUM_SHADS];
+static PagedShad *ram;
+static FastShad *llv;
+
+static std::unordered_map<uint32_t, int64_t> label_map; // -1 = drop
+static bool drop_unmapped = false;
+static bool print_branches = false;
+
+static uint64_t block_pc, block_instr;
+static uint64_t tainted_branches = 0;
+
+static uint64_t label_set_gc = 1 << 20;
+
+static TaintData mixed_labels(Shad *shad, uint64_t addr, uint64_t size,
+                              bool increment_tcn) {
+    TaintData td(shad->query_full(addr));
+    for (uint64_t i = 1; i < size; ++i) {
+        td = TaintData::make_union(td, shad->query_full(addr + i), false);
+    }
+    if (increment_tcn) td.increment_tcn();
+    return td;
+}
+
+static void bulk_set(Shad *shad, uint64_t addr, uint64_t size, TaintData td) {
+    for (uint64_t i = 0; i < size; ++i) {
+        shad->set_full(addr + i, td);
+    }
+}
+
+static void parallel_compute(Shad *shad, uint64_t dest, uint64_t src1,
+                             uint64_t src2, uint64_t size) {
+    for (uint64_t i = 0; i < size; ++i) {
+        shad->set_full(dest + i, TaintData::make_union(
+                shad->query_full(src1 + i), shad->query_full(src2 + i), true));
+    }
+}
+
+static void mix_compute(Shad *shad, uint64_t dest, uint64_t dest_size,
+                        uint64_t src1, uint64_t src2, uint64_t src_size) {
+    bulk_set(shad, dest, dest_size, TaintData::make_union(
+            mixed_labels(shad, src1, src_size, false),
+            mixed_labels(shad, src2, src_size, false), true));
+}
+
+static bool map_label(uint64_t &label) {
+    auto it = label_map.find(label);
+    if (it == label_map.end()) return !drop_unmapped;
+    if (it->second < 0) return false;
+    label = it->second;
+    return true;
+}
+
+static void print_labels(LabelSetP ls) {
+    const char *sep = "";
+    for (uint32_t l : *ls) {
+        printf("%s%u", sep, l);
+        sep = ",";
+    }
+}
+
+static void collect_label_sets() {
+    for (unsigned i = 1; i < TT_NUM_SHADS; i++) {
+        shads[i]->mark_label_sets();
+    }
+    label_set_sweep();
+}
+
+// Same as the taint op of the same name in taint_ops.cpp, minus controlled
+// bits.
+static void apply(const Rec &r) {
+    Shad *s1 = shads[r.shad[0]], *s2 = shads[r.shad[1]], *s3 = shads[r.shad[2]];
+    const uint64_t *a = r.arg;
+    switch (r.op) {
+    case TT_COPY:
+        Shad::copy(s1, a[0], s2, a[1], a[2]);
+        break;
+    case TT_PARALLEL:
+        parallel_compute(s1, a[0], a[1], a[2], a[3]);
+        break;
+    case TT_MIX:
+        bulk_set(s1, a[0], a[1], mixed_labels(s1, a[2], a[3], true));
+        break;
+    case TT_MIX_COMPUTE:
+        mix_compute(s1, a[0], a[1], a[2], a[3], a[4]);
+        break;
+    case TT_MUL_COMPUTE: {
+        bool tainted1 = false, tainted2 = false;
+        for (uint64_t i = 0; i < a[4]; ++i) {
+            tainted1 |= s1->query(a[2] + i) != NULL;
+            tainted2 |= s1->query(a[3] + i) != NULL;
+        }
+        if (!tainted1 && !tainted2) break;
+        if (!(tainted1 && tainted2)) {
+            uint64_t clean_arg = tainted1 ? a[6] : a[5];
+            if (clean_arg == 0) break;
+            if (clean_arg == 1) {
+                uint64_t size = s1->get_size();
+                if (a[0] < size && a[2] < size && a[3] < size) {
+                    parallel_compute(s1, a[0], a[2], a[3], a[4]);
+                }
+                break;
+            }
+        }
+        mix_compute(s1, a[0], a[1], a[2], a[3], a[4]);
+        break;
+    }
+    case TT_POINTER: {
+        TaintData ptr_td = mixed_labels(s2, a[1], a[2], false);
+        if (!s3) {
+            bulk_set(s1, a[0], a[4], ptr_td);
+            break;
+        }
+        for (uint64_t i = 0; i < a[4]; i++) {
+            TaintData byte_td = s3->query_full(a[3] + i);
+            TaintData dest_td = TaintData::make_union(ptr_td, byte_td, false);
+            dest_td.cb_mask = byte_td.cb_mask;
+            s1->set_full(a[0] + i, dest_td);
+        }
+        break;
+    }
+    case TT_DELETE:
+        s1->remove(a[0], a[1]);
+        break;
+    case TT_SET:
+        bulk_set(s1, a[0], a[1], s2->query_full(a[2]));
+        break;
+    case TT_SEXT:
+        Shad::copy(s1, a[0], s1, a[2], a[3]);
+        bulk_set(s1, a[0] + a[3], a[1] - a[3], s1->query_full(a[0] + a[3] - 1));
+        break;
+    case TT_LABEL:
+    case TT_LABEL_ADD: {
+        uint64_t label = a[1];
+        if (!map_label(label)) break;
+        LabelSetP ls = label_set_singleton(label);
+        if (r.op == TT_LABEL_ADD) ls = label_set_union(s1->query(a[0]), ls);
+        s1->set_full(a[0], TaintData(ls));
+        break;
+    }
+    case TT_PUSH_FRAME:
+        s1->push_frame(a[0]);
+        break;
+    case TT_POP_FRAME:
+        s1->pop_frame(a[0]);
+        break;
+    case TT_RESET_FRAME:
+        s1->reset_frame();
+        break;
+    case TT_BLOCK:
+        block_pc = a[0];
+        block_instr = a[1];
+        // between blocks, all label sets in use are in shadow memory
+        if (label_set_count() >= label_set_gc) {
+            collect_label_sets();
+            label_set_gc = std::max<uint64_t>(label_set_gc, 2 * label_set_count());
+        }
+        break;
+    case TT_BRANCH: {
+        LabelSetP ls = mixed_labels(s1, a[0], a[1], false).ls;
+        if (!ls) break;
+        tainted_branches++;
+        if (print_branches) {
+            printf("branch instr=%" PRIu64 " pc=0x%" PRIx64 " labels=",
+                   block_instr, block_pc);
+            print_labels(ls);
+            printf("\n");
+        }
+        break;
+    }
+    }
+}
+
+static void read_label_map(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long old_label;
+        char new_label[64];
+        if (sscanf(line, "%lu %63s", &old_label, new_label) != 2) continue;
+        label_map[old_label] = strcmp(new_label, "-") == 0 ?
+            -1 : (int64_t)strtoul(new_label, NULL, 0);
+    }
+    fclose(f);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-m label_map] [-u] [-b] [-d] trace\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    bool dump_ram = false;
+    int c;
+    while ((c = getopt(argc, argv, "m:ubd")) != -1) {
+        switch (c) {
+        case 'm': read_label_map(optarg); break;
+        case 'u': drop_unmapped = true; break;
+        case 'b': print_branches = true; break;
+        case 'd': dump_ram = true; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+    TaintTraceHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 ||
+            strncmp(header.magic, TAINT_TRACE_MAGIC, sizeof(header.magic)) ||
+            header.version != TAINT_TRACE_VERSION ||
+            header.num_shads != TT_NUM_SHADS) {
+        fprintf(stderr, "%s: not a taint2 trace of this version\n", argv[optind]);
+        return 1;
+    }
+
+    ram = new PagedShad("RAM", header.shad_size[TT_RAM]);
+    llv = new FastShad("LLVM", header.shad_size[TT_LLV]);
+    shads[TT_NONE] = NULL;
+    shads[TT_RAM] = ram;
+    shads[TT_LLV] = llv;
+    shads[TT_RET] = new FastShad("Ret", header.shad_size[TT_RET]);
+    shads[TT_GRV] = new FastShad("Reg", header.shad_size[TT_GRV]);
+    shads[TT_GSV] = new FastShad("CPUState", header.shad_size[TT_GSV]);
+    shads[TT_HD] = new RangeShad("HD", header.shad_size[TT_HD]);
+    shads[TT_IO] = new RangeShad("IO", header.shad_size[TT_IO]);
+
+    double start = now();
+    BatchQueue queue;
+    std::thread reader(read_trace, f, &queue);
+    uint64_t records = 0;
+    for (;;) {
+        Batch *batch = queue.get();
+        if (batch->empty()) {
+            delete batch;
+            break;
+        }
+        for (const Rec &r : *batch) {
+            apply(r);
+        }
+        records += batch->size();
+        delete batch;
+    }
+    reader.join();
+    fclose(f);
+    double elapsed = now() - start;
+
+    uint64_t tainted_ram = 0;
+    const uint64_t page = PagedShad::SHAD_PAGE_SIZE;
+    for (uint64_t addr = 0; addr < ram->get_size(); addr += page) {
+        uint64_t n = std::min(page, ram->get_size() - addr);
+        if (!ram->any_tainted(addr, n)) continue;
+        for (uint64_t i = 0; i < n; i++) {
+            LabelSetP ls = ram->query(addr + i);
+            if (!ls) continue;
+            tainted_ram++;
+            if (dump_ram) {
+                printf("ram 0x%" PRIx64 " labels=", addr + i);
+                print_labels(ls);
+                printf("\n");
+            }
+        }
+    }
+
+    fprintf(stderr, "%" PRIu64 " taint ops in %.3f s (%.1f M/s), "
+            "%" PRIu64 " tainted branches, %" PRIu64 " tainted RAM bytes, "
+            "%zu label sets\n", records, elapsed, records / elapsed / 1e6,
+            tainted_branches, tainted_ram, label_set_count());
+    return 0;
+}
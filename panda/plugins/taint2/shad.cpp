@@ -38,7 +38,7 @@ Shad::Shad(std::string name, uint64_t max_size)
 
 Shad::~Shad() = default;
 
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const LabelSet *LabelSetP;
 
 FastShad::FastShad(std::string name, uint64_t labelsets) : Shad(name, labelsets)
 {
@@ -62,6 +62,7 @@ FastShad::FastShad(std::string name, uint64_t labelsets) : Shad(name, labelsets)
 
     labels = array;
     orig_labels = array;
+    fast = true;
 }
 
 // release all memory associated with this fast_shad.
@@ -73,6 +74,85 @@ FastShad::~FastShad() {
     }
 }
 
+PagedShad::PagedShad(std::string name, uint64_t max_size) : Shad(name, max_size)
+{
+    num_pages = (max_size + SHAD_PAGE_SIZE - 1) >> SHAD_PAGE_BITS;
+    printf("taint2: Allocating paged shad (%" PRIu64 " pages of %" PRIu64
+           " bytes).\n", num_pages, (uint64_t)sizeof(Page));
+
+    // every page starts out as the zero page, which must never be written
+    zero_page = (Page *)mmap(NULL, sizeof(Page), PROT_READ,
+                             MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(zero_page != (Page *)MAP_FAILED);
+
+    pages = (Page **)malloc(num_pages * sizeof(Page *));
+    assert(pages);
+    std::fill(pages, pages + num_pages, zero_page);
+    tainted_pages = (uint64_t *)calloc((num_pages + 63) / 64, sizeof(uint64_t));
+    assert(tainted_pages);
+    allocated = 0;
+}
+
+PagedShad::~PagedShad()
+{
+    for (uint64_t pn = 0; pn < num_pages; pn++) {
+        if (pages[pn] != zero_page) free_page(pn);
+    }
+    free(tainted_pages);
+    free(pages);
+    munmap(zero_page, sizeof(Page));
+}
+
+PagedShad::Page *PagedShad::alloc_page(uint64_t pn)
+{
+    Page *page = (Page *)calloc(1, sizeof(Page));
+    assert(page);
+    pages[pn] = page;
+    allocated++;
+    return page;
+}
+
+void PagedShad::free_page(uint64_t pn)
+{
+    Page *page = pages[pn];
+    delete[] page->extra;
+    free(page);
+    pages[pn] = zero_page;
+    set_page_tainted(pn, false);
+    allocated--;
+}
+
+void PagedShad::clear(uint64_t addr, uint64_t clear_size)
+{
+    uint64_t end = addr + clear_size;
+    while (addr < end) {
+        uint64_t pn = addr >> SHAD_PAGE_BITS;
+        uint64_t page_start = pn << SHAD_PAGE_BITS;
+        uint64_t page_end = std::min(page_start + SHAD_PAGE_SIZE, end);
+        Page *page = pages[pn];
+        if (page != zero_page) {
+            if (addr == page_start && page_end == page_start + SHAD_PAGE_SIZE) {
+                free_page(pn);
+            } else {
+                for (uint64_t a = addr; a < page_end; a++) {
+                    put(a, TaintData());
+                }
+                if (page->tainted == 0 && !page->extra) free_page(pn);
+            }
+        }
+        addr = page_end;
+    }
+}
+
+uint64_t PagedShad::allocated_bytes()
+{
+    uint64_t bytes = allocated * sizeof(Page);
+    for (uint64_t pn = 0; pn < num_pages; pn++) {
+        if (pages[pn]->extra) bytes += SHAD_PAGE_SIZE * sizeof(TaintExtra);
+    }
+    return bytes;
+}
+
 LazyShad::LazyShad(std::string name, uint64_t max_size) : Shad(name, max_size)
 {
     tassert(this->size > 0);
@@ -82,3 +162,13 @@ LazyShad::LazyShad(std::string name, uint64_t max_size) : Shad(name, max_size)
 LazyShad::~LazyShad()
 {
 }
+
+RangeShad::RangeShad(std::string name, uint64_t max_size) : Shad(name, max_size)
+{
+    tassert(this->size > 0);
+    copy_by_runs = true;
+}
+
+RangeShad::~RangeShad()
+{
+}
@@ -21,6 +21,7 @@ PANDAENDCOMMENT */
 #include <cstring>
 #include <string>
 #include <map>
+#include <vector>
 
 #ifdef TAINT2_DEBUG
 #include "qemu/osdep.h"
@@ -50,6 +51,12 @@ extern uint32_t max_taintset_card;
 
 }
 
+// Whether set_full() may drop taint for exceeding one of the limits above.
+static inline bool taint_limits_active()
+{
+    return max_tcn != 0 || max_taintset_card != 0;
+}
+
 #define CPU_LOG_TAINT_OPS (1 << 28)
 
 #ifdef TAINT2_DEBUG
@@ -123,12 +130,27 @@ struct TaintData {
     }
 };
 
+// A run of bytes with the same taint, at offset from the start of a query.
+struct TaintRun {
+    uint64_t offset;
+    uint64_t size;
+    TaintData td;
+};
+
 class Shad
 {
   protected:
     uint64_t size; // Number of labelsets contained.
     std::string _name;
 
+    // Whether copy() to or from this shadow should go run by run rather
+    // than byte by byte.
+    bool copy_by_runs = false;
+
+    // Set by FastShad, so that hot paths can use its inline bulk kernels
+    // rather than going through the vtable byte by byte.
+    bool fast = false;
+
     // Determines if any of the memory locations in the range [addr ..
     // addr+size-1] are tainted.
     virtual bool range_tainted(uint64_t addr, uint64_t size) = 0;
@@ -139,6 +161,31 @@ class Shad
     // taint changes.
     virtual void set_full_quiet(uint64_t addr, TaintData td) = 0;
 
+    // Puts td on every address in [addr .. addr+size-1], quietly.
+    virtual void set_range_quiet(uint64_t addr, uint64_t size, TaintData td)
+    {
+        for (uint64_t i = 0; i < size; i++) {
+            set_full_quiet(addr + i, td);
+        }
+    }
+
+    // Appends the runs of [addr .. addr+size-1] that carry any TaintData
+    // other than the default one to runs.
+    virtual void query_runs(uint64_t addr, uint64_t size,
+                            std::vector<TaintRun> &runs)
+    {
+        for (uint64_t i = 0; i < size; i++) {
+            TaintData td = query_full(addr + i);
+            if (td == TaintData()) continue;
+            if (!runs.empty() && runs.back().td == td &&
+                    runs.back().offset + runs.back().size == i) {
+                runs.back().size++;
+            } else {
+                runs.push_back(TaintRun{i, 1, td});
+            }
+        }
+    }
+
   public:
     Shad(std::string name, uint64_t max_size);
 
@@ -150,29 +197,8 @@ class Shad
 
     virtual void label(uint64_t addr, LabelSetP ls) = 0;
 
-    static void copy(Shad *shad_dest, uint64_t dest, Shad *shad_src,
-                     uint64_t src, uint64_t size)
-    {
-        tassert(dest + size >= dest);
-        tassert(src + size >= src);
-        tassert(dest + size <= shad_dest->size);
-        tassert(src + size <= shad_src->size);
-
-        bool change = false;
-        if (track_taint_state && (shad_dest->range_tainted(dest, size) ||
-                    shad_src->range_tainted(src, size)))
-            change = true;
-
-        for (uint64_t i = 0; i < size; i++) {
-            auto td = shad_src->query_full(src + i);
-
-            // don't report taint changes when store the taint data, as it is
-            // already taken care of for all bytes below
-            shad_dest->set_full_quiet(dest + i, td);
-        }
-
-        if (change) taint_state_changed(shad_dest, dest, size);
-    }
+    static inline void copy(Shad *shad_dest, uint64_t dest, Shad *shad_src,
+                            uint64_t src, uint64_t size);
 
     virtual void remove(uint64_t addr, uint64_t remove_size) = 0;
 
@@ -191,6 +217,22 @@ class Shad
 
     virtual uint32_t query_tcn(uint64_t addr) = 0;
 
+    // Appends the runs of [addr .. addr+size-1] that carry taint to runs,
+    // with offsets relative to addr.
+    void query_range(uint64_t addr, uint64_t size, std::vector<TaintRun> &runs)
+    {
+        tassert(addr + size <= this->size);
+        query_runs(addr, size, runs);
+    }
+
+    // Marks every label set stored in this shadow, for label_set_sweep().
+    virtual void mark_label_sets() = 0;
+
+    bool is_fast()
+    {
+        return fast;
+    }
+
     const char *name()
     {
         return _name.c_str();
@@ -205,37 +247,156 @@ class FastShad : public Shad
     TaintData *labels;
     TaintData *orig_labels;
 
+    // Number of bytes with a label set, kept up to date only once
+    // count_tainted() has been called.
+    bool counting = false;
+    uint64_t tainted = 0;
+
     TaintData *get_td_p(uint64_t guest_addr)
     {
         tassert(guest_addr < size);
         return &labels[guest_addr];
     }
 
+    uint64_t count_range(uint64_t addr, uint64_t range_size)
+    {
+        const TaintData *td = labels + addr;
+        uint64_t n = 0;
+        for (uint64_t i = 0; i < range_size; i++) {
+            n += td[i].ls != NULL;
+        }
+        return n;
+    }
+
+    // Accounts for td replacing the taint at addr.
+    void count(uint64_t addr, const TaintData &td)
+    {
+        if (counting) {
+            tainted += (td.ls != NULL);
+            tainted -= (labels[addr].ls != NULL);
+        }
+    }
+
+    void count_fill(uint64_t addr, uint64_t range_size, const TaintData &td)
+    {
+        if (counting) {
+            tainted -= count_range(addr, range_size);
+            if (td.ls) tainted += range_size;
+        }
+    }
+
   protected:
     bool range_tainted(uint64_t addr, uint64_t size) override
     {
-        for (unsigned i = addr; i < addr + size; i++) {
-            if (get_td_p(i)->ls)
-                return true;
-        }
-        return false;
+        return any_tainted(addr, size);
     }
 
     // Set taint quietly - ie. no taint change report is made.
     void set_full_quiet(uint64_t addr, TaintData td) override
     {
         tassert(addr < size);
+        count(addr, td);
         labels[addr] = td;
     }
 
+    void set_range_quiet(uint64_t addr, uint64_t range_size,
+                         TaintData td) override
+    {
+        tassert(addr + range_size <= size);
+        count_fill(addr, range_size, td);
+        std::fill(labels + addr, labels + addr + range_size, td);
+    }
+
+    void query_runs(uint64_t addr, uint64_t range_size,
+                    std::vector<TaintRun> &runs) override
+    {
+        tassert(addr + range_size <= size);
+        for (uint64_t i = 0; i < range_size; i++) {
+            const TaintData &td = labels[addr + i];
+            if (td == TaintData()) continue;
+            if (!runs.empty() && runs.back().td == td &&
+                    runs.back().offset + runs.back().size == i) {
+                runs.back().size++;
+            } else {
+                runs.push_back(TaintRun{i, 1, td});
+            }
+        }
+    }
+
   public:
     FastShad(std::string name, uint64_t size);
     ~FastShad();
 
+    // Starts keeping count of the tainted bytes, so that tainted_bytes()
+    // is O(1). Not for shadows with frames.
+    void count_tainted()
+    {
+        counting = true;
+        tainted = count_range(0, size);
+    }
+
+    uint64_t tainted_bytes()
+    {
+        tassert(counting);
+        return tainted;
+    }
+
+    // Bulk kernels, for callers that know both sides are FastShads. These
+    // skip the vtable and work on whole ranges; set_range() doesn't apply
+    // max_tcn or max_taintset_card, so it must only be used when those are
+    // off (see taint_limits_active()).
+
+    // Whether any byte in the range has a label set. There's no early exit,
+    // so that the compiler can vectorize the loop.
+    bool any_tainted(uint64_t addr, uint64_t range_size)
+    {
+        tassert(addr + range_size <= size);
+        const TaintData *td = labels + addr;
+        uintptr_t any = 0;
+        for (uint64_t i = 0; i < range_size; i++) {
+            any |= (uintptr_t)td[i].ls;
+        }
+        return any != 0;
+    }
+
+    void set_range(uint64_t addr, uint64_t range_size, TaintData td)
+    {
+        tassert(addr + range_size <= size);
+        count_fill(addr, range_size, td);
+        TaintData *dest = labels + addr;
+        bool change = false;
+        for (uint64_t i = 0; i < range_size; i++) {
+            change |= !(dest[i] == td);
+            dest[i] = td;
+        }
+        if (change) taint_state_changed(this, addr, range_size);
+    }
+
+    static void copy_range(FastShad *shad_dest, uint64_t dest,
+                           FastShad *shad_src, uint64_t src, uint64_t size)
+    {
+        tassert(dest + size <= shad_dest->size);
+        tassert(src + size <= shad_src->size);
+
+        bool change = track_taint_state &&
+            (shad_dest->any_tainted(dest, size) ||
+             shad_src->any_tainted(src, size));
+        if (shad_dest->counting) {
+            shad_dest->tainted -= shad_dest->count_range(dest, size);
+        }
+        memmove(shad_dest->labels + dest, shad_src->labels + src,
+                size * sizeof(TaintData));
+        if (shad_dest->counting) {
+            shad_dest->tainted += shad_dest->count_range(dest, size);
+        }
+        if (change) taint_state_changed(shad_dest, dest, size);
+    }
+
     // Taint an address with a labelset.
     void label(uint64_t addr, LabelSetP ls) override
     {
         taint_log("LABEL: %s[%lx] (%p)\n", name(), addr, ls);
+        count(addr, TaintData(ls));
         *get_td_p(addr) = TaintData(ls);
     }
 
@@ -248,6 +409,7 @@ class FastShad : public Shad
         bool change = false;
         if (track_taint_state && range_tainted(addr, remove_size))
             change = true;
+        count_fill(addr, remove_size, TaintData());
         memset(get_td_p(addr), 0, remove_size * sizeof(TaintData));
 
         if (change)
@@ -294,6 +456,7 @@ class FastShad : public Shad
             ((max_taintset_card == 0) || (newcard <= max_taintset_card)))
         {
             bool change = !(td == *get_td_p(addr));
+            count(addr, td);
             labels[addr] = td;
             
             if (change) taint_state_changed(this, addr, 1);
@@ -314,6 +477,330 @@ class FastShad : public Shad
     {
         return (query_full(addr)).tcn;
     }
+
+    void mark_label_sets() override
+    {
+        // all frames, not just the current one
+        for (uint64_t i = 0; i < size; i++) {
+            label_set_mark(orig_labels[i].ls);
+        }
+    }
+};
+
+inline void Shad::copy(Shad *shad_dest, uint64_t dest, Shad *shad_src,
+                       uint64_t src, uint64_t size)
+{
+    tassert(dest + size >= dest);
+    tassert(src + size >= src);
+    tassert(dest + size <= shad_dest->size);
+    tassert(src + size <= shad_src->size);
+
+    if (shad_dest->fast && shad_src->fast) {
+        FastShad::copy_range(static_cast<FastShad *>(shad_dest), dest,
+                             static_cast<FastShad *>(shad_src), src, size);
+        return;
+    }
+
+    bool change = false;
+    if (track_taint_state && (shad_dest->range_tainted(dest, size) ||
+                shad_src->range_tainted(src, size)))
+        change = true;
+
+    // don't report taint changes when store the taint data, as it is
+    // already taken care of for all bytes below
+    if (shad_dest->copy_by_runs || shad_src->copy_by_runs) {
+        std::vector<TaintRun> runs;
+        shad_src->query_runs(src, size, runs);
+        shad_dest->set_range_quiet(dest, size, TaintData());
+        for (auto &run : runs) {
+            shad_dest->set_range_quiet(dest + run.offset, run.size, run.td);
+        }
+    } else {
+        for (uint64_t i = 0; i < size; i++) {
+            auto td = shad_src->query_full(src + i);
+            shad_dest->set_full_quiet(dest + i, td);
+        }
+    }
+
+    if (change) taint_state_changed(shad_dest, dest, size);
+}
+
+// A sparse shadow for guest RAM. Taint is kept in pages that are only
+// allocated when something on them gets tainted; untouched pages all map to
+// one read-only page of zeros. Each byte is a 32-bit label set id rather than
+// a whole TaintData. The taint compute number and masks live in a side
+// table, allocated per page only once some byte on it differs from the
+// defaults for its label set. A bitmap of pages holding any label set lets
+// range_tainted() and remove() skip clean pages.
+class PagedShad : public Shad
+{
+  public:
+    static const unsigned SHAD_PAGE_BITS = 12;
+    static const uint64_t SHAD_PAGE_SIZE = 1 << SHAD_PAGE_BITS;
+
+  private:
+    struct TaintExtra {
+        uint32_t tcn;
+        uint8_t cb_mask;
+        uint8_t one_mask;
+        uint8_t zero_mask;
+    };
+
+    struct Page {
+        uint32_t ids[SHAD_PAGE_SIZE];
+        TaintExtra *extra; // NULL while all bytes have the default extras
+        uint32_t tainted;  // number of bytes with a label set
+    };
+
+    uint64_t num_pages;
+    Page **pages;
+    Page *zero_page;
+    uint64_t *tainted_pages; // bitmap
+    uint64_t allocated;      // number of pages that aren't zero_page
+
+    // TaintData(ls) is what label() stores, so that's the default.
+    static TaintExtra default_extra(uint32_t id)
+    {
+        return TaintExtra{0, (uint8_t)(id ? 0xFF : 0), 0, 0};
+    }
+
+    static bool is_default(const TaintData &td)
+    {
+        return td.tcn == 0 && td.cb_mask == (td.ls ? 0xFF : 0) &&
+            td.one_mask == 0 && td.zero_mask == 0;
+    }
+
+    bool page_tainted(uint64_t pn)
+    {
+        return tainted_pages[pn / 64] & (1ULL << (pn % 64));
+    }
+
+    void set_page_tainted(uint64_t pn, bool tainted)
+    {
+        if (tainted) {
+            tainted_pages[pn / 64] |= 1ULL << (pn % 64);
+        } else {
+            tainted_pages[pn / 64] &= ~(1ULL << (pn % 64));
+        }
+    }
+
+    Page *alloc_page(uint64_t pn);
+    void free_page(uint64_t pn);
+
+    TaintData get(uint64_t addr)
+    {
+        tassert(addr < size);
+        Page *page = pages[addr >> SHAD_PAGE_BITS];
+        uint64_t off = addr & (SHAD_PAGE_SIZE - 1);
+        TaintData td;
+        td.ls = label_set_from_id(page->ids[off]);
+        if (page->extra) {
+            const TaintExtra &e = page->extra[off];
+            td.tcn = e.tcn;
+            td.cb_mask = e.cb_mask;
+            td.one_mask = e.one_mask;
+            td.zero_mask = e.zero_mask;
+        } else if (td.ls) {
+            td.cb_mask = 0xFF;
+        }
+        return td;
+    }
+
+    void put(uint64_t addr, const TaintData &td)
+    {
+        tassert(addr < size);
+        uint64_t pn = addr >> SHAD_PAGE_BITS;
+        uint64_t off = addr & (SHAD_PAGE_SIZE - 1);
+        uint32_t id = label_set_to_id(td.ls);
+        bool dflt = is_default(td);
+
+        Page *page = pages[pn];
+        if (page == zero_page) {
+            if (id == 0 && dflt) return;
+            page = alloc_page(pn);
+        }
+
+        uint32_t &slot = page->ids[off];
+        if (slot && !id) {
+            if (--page->tainted == 0) set_page_tainted(pn, false);
+        } else if (!slot && id) {
+            if (page->tainted++ == 0) set_page_tainted(pn, true);
+        }
+        slot = id;
+
+        if (!page->extra && !dflt) {
+            page->extra = new TaintExtra[SHAD_PAGE_SIZE];
+            for (uint64_t i = 0; i < SHAD_PAGE_SIZE; i++) {
+                page->extra[i] = default_extra(page->ids[i]);
+            }
+        }
+        if (page->extra) {
+            page->extra[off] = TaintExtra{td.tcn, td.cb_mask, td.one_mask,
+                                          td.zero_mask};
+        }
+    }
+
+    // Puts the default TaintData on the range, dropping whole pages.
+    void clear(uint64_t addr, uint64_t clear_size);
+
+  protected:
+    bool range_tainted(uint64_t addr, uint64_t range_size) override
+    {
+        uint64_t end = addr + range_size;
+        while (addr < end) {
+            uint64_t pn = addr >> SHAD_PAGE_BITS;
+            uint64_t page_end = std::min((pn + 1) << SHAD_PAGE_BITS, end);
+            if (page_tainted(pn)) {
+                Page *page = pages[pn];
+                for (uint64_t a = addr; a < page_end; a++) {
+                    if (page->ids[a & (SHAD_PAGE_SIZE - 1)]) return true;
+                }
+            }
+            addr = page_end;
+        }
+        return false;
+    }
+
+    void set_full_quiet(uint64_t addr, TaintData td) override
+    {
+        put(addr, td);
+    }
+
+    void set_range_quiet(uint64_t addr, uint64_t range_size,
+                         TaintData td) override
+    {
+        if (td == TaintData()) {
+            clear(addr, range_size);
+            return;
+        }
+        for (uint64_t i = 0; i < range_size; i++) {
+            put(addr + i, td);
+        }
+    }
+
+    void query_runs(uint64_t addr, uint64_t range_size,
+                    std::vector<TaintRun> &runs) override
+    {
+        uint64_t end = addr + range_size;
+        for (uint64_t a = addr; a < end;) {
+            uint64_t pn = a >> SHAD_PAGE_BITS;
+            uint64_t page_end = std::min((pn + 1) << SHAD_PAGE_BITS, end);
+            if (pages[pn] == zero_page) {
+                a = page_end;
+                continue;
+            }
+            for (; a < page_end; a++) {
+                TaintData td = get(a);
+                if (td == TaintData()) continue;
+                uint64_t i = a - addr;
+                if (!runs.empty() && runs.back().td == td &&
+                        runs.back().offset + runs.back().size == i) {
+                    runs.back().size++;
+                } else {
+                    runs.push_back(TaintRun{i, 1, td});
+                }
+            }
+        }
+    }
+
+  public:
+    PagedShad(std::string name, uint64_t size);
+    ~PagedShad();
+
+    // Whether any byte in the range has a label set; clean pages cost a
+    // bitmap lookup.
+    bool any_tainted(uint64_t addr, uint64_t range_size)
+    {
+        return range_tainted(addr, range_size);
+    }
+
+    void label(uint64_t addr, LabelSetP ls) override
+    {
+        taint_log("LABEL: %s[%lx] (%p)\n", name(), addr, ls);
+        put(addr, TaintData(ls));
+    }
+
+    void remove(uint64_t addr, uint64_t remove_size) override
+    {
+        tassert(addr + remove_size >= addr);
+        tassert(addr + remove_size <= size);
+
+        bool change = false;
+        if (track_taint_state && range_tainted(addr, remove_size))
+            change = true;
+        clear(addr, remove_size);
+
+        if (change)
+            taint_state_changed(this, addr, remove_size);
+    }
+
+    LabelSetP query(uint64_t addr) override
+    {
+        tassert(addr < size);
+        Page *page = pages[addr >> SHAD_PAGE_BITS];
+        return label_set_from_id(page->ids[addr & (SHAD_PAGE_SIZE - 1)]);
+    }
+
+    void reset_frame() override
+    {
+    }
+
+    void push_frame(uint64_t framesize) override
+    {
+    }
+
+    void pop_frame(uint64_t framesize) override
+    {
+    }
+
+    TaintData query_full(uint64_t addr) override
+    {
+        return get(addr);
+    }
+
+    void set_full(uint64_t addr, TaintData td) override
+    {
+        tassert(addr < size);
+
+        uint32_t newcard = 0;
+        if (td.ls != NULL) newcard = td.ls->size();
+        if (((max_tcn == 0) || (td.tcn <= max_tcn)) &&
+            ((max_taintset_card == 0) || (newcard <= max_taintset_card)))
+        {
+            bool change = !(td == get(addr));
+            put(addr, td);
+
+            if (change) taint_state_changed(this, addr, 1);
+        }
+        else
+        {
+            // delete taint, if there is any, as things have gone too far
+            if (range_tainted(addr, 1))
+            {
+                // remove will take care of taint_state_changed, unless they
+                // don't care to be informed of removals
+                remove(addr, 1);
+            }
+        }
+    }
+
+    uint32_t query_tcn(uint64_t addr) override
+    {
+        return get(addr).tcn;
+    }
+
+    void mark_label_sets() override
+    {
+        for (uint64_t pn = 0; pn < num_pages; pn++) {
+            if (!page_tainted(pn)) continue;
+            for (uint32_t id : pages[pn]->ids) {
+                if (id) label_set_mark(label_set_from_id(id));
+            }
+        }
+    }
+
+    // Memory used by allocated pages and their side tables, in bytes.
+    uint64_t allocated_bytes();
 };
 
 class LazyShad : public Shad
@@ -339,6 +826,22 @@ class LazyShad : public Shad
         labels[addr] = td;
     }
 
+    void query_runs(uint64_t addr, uint64_t range_size,
+                    std::vector<TaintRun> &runs) override
+    {
+        for (auto it = labels.lower_bound(addr);
+             it != labels.end() && it->first < addr + range_size; it++) {
+            if (it->second == TaintData()) continue;
+            uint64_t i = it->first - addr;
+            if (!runs.empty() && runs.back().td == it->second &&
+                    runs.back().offset + runs.back().size == i) {
+                runs.back().size++;
+            } else {
+                runs.push_back(TaintRun{i, 1, it->second});
+            }
+        }
+    }
+
   public:
     LazyShad(std::string name, uint64_t size);
     ~LazyShad();
@@ -422,6 +925,192 @@ class LazyShad : public Shad
     void pop_frame(uint64_t framesize) override
     {
     }
+
+    void mark_label_sets() override
+    {
+        for (auto &it : labels) {
+            label_set_mark(it.second.ls);
+        }
+    }
+};
+
+// A shadow for large address spaces that are tainted in big contiguous
+// chunks, like the hard drive and I/O buffers. Runs of identical TaintData
+// are stored as extents, so copying, removing or querying taint on a range
+// costs O(extents) rather than O(bytes).
+class RangeShad : public Shad
+{
+  private:
+    struct Extent {
+        uint64_t end; // exclusive
+        TaintData td;
+    };
+
+    // Non-overlapping extents, keyed by start address. Bytes with the
+    // default TaintData aren't stored.
+    std::map<uint64_t, Extent> extents;
+
+    typedef std::map<uint64_t, Extent>::iterator extent_iter;
+
+    // The first extent ending after addr.
+    extent_iter find(uint64_t addr)
+    {
+        auto it = extents.upper_bound(addr);
+        if (it != extents.begin() && std::prev(it)->second.end > addr) {
+            return std::prev(it);
+        }
+        return it;
+    }
+
+    // Splits the extent containing addr, if any, so that one starts at addr.
+    // Returns the first extent starting at or after addr.
+    extent_iter split(uint64_t addr)
+    {
+        auto it = find(addr);
+        if (it != extents.end() && it->first < addr) {
+            Extent tail = it->second;
+            it->second.end = addr;
+            return extents.emplace_hint(std::next(it), addr, tail);
+        }
+        return it;
+    }
+
+  protected:
+    bool range_tainted(uint64_t addr, uint64_t size) override
+    {
+        for (auto it = find(addr);
+             it != extents.end() && it->first < addr + size; it++) {
+            if (it->second.td.ls) return true;
+        }
+        return false;
+    }
+
+    void set_full_quiet(uint64_t addr, TaintData td) override
+    {
+        set_range_quiet(addr, 1, td);
+    }
+
+    void set_range_quiet(uint64_t addr, uint64_t range_size,
+                         TaintData td) override
+    {
+        if (range_size == 0) return;
+        uint64_t start = addr, end = addr + range_size;
+        auto first = split(start);
+        auto next = split(end);
+        extents.erase(first, next);
+        if (td == TaintData()) return;
+
+        // merge with neighbors carrying the same taint
+        if (next != extents.end() && next->first == end &&
+                next->second.td == td) {
+            end = next->second.end;
+            next = extents.erase(next);
+        }
+        if (next != extents.begin()) {
+            auto prev = std::prev(next);
+            if (prev->second.end == start && prev->second.td == td) {
+                prev->second.end = end;
+                return;
+            }
+        }
+        extents.emplace_hint(next, start, Extent{end, td});
+    }
+
+    void query_runs(uint64_t addr, uint64_t range_size,
+                    std::vector<TaintRun> &runs) override
+    {
+        uint64_t end = addr + range_size;
+        for (auto it = find(addr); it != extents.end() && it->first < end;
+             it++) {
+            uint64_t run_start = std::max(it->first, addr);
+            uint64_t run_end = std::min(it->second.end, end);
+            runs.push_back(TaintRun{run_start - addr, run_end - run_start,
+                                    it->second.td});
+        }
+    }
+
+  public:
+    RangeShad(std::string name, uint64_t size);
+    ~RangeShad();
+
+    void label(uint64_t addr, LabelSetP ls) override
+    {
+        taint_log("LABEL: %s[%lx] (%p)\n", name(), addr, ls);
+        set_range_quiet(addr, 1, TaintData(ls));
+    }
+
+    void remove(uint64_t addr, uint64_t remove_size) override
+    {
+        bool change = false;
+        if (track_taint_state && range_tainted(addr, remove_size)) {
+            change = true;
+        }
+        set_range_quiet(addr, remove_size, TaintData());
+
+        if (change) {
+            taint_state_changed(this, addr, remove_size);
+        }
+    }
+
+    LabelSetP query(uint64_t addr) override
+    {
+        return query_full(addr).ls;
+    }
+
+    TaintData query_full(uint64_t addr) override
+    {
+        auto it = find(addr);
+        if (it == extents.end() || it->first > addr) {
+            return TaintData();
+        }
+        return it->second.td;
+    }
+
+    void set_full(uint64_t addr, TaintData td) override
+    {
+        uint32_t newcard = 0;
+        if (td.ls != NULL) newcard = td.ls->size();
+        if (((max_tcn == 0) || (td.tcn <= max_tcn)) &&
+            ((max_taintset_card == 0) || (newcard <= max_taintset_card)))
+        {
+            bool change = !(td == query_full(addr));
+            set_range_quiet(addr, 1, td);
+
+            if (change) taint_state_changed(this, addr, 1);
+        }
+        else
+        {
+            // delete taint, if there is any, as things have gone too far
+            if (range_tainted(addr, 1))
+            {
+                remove(addr, 1);
+            }
+        }
+    }
+
+    uint32_t query_tcn(uint64_t addr) override
+    {
+        return (query_full(addr)).tcn;
+    }
+
+    void reset_frame() override
+    {
+    }
+
+    void push_frame(uint64_t framesize) override
+    {
+    }
+
+    void pop_frame(uint64_t framesize) override
+    {
+    }
+
+    void mark_label_sets() override
+    {
+        for (auto &it : extents) {
+            label_set_mark(it.second.td.ls);
+        }
+    }
 };
 
 #endif
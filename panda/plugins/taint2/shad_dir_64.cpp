@@ -32,7 +32,7 @@ PANDAENDCOMMENT */
 
 #include "shad_dir_64.h"
 
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const LabelSet *LabelSetP;
 
 // 64-bit addresses
 // create a new table
@@ -34,10 +34,13 @@
 #undef NDEBUG
 #endif
 
+#include <algorithm>
 #include <iostream>
+#include <vector>
 
 #include "panda/plugin.h"
 #include "panda/tcg-llvm.h"
+#include "panda/rr/rr_log.h"
 
 #include <llvm/PassManager.h>
 #include <llvm/PassRegistry.h>
@@ -54,6 +57,8 @@
 #include "label_set.h"
 #include "taint_api.h"
 #include "taint2_hypercalls.h"
+#include "taint_cache.h"
+#include "taint_trace.h"
 
 extern "C" {
 #include "callstack_instr/callstack_instr.h"
@@ -75,6 +80,8 @@ int on_replay_before_dma(CPUState *cpu, uint32_t is_write, uint8_t *src_addr, ui
 void taint_state_changed(Shad *, uint64_t, uint64_t);
 PPP_PROT_REG_CB(on_taint_change);
 PPP_CB_BOILERPLATE(on_taint_change);
+PPP_PROT_REG_CB(on_taint_change_batch);
+PPP_CB_BOILERPLATE(on_taint_change_batch);
 
 bool track_taint_state = false;
 uint32_t max_tcn = 0;          // ie disabled
@@ -111,16 +118,61 @@ extern bool inline_taint;
 bool debug_taint = false;
 bool detaint_cb0_bytes = false;
 
+// Collect unused label sets once there are this many (0 = never)
+static uint32_t label_set_gc = 1 << 20;
+static uint64_t next_label_set_gc;
+
+// Run blocks from their TCG translation while no taint can reach them.
+static bool dual_exec = false;
+// A block run natively was stopped before touching tainted RAM, so the next
+// one, which picks up from there, must run under LLVM.
+static bool force_llvm_block = false;
+static uint64_t native_blocks = 0;
+static uint64_t llvm_blocks = 0;
+static uint64_t native_blocks_stopped = 0;
+
+// Taint changes not yet delivered to on_taint_change_batch; flushed before
+// every block and whenever the queue fills up.
+#define TAINT_CHANGE_QUEUE_SIZE 4096
+static std::vector<TaintChange> taint_changes;
+// where the last queued change ends, to merge the next one into it
+static Shad *last_change_shad = nullptr;
+static uint64_t last_change_end;
+
+// Where to write the taint op trace (empty = no trace)
+static std::string trace_path;
+
+// Instrumented helpers saved across runs (nullptr = no cache)
+static TaintCache *taint_cache = nullptr;
+
+/*
+ * A block running natively doesn't propagate taint, so it must not touch
+ * any. Its registers were clean when it started, and it stops right before
+ * accessing tainted RAM; the rest of it then runs under LLVM.
+ */
+static void check_native_access(target_ulong addr, target_ulong size) {
+    if (!dual_exec || !taintEnabled || execute_llvm) return;
+    uint64_t shad_size = shadow->ram.get_size();
+    if (addr >= shad_size) return;
+    if (shadow->ram.any_tainted(addr, std::min<uint64_t>(size, shad_size - addr))) {
+        force_llvm_block = true;
+        native_blocks_stopped++;
+        panda_retry_mem_access();
+    }
+}
+
 /*
  * These memory callbacks are only for whole-system mode.  User-mode memory
  * accesses are captured by IR instrumentation.
  */
 int phys_mem_write_callback(CPUState *cpu, target_ulong pc, target_ulong addr, target_ulong size, void *buf) {
+    check_native_access(addr, size);
     taint_memlog_push(&taint_memlog, addr);
     return 0;
 }
 
 int phys_mem_read_callback(CPUState *cpu, target_ulong pc, target_ulong addr, target_ulong size) {
+    check_native_access(addr, size);
     taint_memlog_push(&taint_memlog, addr);
     return 0;
 }
@@ -156,6 +208,7 @@ int replay_hd_transfer_callback(CPUState *cpu, uint32_t type, uint64_t src_addr,
         return 0;
     }
 
+    TAINT_TRACE(TT_COPY, dst_shad, src_shad, NULL, dst_addr, src_addr, num_bytes);
     Shad::copy(dst_shad, dst_addr, src_shad, src_addr, num_bytes);
 
     return 0;
@@ -190,6 +243,7 @@ int on_replay_net_transfer(CPUState *cpu, uint32_t type, uint64_t src_addr,
         fprintf(stderr, "Invalid network transfer type (%d)\n", type);
         return 0;
     }
+    TAINT_TRACE(TT_COPY, dst_shad, src_shad, NULL, dst_addr, src_addr, num_bytes);
     Shad::copy(dst_shad, dst_addr, src_shad, src_addr, num_bytes);
     return 0;
 } // end of function on_replay_net_transfer
@@ -237,6 +291,7 @@ int on_replay_before_dma(CPUState *cpu, uint32_t is_write, uint8_t *src_addr,
         fprintf(stderr, "Invalid replay before DMA write flag (%d)\n", is_write);
         return 0;
     }
+    TAINT_TRACE(TT_COPY, dst_shad, src_shad, NULL, ds_addr, ss_addr, num_bytes);
     Shad::copy(dst_shad, ds_addr, src_shad, ss_addr, num_bytes);
     return 0;
 } // end of function on_replay_before_dma
@@ -275,9 +330,21 @@ void taint2_enable_taint(void) {
         panda_enable_llvm();
     }
     panda_enable_llvm_helpers();
+    if (dual_exec) {
+        panda_enable_llvm_dual_exec();
+    }
 
     if (shadow) delete shadow;
     shadow = new ShadowState();
+    if (dual_exec) {
+        // checked before every block
+        shadow->grv.count_tainted();
+        shadow->gsv.count_tainted();
+    }
+
+    if (!trace_path.empty() && !taint_trace_open(trace_path.c_str(), shadow)) {
+        exit(1);
+    }
 
     // Initialize memlog.
     memset(&taint_memlog, 0, sizeof(taint_memlog));
@@ -299,10 +366,23 @@ void taint2_enable_taint(void) {
 
     FPM->doInitialization();
 
+    // Addresses the instrumented helpers refer to, for the cache
+    TaintCache::Symbols symbols = {
+        { "llv", (uint64_t)&shadow->llv }, { "ram", (uint64_t)&shadow->ram },
+        { "grv", (uint64_t)&shadow->grv }, { "gsv", (uint64_t)&shadow->gsv },
+        { "ret", (uint64_t)&shadow->ret },
+        { "prev_bb", (uint64_t)&shadow->prev_bb },
+        { "memlog", (uint64_t)&taint_memlog },
+        { "env", (uint64_t)first_cpu->env_ptr },
+    };
+    std::set<llvm::Function *> cached;
+    bool hit = taint_cache && taint_cache->load_helpers(*mod, symbols, cached);
+
     // Populate module with helper function taint ops
     for (auto i = mod->begin(); i != mod->end(); i++){
-        if (!i->isDeclaration()) PTFP->runOnFunction(*i);
+        if (!i->isDeclaration() && !cached.count(&*i)) PTFP->runOnFunction(*i);
     }
+    if (taint_cache && !hit) taint_cache->save_helpers(*mod, symbols);
 
     std::cerr << PANDA_MSG "Done processing helper functions for taint." << std::endl;
 
@@ -325,6 +405,7 @@ int after_block_exec(CPUState *cpu, TranslationBlock *tb) {
         taintJustDisabled = false;
         execute_llvm = 0;
         generate_llvm = 0;
+        dual_exec_llvm = 0;
         panda_do_flush_tb();
         panda_disable_memcb();
     }
@@ -357,13 +438,8 @@ void panda_virtual_string_read(CPUState *cpu, target_ulong vaddr, char *str) {
 }
 #endif
 
-/**
- * @brief Wrapper for running the registered `on_taint_change` PPP callbacks.
- * Called by the shadow memory implementation whenever changes occur to it.
- */
-void taint_state_changed(Shad *shad, uint64_t shad_addr, uint64_t size)
+static bool shad_addr_to_addr(Shad *shad, uint64_t shad_addr, Addr &addr)
 {
-    Addr addr;
     if (shad == &shadow->llv) {
         addr = make_laddr(shad_addr / MAXREGSIZE, shad_addr % MAXREGSIZE);
     } else if (shad == &shadow->ram) {
@@ -386,13 +462,87 @@ void taint_state_changed(Shad *shad, uint64_t shad_addr, uint64_t size)
         addr = make_iaddr(shad_addr);
         /*    } else if (shad == &shadow->ports) {
                 addr = make_paddr(shad_addr); */
-    } else return;
+    } else return false;
+    return true;
+}
+
+// Size of the register slots of a register shadow, or 0 for shadows that
+// are flat address spaces, where contiguous changes can always be merged.
+static uint64_t shad_slot_size(Shad *shad)
+{
+    if (shad == &shadow->llv) return MAXREGSIZE;
+    if (shad == &shadow->grv) return sizeof(target_ulong);
+    return 0;
+}
+
+/**
+ * @brief Delivers the queued taint changes to the `on_taint_change_batch`
+ * PPP callbacks.
+ */
+void taint2_flush_taint_changes(void)
+{
+    if (taint_changes.empty()) return;
+    PPP_RUN_CB(on_taint_change_batch, taint_changes.data(),
+               (uint32_t)taint_changes.size());
+    taint_changes.clear();
+    last_change_shad = nullptr;
+}
+
+/**
+ * @brief Wrapper for running the registered `on_taint_change` PPP callbacks,
+ * and queueing the change for the `on_taint_change_batch` ones.
+ * Called by the shadow memory implementation whenever changes occur to it.
+ */
+void taint_state_changed(Shad *shad, uint64_t shad_addr, uint64_t size)
+{
+    Addr addr;
+    if (!shad_addr_to_addr(shad, shad_addr, addr)) return;
+
+    if (ppp_on_taint_change_batch_num_cb > 0) {
+        CPUState *cpu = first_cpu;
+        uint64_t pc = panda_current_pc(cpu);
+        uint64_t instr = rr_get_guest_instr_count();
+        // bytes changed by the same instruction right after the last ones
+        // extend that change, unless they start the next register
+        uint64_t slot = shad_slot_size(shad);
+        if (shad == last_change_shad && shad_addr == last_change_end &&
+                (slot == 0 || shad_addr % slot != 0) &&
+                taint_changes.back().pc == pc &&
+                taint_changes.back().instr == instr) {
+            taint_changes.back().size += size;
+        } else {
+            if (taint_changes.size() == TAINT_CHANGE_QUEUE_SIZE) {
+                taint2_flush_taint_changes();
+            }
+            taint_changes.push_back(TaintChange{ addr, size,
+                panda_current_asid(cpu), pc, instr });
+            last_change_shad = shad;
+        }
+        last_change_end = shad_addr + size;
+    }
 
     PPP_RUN_CB(on_taint_change, addr, size);
 }
 
 bool before_block_exec_invalidate_opt(CPUState *cpu, TranslationBlock *tb) {
     if (taintEnabled) {
+        taint2_flush_taint_changes();
+        TAINT_TRACE(TT_BLOCK, NULL, NULL, NULL, tb->pc,
+                    rr_get_guest_instr_count());
+        // between blocks, all label sets in use are in shadow memory
+        if (label_set_gc && label_set_count() >= next_label_set_gc) {
+            shadow->collect_label_sets();
+            next_label_set_gc = std::max<uint64_t>(label_set_gc,
+                                                   2 * label_set_count());
+        }
+        if (dual_exec) {
+            // tainted RAM is caught on access, see check_native_access()
+            execute_llvm = force_llvm_block ||
+                shadow->grv.tainted_bytes() || shadow->gsv.tainted_bytes();
+            force_llvm_block = false;
+            if (execute_llvm) llvm_blocks++;
+            else native_blocks++;
+        }
         return tb->llvm_tc_ptr ? false : true /* invalidate! */;
     }
     return false;
@@ -436,12 +586,38 @@ bool init_plugin(void *self) {
     std::cerr << PANDA_MSG "taint debugging " << PANDA_FLAG_STATUS(debug_taint) << std::endl;
     detaint_cb0_bytes = panda_parse_bool_opt(args, "detaint_cb0", "detaint bytes whose control mask bits are 0");
     std::cerr << PANDA_MSG "detaint if control bits 0 " << PANDA_FLAG_STATUS(detaint_cb0_bytes) << std::endl;
+    dual_exec = panda_parse_bool_opt(args, "dual_exec", "run blocks natively while no taint can reach them");
+    std::cerr << PANDA_MSG "native execution of untainted blocks " << PANDA_FLAG_STATUS(dual_exec) << std::endl;
     max_tcn = panda_parse_uint32_opt(args, "max_taintset_compute_number", 0,
         "stop propagating taint after it goes through this number of computations (0=never stop)");
     std::cerr << PANDA_MSG "maximum taint compute number (0=unlimited) " << max_tcn << std::endl;
     max_taintset_card = panda_parse_uint32_opt(args, "max_taintset_card", 0,
         "maximum size a label set can reach before stop tracking taint on it (0=never stop)");
     std::cerr << PANDA_MSG "maximum taintset cardinality (0=unlimited) " << max_taintset_card << std::endl;
+    uint32_t union_cache_size = panda_parse_uint32_opt(args, "union_cache_size", 1 << 20,
+        "number of label set unions to memoize (0=unlimited)");
+    label_set_set_union_cache_size(union_cache_size);
+    std::cerr << PANDA_MSG "label set union cache size (0=unlimited) " << union_cache_size << std::endl;
+    label_set_gc = panda_parse_uint32_opt(args, "label_set_gc", 1 << 20,
+        "free unused label sets once there are this many (0=never)");
+    next_label_set_gc = label_set_gc;
+    std::cerr << PANDA_MSG "label set collection threshold (0=never) " << label_set_gc << std::endl;
+    std::string cache_dir = panda_parse_string_opt(args, "cache_dir", "",
+        "directory to cache instrumented helpers in across runs (empty=no cache)");
+    if (!cache_dir.empty()) {
+        std::string options = std::string("tp=") + (tainted_pointer ? "1" : "0") +
+            ";inline=" + (inline_taint ? "1" : "0");
+        taint_cache = new TaintCache(cache_dir, options);
+    }
+    std::cerr << PANDA_MSG "instrumented helper cache (empty=none) " << cache_dir << std::endl;
+    trace_path = panda_parse_string_opt(args, "trace", "",
+        "file to write a trace of taint ops to, for offline propagation (empty=no trace)");
+    if (!trace_path.empty() && dual_exec) {
+        // blocks run natively leave no taint ops in the trace
+        std::cerr << PANDA_MSG "trace requires every block to run under LLVM, disabling dual_exec" << std::endl;
+        dual_exec = false;
+    }
+    std::cerr << PANDA_MSG "taint op trace (empty=none) " << trace_path << std::endl;
     
     // load dependencies
     panda_require("callstack_instr");
@@ -450,8 +626,47 @@ bool init_plugin(void *self) {
     return true;
 }
 
+static void label_set_report() {
+    LabelSetStats s = label_set_stats();
+    std::cerr << PANDA_MSG "label sets: " << s.sets << " (" << s.bitmap_sets
+              << " bitmaps), " << s.set_bytes << " bytes, hash-consing table "
+              << s.table_bytes << " bytes" << std::endl;
+    std::cerr << PANDA_MSG "label set unions: " << s.unions << ", "
+              << s.cache_hits << " cache hits, " << s.cache_entries
+              << " cached (" << s.cache_bytes << " bytes), "
+              << s.cache_evictions << " evicted" << std::endl;
+    std::cerr << PANDA_MSG "label set collections: " << s.collections
+              << ", " << s.sets_freed << " sets freed" << std::endl;
+}
+
+static void taint_cache_report() {
+    if (!taint_cache) return;
+    std::cerr << PANDA_MSG "instrumented helper cache: " << taint_cache->hits
+              << " hits, " << taint_cache->misses << " misses" << std::endl;
+}
+
+static void dual_exec_report() {
+    uint64_t blocks = native_blocks + llvm_blocks;
+    if (!dual_exec || blocks == 0) return;
+    std::cerr << PANDA_MSG "blocks run natively: " << native_blocks << " ("
+              << 100.0 * native_blocks / blocks << "%), under LLVM: "
+              << llvm_blocks << " (" << 100.0 * llvm_blocks / blocks
+              << "%), " << native_blocks_stopped
+              << " native blocks stopped at tainted RAM" << std::endl;
+}
+
 void uninit_plugin(void *self) {
+    taint2_flush_taint_changes();
+    label_set_report();
+    dual_exec_report();
+    taint_cache_report();
+    taint_trace_close();
+    delete taint_cache;
+    taint_cache = nullptr;
+
     if (shadow) {
+        std::cerr << PANDA_MSG "RAM shadow: " << shadow->ram.allocated_bytes()
+                  << " bytes in tainted pages" << std::endl;
         delete shadow;
         shadow = nullptr;
     }
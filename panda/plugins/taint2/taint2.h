@@ -27,7 +27,7 @@
 #include "shad_dir_64.h"
 #include "taint_defines.h"
 
-typedef const std::set<uint32_t> *LabelSetP;
+typedef const LabelSet *LabelSetP;
 
 typedef void (*on_branch2_t) (Addr, uint64_t);
 typedef void (*on_indirect_jump_t) (Addr, uint64_t);
@@ -35,17 +35,56 @@ typedef void (*on_taint_change_t) (Addr, uint64_t);
 typedef void (*on_ptr_load_t) (Addr, uint64_t, uint64_t);
 typedef void (*on_ptr_store_t) (Addr, uint64_t, uint64_t);
 
+// A run of bytes whose taint was changed by one guest instruction. Byte i
+// of the run is at addr with addr.off increased by i.
+struct TaintChange {
+    Addr addr;
+    uint64_t size;
+    uint64_t asid;
+    uint64_t pc;
+    uint64_t instr; // guest instruction count
+};
+
+typedef void (*on_taint_change_batch_t) (const TaintChange *, uint32_t);
+
+// A run of bytes with the same label set and tcn, as returned by
+// taint2_query_range. offset is relative to the start of the queried range
+// and label_set indexes the label sets of the query.
+struct TaintExtent {
+    uint64_t offset;
+    uint64_t size;
+    uint32_t label_set;
+    uint32_t tcn;
+};
+
+// Result of taint2_query_range. The labels of label set i are
+// labels[label_set_start[i] .. label_set_start[i+1]-1]. Zero-initialize it
+// before the first query; its buffers are reused by later queries and
+// released by taint2_query_range_free.
+struct TaintRangeQuery {
+    uint32_t num_extents;
+    TaintExtent *extents;
+    uint32_t num_label_sets;
+    uint32_t *label_set_start; // num_label_sets + 1 entries
+    uint32_t *labels;
+
+    // allocated sizes of the buffers above
+    uint32_t extents_cap;
+    uint32_t label_sets_cap;
+    uint32_t labels_cap;
+};
+
 
 struct ShadowState {
     uint64_t prev_bb; // label for previous BB.
     uint32_t num_vals;
-    FastShad ram;
+    PagedShad ram;
     FastShad llv;  // LLVM registers, with multiple frames
     FastShad ret;  // LLVM return value, also temp register
     FastShad grv;  // guest general purpose registers
     FastShad gsv;  // guest special values, like FP, and parts of CPUState
-    LazyShad hd;   // Hard Drive
-    LazyShad io;   // I/O Buffer
+    RangeShad hd;  // Hard Drive
+    RangeShad io;  // I/O Buffer
 
     ShadowState()
         : prev_bb(0), num_vals(MAXFRAMESIZE), ram("RAM", ram_size),
@@ -80,6 +119,17 @@ struct ShadowState {
                 return std::make_pair(nullptr, 0);
         }
     }
+
+    // Frees the label sets no longer stored anywhere in shadow memory.
+    // Returns how many were freed.
+    size_t collect_label_sets()
+    {
+        Shad *shads[] = { &ram, &llv, &ret, &grv, &gsv, &hd, &io };
+        for (Shad *shad : shads) {
+            shad->mark_label_sets();
+        }
+        return label_set_sweep();
+    }
 };
 
 extern "C" {
@@ -55,6 +55,29 @@ Panda__SrcInfo *pandalog_src_info_create(PandaHypercallStruct phs) {
     return si;
 }
 
+// Appends the physical address and offset of each tainted byte of the len
+// bytes at va to tainted, querying a page at a time.
+static void query_virtual_range(CPUState *cpu, target_ulong va, uint32_t len,
+        std::vector<std::pair<uint32_t, uint32_t>> &tainted) {
+    static TaintRangeQuery q;
+    uint32_t offset = 0;
+    while (offset < len) {
+        target_ulong addr = va + offset;
+        uint32_t n = TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+        if (n > len - offset) n = len - offset;
+        uint32_t pa = panda_virt_to_phys(cpu, addr);
+        if ((int) pa != -1 && taint2_query_range(make_maddr(pa), n, &q)) {
+            for (uint32_t i = 0; i < q.num_extents; i++) {
+                const TaintExtent &e = q.extents[i];
+                for (uint64_t j = e.offset; j < e.offset + e.size; j++) {
+                    tainted.push_back(std::make_pair(pa + j, offset + j));
+                }
+            }
+        }
+        offset += n;
+    }
+}
+
 /**
  * @brief Hypercall-initiated taint query of some src-level extent.
  */
@@ -62,31 +85,25 @@ void taint_query_hypercall(PandaHypercallStruct phs) {
     CPUState *cpu = first_cpu;
     if  (pandalog && taintEnabled && (taint2_num_labels_applied() > 0)) {
         // okay, taint is on and some labels have actually been applied
-        // is there *any* taint on this extent
-        uint32_t num_tainted = 0;
         bool is_strnlen = ((int) phs.len == -1);
-        uint32_t offset=0;
-        while (true) {
-            uint32_t va = phs.buf + offset;
-            uint32_t pa =  panda_virt_to_phys(cpu, va);
-            if (is_strnlen) {
+        uint32_t len = phs.len;
+        if (is_strnlen) {
+            uint32_t offset=0;
+            while (offset < QUERY_HYPERCALL_MAX_LEN) {
+                uint32_t va = phs.buf + offset;
+                uint32_t pa =  panda_virt_to_phys(cpu, va);
                 uint8_t c;
                 panda_virtual_memory_rw(cpu, pa, &c, 1, false);
                 // null terminator
                 if (c==0) break;
+                offset ++;
             }
-            if ((int) pa != -1) {
-                Addr a = make_maddr(pa);
-                if (taint2_query(a)) {
-                    num_tainted ++;
-                }
-            }
-            offset ++;
-            // end of query by length or max string length
-            if (!is_strnlen && offset == phs.len) break;
-            if (is_strnlen && (offset == QUERY_HYPERCALL_MAX_LEN)) break;
+            len = offset;
         }
-        uint32_t len = offset;
+        // is there *any* taint on this extent
+        std::vector<std::pair<uint32_t, uint32_t>> tainted;
+        query_virtual_range(cpu, phs.buf, len, tainted);
+        uint32_t num_tainted = tainted.size();
         if (num_tainted) {
             // ok at least one byte in the extent is tainted
             // 1. write the pandalog entry that tells us something was tainted on this extent
@@ -117,15 +134,8 @@ void taint_query_hypercall(PandaHypercallStruct phs) {
             Panda__CallStack *cs = pandalog_callstack_create();
             tqh->call_stack = cs;
             std::vector<Panda__TaintQuery *> tq;
-            for (uint32_t offset=0; offset<len; offset++) {
-                uint32_t va = phs.buf + offset;
-                uint32_t pa =  panda_virt_to_phys(cpu, va);
-                if ((int) pa != -1) {
-                    Addr a = make_maddr(pa);
-                    if (taint2_query(a)) {
-                        tq.push_back(taint2_query_pandalog(a, offset));
-                    }
-                }
+            for (auto &t : tainted) {
+                tq.push_back(taint2_query_pandalog(make_maddr(t.first), t.second));
             }
             tqh->n_taint_query = tq.size();
             tqh->taint_query = (Panda__TaintQuery **) malloc(sizeof(Panda__TaintQuery *) * tqh->n_taint_query);
@@ -1,6 +1,7 @@
 
 typedef void *LabelSetP;
 typedef void Panda__TaintQuery;
+typedef void TaintRangeQuery;
 
 #include "taint2_int_fns.h"
 
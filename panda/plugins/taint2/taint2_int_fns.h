@@ -64,6 +64,14 @@ uint32_t taint2_query_tcn_io(uint64_t ia);
 // reversibly from input).
 uint64_t taint2_query_cb_mask(Addr a, uint8_t size);
 
+// Queries the size bytes starting at a in one go, filling q with the
+// extents of bytes that share a label set and tcn and with each distinct
+// label set once. Returns the number of tainted bytes.
+uint64_t taint2_query_range(Addr a, uint64_t size, TaintRangeQuery *q);
+
+// frees the buffers of a range query
+void taint2_query_range_free(TaintRangeQuery *q);
+
 // delete taint from this phys addr
 void taint2_delete_ram(uint64_t pa);
 
@@ -95,6 +103,10 @@ uint32_t taint2_num_labels_applied(void);
 // Track whether taint state actually changed during a BB
 void taint2_track_taint_state(void);
 
+// Delivers the taint changes queued for on_taint_change_batch right away
+// rather than before the next basic block.
+void taint2_flush_taint_changes(void);
+
 
 // queries taint on this virtual addr and, if any taint there,
 // writes an entry to pandalog with lots of stuff like
@@ -1,5 +1,11 @@
+#include <cstdlib>
+
+#include <unordered_map>
+#include <vector>
+
 #include "taint_api.h"
 #include "taint2.h"
+#include "taint_trace.h"
 
 Addr make_haddr(uint64_t a)
 {
@@ -105,7 +111,9 @@ static TaintData tp_query_full(const Addr &a) {
 static void tp_delete(const Addr &a) {
     assert(shadow);
     auto loc = shadow->query_loc(a);
-    if (loc.first) loc.first->remove(loc.second, 1);
+    if (!loc.first) return;
+    TAINT_TRACE(TT_DELETE, loc.first, NULL, NULL, loc.second, 1);
+    loc.first->remove(loc.second, 1);
 }
 
 static void tp_labelset_put(const Addr &a, LabelSetP ls) {
@@ -123,6 +131,8 @@ static void tp_label(Addr a, uint32_t l) {
     if (debug_taint) start_debugging();
 
     LabelSetP ls = label_set_singleton(l);
+    auto loc = shadow->query_loc(a);
+    if (loc.first) TAINT_TRACE(TT_LABEL, loc.first, NULL, NULL, loc.second, l);
     tp_labelset_put(a, ls);
     labels_applied.insert(l);
 }
@@ -139,6 +149,8 @@ static void tp_label_additive(Addr a, uint32_t l) {
     // if successful, add the labelset, skip otherwise.
     LabelSetP new_ls = label_set_union(ls_at_a, ls_of_l);
     if (new_ls) {
+        auto loc = shadow->query_loc(a);
+        if (loc.first) TAINT_TRACE(TT_LABEL_ADD, loc.first, NULL, NULL, loc.second, l);
         tp_labelset_put(a, new_ls);
         labels_applied.insert(l);
 	}
@@ -362,6 +374,72 @@ uint64_t taint2_query_cb_mask(Addr a, uint8_t size) {
     return cb_mask;
 }
 
+// Grows buf to hold at least n elements.
+template <typename T>
+static void range_query_reserve(T *&buf, uint32_t &cap, uint32_t n) {
+    if (n <= cap) return;
+    cap = std::max(n, 2 * cap);
+    buf = (T *)realloc(buf, cap * sizeof(T));
+}
+
+uint64_t taint2_query_range(Addr a, uint64_t size, TaintRangeQuery *q) {
+    assert(shadow);
+    static std::vector<TaintRun> runs;
+    static std::unordered_map<LabelSetP, uint32_t> ls_index;
+
+    q->num_extents = 0;
+    q->num_label_sets = 0;
+    range_query_reserve(q->label_set_start, q->label_sets_cap, 1);
+    q->label_set_start[0] = 0;
+
+    auto loc = shadow->query_loc(a);
+    if (!loc.first || loc.second >= loc.first->get_size()) return 0;
+    size = std::min(size, loc.first->get_size() - loc.second);
+
+    runs.clear();
+    ls_index.clear();
+    loc.first->query_range(loc.second, size, runs);
+
+    uint64_t tainted = 0;
+    for (const TaintRun &run : runs) {
+        LabelSetP ls = run.td.ls;
+        if (!ls) continue;
+        tainted += run.size;
+
+        auto it = ls_index.find(ls);
+        if (it == ls_index.end()) {
+            uint32_t i = q->num_label_sets++;
+            it = ls_index.emplace(ls, i).first;
+            uint32_t start = q->label_set_start[i];
+            range_query_reserve(q->label_set_start, q->label_sets_cap, i + 2);
+            range_query_reserve(q->labels, q->labels_cap, start + ls->size());
+            for (uint32_t l : *ls) q->labels[start++] = l;
+            q->label_set_start[i + 1] = start;
+        }
+
+        // runs also split on the cb mask, which extents leave out
+        if (q->num_extents) {
+            TaintExtent &last = q->extents[q->num_extents - 1];
+            if (last.offset + last.size == run.offset &&
+                    last.label_set == it->second && last.tcn == run.td.tcn) {
+                last.size += run.size;
+                continue;
+            }
+        }
+        range_query_reserve(q->extents, q->extents_cap, q->num_extents + 1);
+        q->extents[q->num_extents++] =
+            TaintExtent{run.offset, run.size, it->second, run.td.tcn};
+    }
+    return tainted;
+}
+
+void taint2_query_range_free(TaintRangeQuery *q) {
+    free(q->extents);
+    free(q->label_set_start);
+    free(q->labels);
+    *q = TaintRangeQuery();
+}
+
 uint32_t taint2_num_labels_applied(void) {
     return labels_applied.size();
 }
@@ -444,6 +522,8 @@ Panda__TaintQuery *taint2_query_pandalog (Addr a, uint32_t offset) {
             // this ls hasn't yet been written to pandalog
             // write out mapping from ls pointer to labelset contents
             // as its own separate log entry
+            // the pointer identifies the set from now on, so keep it alive
+            label_set_ref(ls);
             Panda__TaintQueryUniqueLabelSet *tquls =
                 (Panda__TaintQueryUniqueLabelSet *)
                 malloc (sizeof (Panda__TaintQueryUniqueLabelSet));
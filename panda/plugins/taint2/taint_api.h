@@ -44,6 +44,9 @@ uint32_t taint2_query_tcn_llvm(int reg_num, int offset);
 
 uint64_t taint2_query_cb_mask(Addr a, uint8_t size);
 
+uint64_t taint2_query_range(Addr a, uint64_t size, TaintRangeQuery *q);
+void taint2_query_range_free(TaintRangeQuery *q);
+
 void taint2_labelset_addr_iter(Addr addr, int (*app)(uint32_t el, void *stuff1), void *stuff2);
 void taint2_labelset_ram_iter(uint64_t pa, int (*app)(uint32_t el, void *stuff1), void *stuff2);
 void taint2_labelset_reg_iter(int reg_num, int offset, int (*app)(uint32_t el, void *stuff1), void *stuff2);
@@ -53,5 +56,9 @@ void taint2_labelset_llvm_iter(int reg_num, int offset, int (*app)(uint32_t el,
 uint32_t taint2_num_labels_applied(void);
 
 void taint2_track_taint_state(void);
+
+// Delivers the taint changes queued for on_taint_change_batch right away
+// rather than before the next basic block.
+void taint2_flush_taint_changes(void);
 }
 
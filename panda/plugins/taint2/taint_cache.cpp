@@ -0,0 +1,354 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/Analysis/Verifier.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Linker.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+#include "panda/plugin.h"
+
+#include "taint_cache.h"
+
+extern "C" {
+#include "libgen.h"
+}
+
+extern const char *qemu_file;
+
+using namespace llvm;
+
+#define RELOCS_MD "taint2.relocs"
+
+// Identifies a file by its size and modification time.
+static std::string fingerprint(const std::string &file) {
+    std::ostringstream out;
+    struct stat st;
+    out << file << ':';
+    if (stat(file.c_str(), &st) == 0) {
+        out << st.st_size << ':' << st.st_mtim.tv_sec << '.'
+            << st.st_mtim.tv_nsec;
+    } else {
+        out << "missing";
+    }
+    out << ';';
+    return out.str();
+}
+
+static uint64_t fnv1a(const std::string &s) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (unsigned char c : s) {
+        h = (h ^ c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static bool is_tb(const Function &F) {
+    return F.getName().startswith("tcg-llvm-tb-");
+}
+
+// Rewrites the relocated addresses in C, which is either one of them as an
+// i64 or a constant expression built from them.
+static Constant *relocate(Constant *C, const DenseMap<uint64_t, uint64_t> &relocs,
+                          DenseMap<Constant *, Constant *> &done) {
+    auto it = done.find(C);
+    if (it != done.end()) return it->second;
+
+    Constant *result = C;
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(C)) {
+        if (CI->getBitWidth() == 64) {
+            auto r = relocs.find(CI->getZExtValue());
+            if (r != relocs.end()) result = ConstantInt::get(CI->getType(), r->second);
+        }
+    } else if (ConstantExpr *CE = dyn_cast<ConstantExpr>(C)) {
+        std::vector<Constant *> ops;
+        bool changed = false;
+        for (unsigned i = 0; i < CE->getNumOperands(); i++) {
+            Constant *op = CE->getOperand(i);
+            ops.push_back(relocate(op, relocs, done));
+            changed |= ops.back() != op;
+        }
+        if (changed) result = CE->getWithOperands(ops);
+    }
+    done[C] = result;
+    return result;
+}
+
+TaintCache::TaintCache(const std::string &dir, const std::string &options) {
+    char *exe = strdup(qemu_file);
+    std::string exe_dir(dirname(exe));
+    free(exe);
+
+    // The build is identified by the files that determine what the
+    // instrumented helpers look like: PANDA itself, the helper bitcode, the
+    // taint ops bitcode and this plugin.
+    std::string id = TARGET_NAME ";" + options + ";";
+    id += fingerprint(qemu_file);
+    id += fingerprint(exe_dir + "/llvm-helpers.bc");
+    id += fingerprint(exe_dir + "/panda/plugins/panda_taint2_ops.bc");
+    Dl_info info;
+    if (dladdr((void *)fingerprint, &info) && info.dli_fname) {
+        id += fingerprint(info.dli_fname);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "/taint2-helpers-" TARGET_NAME "-%016lx.bc",
+             (unsigned long)fnv1a(id));
+    path = dir + name;
+}
+
+bool TaintCache::load_helpers(Module &M, const Symbols &symbols,
+                              std::set<Function *> &loaded) {
+    if (access(path.c_str(), R_OK) != 0) {
+        misses++;
+        return false;
+    }
+
+    SMDiagnostic Err;
+    Module *cached = ParseIRFile(path, Err, M.getContext());
+    NamedMDNode *relocMD = cached ? cached->getNamedMetadata(RELOCS_MD) : nullptr;
+    if (!relocMD) {
+        std::cerr << PANDA_MSG "ignoring unreadable taint cache " << path << std::endl;
+        delete cached;
+        misses++;
+        return false;
+    }
+
+    // The cached module must define exactly the helpers M defines, and
+    // everything else it refers to must be in M.
+    std::set<std::string> defined;
+    bool match = true;
+    for (Function &F : *cached) {
+        if (!M.getFunction(F.getName())) match = false;
+        else if (!F.isDeclaration()) defined.insert(F.getName());
+    }
+    for (GlobalVariable &GV : cached->getGlobalList()) {
+        if (!M.getNamedGlobal(GV.getName())) match = false;
+    }
+    for (Function &F : M) {
+        if (!F.isDeclaration() && !is_tb(F) && !defined.count(F.getName())) {
+            match = false;
+        }
+    }
+    if (!match) {
+        std::cerr << PANDA_MSG "ignoring stale taint cache " << path << std::endl;
+        delete cached;
+        misses++;
+        return false;
+    }
+
+    // Old addresses of the symbols, and of instructions as "function:index".
+    std::vector<std::pair<uint64_t, std::string>> old;
+    for (unsigned i = 0; i < relocMD->getNumOperands(); i++) {
+        MDNode *N = relocMD->getOperand(i);
+        old.push_back(std::make_pair(
+            cast<ConstantInt>(N->getOperand(0))->getZExtValue(),
+            cast<MDString>(N->getOperand(1))->getString().str()));
+    }
+    relocMD->eraseFromParent();
+
+    // Make room for the cached definitions. The linker replaces these
+    // declarations, and the globals must be visible to the cached code.
+    for (const std::string &name : defined) {
+        Function *MF = M.getFunction(name);
+        MF->deleteBody();
+        MF->setLinkage(GlobalValue::ExternalLinkage);
+    }
+    for (GlobalVariable &GV : cached->getGlobalList()) {
+        GlobalVariable *MGV = M.getNamedGlobal(GV.getName());
+        if (MGV->hasLocalLinkage()) MGV->setLinkage(GlobalValue::ExternalLinkage);
+    }
+
+    std::string err;
+    Linker::LinkModules(&M, cached, Linker::DestroySource, &err);
+    delete cached;
+    if (!err.empty()) {
+        std::cerr << PANDA_MSG << err << std::endl;
+        exit(1);
+    }
+
+    std::map<std::string, Function *> functions;
+    for (const std::string &name : defined) {
+        functions[name] = M.getFunction(name);
+    }
+
+    DenseMap<uint64_t, uint64_t> relocs;
+    std::map<Function *, std::vector<Instruction *>> instrs;
+    for (auto &o : old) {
+        uint64_t addr;
+        size_t colon = o.second.rfind(':');
+        if (colon == std::string::npos) {
+            auto s = symbols.find(o.second);
+            assert(s != symbols.end());
+            addr = s->second;
+        } else {
+            Function *F = functions[o.second.substr(0, colon)];
+            assert(F);
+            std::vector<Instruction *> &is = instrs[F];
+            if (is.empty()) {
+                for (BasicBlock &BB : *F) {
+                    for (Instruction &I : BB) is.push_back(&I);
+                }
+            }
+            size_t idx = strtoul(o.second.c_str() + colon + 1, nullptr, 10);
+            assert(idx < is.size());
+            addr = (uint64_t)is[idx];
+        }
+        relocs[o.first] = addr;
+    }
+
+    DenseMap<Constant *, Constant *> done;
+    for (auto &f : functions) {
+        for (BasicBlock &BB : *f.second) {
+            for (Instruction &I : BB) {
+                for (unsigned i = 0; i < I.getNumOperands(); i++) {
+                    Constant *C = dyn_cast<Constant>(I.getOperand(i));
+                    if (!C || isa<GlobalValue>(C)) continue;
+                    Constant *R = relocate(C, relocs, done);
+                    if (R != C) I.setOperand(i, R);
+                }
+            }
+        }
+        loaded.insert(f.second);
+    }
+
+    hits++;
+    std::cerr << PANDA_MSG "loaded instrumented helpers from " << path << std::endl;
+    return true;
+}
+
+void TaintCache::save_helpers(Module &M, const Symbols &symbols) {
+    // Unnamed globals and aliases can't be linked back in by name.
+    for (GlobalVariable &GV : M.getGlobalList()) {
+        if (!GV.hasName()) return;
+    }
+    if (!M.getAliasList().empty()) return;
+
+    LLVMContext &ctx = M.getContext();
+    DenseMap<uint64_t, std::string> names;
+    for (auto &s : symbols) {
+        if (s.second) names[s.second] = s.first;
+    }
+
+    // Instructions are only referred to by the function they belong to.
+    std::vector<std::pair<uint64_t, std::string>> relocs;
+    std::set<uint64_t> seen;
+    for (Function &F : M) {
+        if (F.isDeclaration() || is_tb(F)) continue;
+        DenseMap<uint64_t, size_t> index;
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                size_t idx = index.size();
+                index[(uint64_t)&I] = idx;
+            }
+        }
+        for (BasicBlock &BB : F) {
+            for (Instruction &I : BB) {
+                for (unsigned i = 0; i < I.getNumOperands(); i++) {
+                    Value *V = I.getOperand(i);
+                    if (ConstantExpr *CE = dyn_cast<ConstantExpr>(V)) {
+                        if (CE->getOpcode() == Instruction::IntToPtr) V = CE->getOperand(0);
+                    }
+                    ConstantInt *CI = dyn_cast<ConstantInt>(V);
+                    if (!CI || CI->getBitWidth() != 64) continue;
+                    uint64_t v = CI->getZExtValue();
+                    if (!v || seen.count(v)) continue;
+                    auto n = names.find(v);
+                    auto x = index.find(v);
+                    if (n != names.end()) {
+                        relocs.push_back(std::make_pair(v, n->second));
+                    } else if (x != index.end()) {
+                        std::ostringstream name;
+                        name << F.getName().str() << ':' << x->second;
+                        relocs.push_back(std::make_pair(v, name.str()));
+                    } else continue;
+                    seen.insert(v);
+                }
+            }
+        }
+    }
+
+    // Blocks translated so far belong to this run only.
+    Module *clone = CloneModule(&M);
+    std::vector<Function *> tbs;
+    for (Function &F : *clone) {
+        if (is_tb(F)) {
+            tbs.push_back(&F);
+        } else if (!F.isDeclaration()) {
+            F.setLinkage(GlobalValue::ExternalLinkage);
+            F.setVisibility(GlobalValue::DefaultVisibility);
+        }
+    }
+    for (Function *F : tbs) {
+        F->replaceAllUsesWith(UndefValue::get(F->getType()));
+        F->eraseFromParent();
+    }
+    for (GlobalVariable &GV : clone->getGlobalList()) {
+        if (!GV.isDeclaration()) GV.setInitializer(nullptr);
+        GV.setLinkage(GlobalValue::ExternalLinkage);
+        GV.setVisibility(GlobalValue::DefaultVisibility);
+    }
+
+    NamedMDNode *relocMD = clone->getOrInsertNamedMetadata(RELOCS_MD);
+    for (auto &r : relocs) {
+        Value *ops[] = {
+            ConstantInt::get(Type::getInt64Ty(ctx), r.first),
+            MDString::get(ctx, r.second)
+        };
+        relocMD->addOperand(MDNode::get(ctx, ops));
+    }
+
+    std::string err;
+    if (verifyModule(*clone, ReturnStatusAction, &err)) {
+        std::cerr << PANDA_MSG "not caching instrumented helpers: " << err << std::endl;
+        delete clone;
+        return;
+    }
+
+    // Write to a temporary file, so that concurrent runs never see half of
+    // one.
+    std::ostringstream tmp;
+    tmp << path << '.' << getpid();
+    {
+        raw_fd_ostream out(tmp.str().c_str(), err, raw_fd_ostream::F_Binary);
+        if (err.empty()) WriteBitcodeToFile(clone, out);
+    }
+    delete clone;
+    if (!err.empty() || rename(tmp.str().c_str(), path.c_str()) != 0) {
+        std::cerr << PANDA_MSG "could not write taint cache " << path << ": "
+                  << (err.empty() ? strerror(errno) : err) << std::endl;
+        unlink(tmp.str().c_str());
+        return;
+    }
+    std::cerr << PANDA_MSG "saved instrumented helpers to " << path << std::endl;
+}
@@ -0,0 +1,63 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#ifndef __TAINT_CACHE_H_
+#define __TAINT_CACHE_H_
+
+#include <cstdint>
+
+#include <map>
+#include <set>
+#include <string>
+
+namespace llvm {
+class Function;
+class Module;
+}
+
+/*
+ * On-disk cache of the helper functions as instrumented by the taint pass,
+ * so that later runs of the same PANDA build skip instrumenting them.
+ *
+ * Instrumented code refers to the shadow memory, the memlog, the CPU state
+ * and its own instructions by their address in the process that
+ * instrumented it. Each of these is named in the cached module along with
+ * the address it had, and rewritten to its current address on load.
+ */
+class TaintCache {
+  public:
+    // Addresses that instrumented code refers to, by name.
+    typedef std::map<std::string, uint64_t> Symbols;
+
+    // Cache files go in dir, keyed by target, build and the options in
+    // options (anything that changes how helpers are instrumented).
+    TaintCache(const std::string &dir, const std::string &options);
+
+    // Replaces the helper functions in M with their cached instrumented
+    // versions. Returns false, leaving M untouched, on a miss; otherwise
+    // the functions it replaced are added to loaded.
+    bool load_helpers(llvm::Module &M, const Symbols &symbols,
+                      std::set<llvm::Function *> &loaded);
+
+    // Stores the helper functions of M, which have just been instrumented.
+    void save_helpers(llvm::Module &M, const Symbols &symbols);
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+
+  private:
+    std::string path;
+};
+
+#endif
@@ -41,6 +41,7 @@ PANDAENDCOMMENT */
 #include "shad.h"
 #include "label_set.h"
 #include "taint_ops.h"
+#include "taint_trace.h"
 
 uint64_t labelset_count;
 
@@ -103,15 +104,18 @@ void taint_breadcrumb(uint64_t *dest_ptr, uint64_t bb_slot) {
 
 void taint_reset_frame(Shad *shad)
 {
+    TAINT_TRACE(TT_RESET_FRAME, shad, NULL, NULL);
     shad->reset_frame();
 }
 
 void taint_push_frame(Shad *shad)
 {
+    TAINT_TRACE(TT_PUSH_FRAME, shad, NULL, NULL, MAXREGSIZE * MAXFRAMESIZE);
     shad->push_frame(MAXREGSIZE * MAXFRAMESIZE);
 }
 void taint_pop_frame(Shad *shad)
 {
+    TAINT_TRACE(TT_POP_FRAME, shad, NULL, NULL, MAXREGSIZE * MAXFRAMESIZE);
     shad->pop_frame(MAXREGSIZE * MAXFRAMESIZE);
 }
 
@@ -141,12 +145,21 @@ void taint_copy(Shad *shad_dest, uint64_t dest, Shad *shad_src, uint64_t src,
     taint_log("copy: %s[%lx+%lx] <- %s[%lx] ",
             shad_dest->name(), dest, size, shad_src->name(), src);
     taint_log_labels(shad_src, src, size);
+    TAINT_TRACE(TT_COPY, shad_dest, shad_src, NULL, dest, src, size);
 
     Shad::copy(shad_dest, dest, shad_src, src, size);
 
     if (I) update_cb(shad_dest, dest, shad_src, src, size, I);
 }
 
+// taint_parallel_compute and taint_mix_compute without tracing, for
+// taint_mul_compute, which traces itself.
+static void parallel_compute(Shad *shad, uint64_t dest, uint64_t src1,
+                             uint64_t src2, uint64_t src_size,
+                             llvm::Instruction *I);
+static void mix_compute(Shad *shad, uint64_t dest, uint64_t dest_size,
+                        uint64_t src1, uint64_t src2, uint64_t src_size);
+
 void taint_parallel_compute(Shad *shad, uint64_t dest, uint64_t ignored,
                             uint64_t src1, uint64_t src2, uint64_t src_size,
                             llvm::Instruction *I)
@@ -156,15 +169,38 @@ void taint_parallel_compute(Shad *shad, uint64_t dest, uint64_t ignored,
         taint_log("  Ignoring IO RW\n");
         return;
     }
+    TAINT_TRACE(TT_PARALLEL, shad, NULL, NULL, dest, src1, src2, src_size);
+    parallel_compute(shad, dest, src1, src2, src_size, I);
+}
 
+static void parallel_compute(Shad *shad, uint64_t dest, uint64_t src1,
+                             uint64_t src2, uint64_t src_size,
+                             llvm::Instruction *I)
+{
     taint_log("pcompute: %s[%lx+%lx] <- %lx + %lx\n",
             shad->name(), dest, src_size, src1, src2);
     uint64_t i;
-    for (i = 0; i < src_size; ++i) {
-        TaintData td = TaintData::make_union(
-                shad->query_full(src1 + i),
-                shad->query_full(src2 + i), true);
-        shad->set_full(dest + i, td);
+    if (shad->is_fast()) {
+        FastShad *fs = static_cast<FastShad *>(shad);
+        if (!fs->any_tainted(src1, src_size) &&
+                !fs->any_tainted(src2, src_size)) {
+            // the union of untainted bytes is the default TaintData
+            fs->set_range(dest, src_size, TaintData());
+        } else {
+            for (i = 0; i < src_size; ++i) {
+                TaintData td = TaintData::make_union(
+                        fs->FastShad::query_full(src1 + i),
+                        fs->FastShad::query_full(src2 + i), true);
+                fs->FastShad::set_full(dest + i, td);
+            }
+        }
+    } else {
+        for (i = 0; i < src_size; ++i) {
+            TaintData td = TaintData::make_union(
+                    shad->query_full(src1 + i),
+                    shad->query_full(src2 + i), true);
+            shad->set_full(dest + i, td);
+        }
     }
 
     // Unlike mixed computes, parallel computes guaranteed to be bitwise.
@@ -204,6 +240,20 @@ void taint_parallel_compute(Shad *shad, uint64_t dest, uint64_t ignored,
 static inline TaintData mixed_labels(Shad *shad, uint64_t addr, uint64_t size,
                                      bool increment_tcn)
 {
+    if (shad->is_fast()) {
+        FastShad *fs = static_cast<FastShad *>(shad);
+        // a union of several untainted bytes is the default TaintData
+        if (size > 1 && !fs->any_tainted(addr, size)) return TaintData();
+
+        TaintData td(fs->FastShad::query_full(addr));
+        for (uint64_t i = 1; i < size; ++i) {
+            td = TaintData::make_union(td, fs->FastShad::query_full(addr + i),
+                                       false);
+        }
+        if (increment_tcn) td.increment_tcn();
+        return td;
+    }
+
     TaintData td(shad->query_full(addr));
     for (uint64_t i = 1; i < size; ++i) {
         td = TaintData::make_union(td, shad->query_full(addr + i), false);
@@ -216,6 +266,11 @@ static inline TaintData mixed_labels(Shad *shad, uint64_t addr, uint64_t size,
 static inline void bulk_set(Shad *shad, uint64_t addr, uint64_t size,
                             TaintData td)
 {
+    if (shad->is_fast() && !taint_limits_active()) {
+        static_cast<FastShad *>(shad)->set_range(addr, size, td);
+        return;
+    }
+
     uint64_t i;
     for (i = 0; i < size; ++i) {
         shad->set_full(addr + i, td);
@@ -225,6 +280,14 @@ static inline void bulk_set(Shad *shad, uint64_t addr, uint64_t size,
 void taint_mix_compute(Shad *shad, uint64_t dest, uint64_t dest_size,
                        uint64_t src1, uint64_t src2, uint64_t src_size,
                        llvm::Instruction *ignored)
+{
+    TAINT_TRACE(TT_MIX_COMPUTE, shad, NULL, NULL,
+                dest, dest_size, src1, src2, src_size);
+    mix_compute(shad, dest, dest_size, src1, src2, src_size);
+}
+
+static void mix_compute(Shad *shad, uint64_t dest, uint64_t dest_size,
+                        uint64_t src1, uint64_t src2, uint64_t src_size)
 {
     TaintData td = TaintData::make_union(
             mixed_labels(shad, src1, src_size, false),
@@ -240,6 +303,8 @@ void taint_mul_compute(Shad *shad, uint64_t dest, uint64_t dest_size,
                        uint64_t src1, uint64_t src2, uint64_t src_size,
                        llvm::Instruction *inst, uint64_t arg1, uint64_t arg2)
 {
+    TAINT_TRACE(TT_MUL_COMPUTE, shad, NULL, NULL,
+                dest, dest_size, src1, src2, src_size, arg1, arg2);
     bool isTainted1 = false;
     bool isTainted2 = false;
     for (int i = 0; i < src_size; ++i) {
@@ -254,12 +319,15 @@ void taint_mul_compute(Shad *shad, uint64_t dest, uint64_t dest_size,
         taint_log("mul_com: one untainted arg %lu \n", cleanArg);
         if (cleanArg == 0) return ; // mul X untainted 0 -> no taint prop
         else if (cleanArg == 1) { //mul X untainted 1(one) should be a parallel taint
-            taint_parallel_compute(shad, dest, dest_size, src1, src2,  src_size, inst);
+            uint64_t shad_size = shad->get_size();
+            if (dest < shad_size && src1 < shad_size && src2 < shad_size) {
+                parallel_compute(shad, dest, src1, src2, src_size, inst);
+            }
             taint_log("mul_com: mul X 1\n");
             return;
         }
     }
-    taint_mix_compute(shad, dest, dest_size, src1, src2,  src_size, inst);
+    mix_compute(shad, dest, dest_size, src1, src2, src_size);
 }
 
 void taint_delete(Shad *shad, uint64_t dest, uint64_t size)
@@ -269,18 +337,21 @@ void taint_delete(Shad *shad, uint64_t dest, uint64_t size)
         taint_log("Ignoring IO RW\n");
         return;
     }
+    TAINT_TRACE(TT_DELETE, shad, NULL, NULL, dest, size);
     shad->remove(dest, size);
 }
 
 void taint_set(Shad *shad_dest, uint64_t dest, uint64_t dest_size,
                Shad *shad_src, uint64_t src)
 {
+    TAINT_TRACE(TT_SET, shad_dest, shad_src, NULL, dest, dest_size, src);
     bulk_set(shad_dest, dest, dest_size, shad_src->query_full(src));
 }
 
 void taint_mix(Shad *shad, uint64_t dest, uint64_t dest_size, uint64_t src,
                uint64_t src_size, llvm::Instruction *I)
 {
+    TAINT_TRACE(TT_MIX, shad, NULL, NULL, dest, dest_size, src, src_size);
     TaintData td = mixed_labels(shad, src, src_size, true);
     bulk_set(shad, dest, dest_size, td);
     taint_log("mix: %s[%lx+%lx] <- %lx+%lx ",
@@ -313,6 +384,8 @@ void taint_pointer(Shad *shad_dest, uint64_t dest, Shad *shad_ptr, uint64_t ptr,
         taint_log("  Source IO.\n");
         src = ones; // ignore source.
     }
+    TAINT_TRACE(TT_POINTER, shad_dest, shad_ptr, src == ones ? NULL : shad_src,
+                dest, ptr, ptr_size, src, size);
 
     // query taint on pointer either being read or written
     if (tainted_pointer & TAINT_POINTER_MODE_CHECK) {
@@ -350,6 +423,7 @@ void taint_sext(Shad *shad, uint64_t dest, uint64_t dest_size, uint64_t src,
                 uint64_t src_size)
 {
     taint_log("taint_sext\n");
+    TAINT_TRACE(TT_SEXT, shad, NULL, NULL, dest, dest_size, src, src_size);
     Shad::copy(shad, dest, shad, src, src_size);
     bulk_set(shad, dest + src_size, dest_size - src_size,
             shad->query_full(dest + src_size - 1));
@@ -368,6 +442,7 @@ void taint_select(Shad *shad, uint64_t dest, uint64_t size, uint64_t selector,
     while (!(src == ones && srcsel == ones)) {
         if (srcsel == selector) { // bingo!
             if (src != ones) { // otherwise it's a constant.
+                TAINT_TRACE(TT_COPY, shad, shad, NULL, dest, src, size);
                 Shad::copy(shad, dest, shad, src, size);
             }
             return;
@@ -455,6 +530,7 @@ void taint_host_copy(uint64_t env_ptr, uint64_t addr, Shad *llv,
     taint_log("hostcopy: %s[%lx+%lx] <- %s[%lx] (offset %lx) ",
             shad_dest->name(), dest, size, shad_src->name(), src, offset);
     taint_log_labels(shad_src, src, size);
+    TAINT_TRACE(TT_COPY, shad_dest, shad_src, NULL, dest, src, size);
     Shad::copy(shad_dest, dest, shad_src, src, size);
 }
 
@@ -481,6 +557,7 @@ void taint_host_memcpy(uint64_t env_ptr, uint64_t dest, uint64_t src,
             shad_dest->name(), dest, size, shad_src->name(), src,
             dest_offset, src_offset);
     taint_log_labels(shad_src, addr_src, size);
+    TAINT_TRACE(TT_COPY, shad_dest, shad_src, NULL, addr_dest, addr_src, size);
     Shad::copy(shad_dest, addr_dest, shad_src, addr_src, size);
 }
 
@@ -499,6 +576,7 @@ void taint_host_delete(uint64_t env_ptr, uint64_t dest_addr, Shad *greg,
     find_offset(greg, gspec, offset, labels_per_reg, &shad, &dest);
 
     taint_log("hostdel: %s[%lx+%lx]\n", shad->name(), dest, size);
+    TAINT_TRACE(TT_DELETE, shad, NULL, NULL, dest, size);
 
     shad->remove(dest, size);
 }
@@ -0,0 +1,114 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include <iostream>
+
+#include "panda/plugin.h"
+
+#include "shad.h"
+#include "taint2.h"
+#include "taint_trace.h"
+
+bool taint_tracing = false;
+
+static FILE *trace_file = nullptr;
+static Shad *trace_shads[TT_NUM_SHADS];
+static uint64_t trace_records = 0;
+
+// Records are gathered here and written out when it fills up.
+static const size_t TRACE_BUF_SIZE = 1 << 20;
+static uint8_t trace_buf[TRACE_BUF_SIZE];
+static size_t trace_len = 0;
+
+static void trace_flush() {
+    if (trace_len && fwrite(trace_buf, 1, trace_len, trace_file) != trace_len) {
+        std::cerr << PANDA_MSG "error writing taint trace, stopping it" << std::endl;
+        taint_tracing = false;
+    }
+    trace_len = 0;
+}
+
+static inline unsigned shad_id(Shad *shad) {
+    if (!shad) return TT_NONE;
+    for (unsigned i = 1; i < TT_NUM_SHADS; i++) {
+        if (trace_shads[i] == shad) return i;
+    }
+    assert(false && "taint op on an unknown shadow");
+    return TT_NONE;
+}
+
+void taint_trace_record(int op, Shad *s1, Shad *s2, Shad *s3,
+                        const uint64_t *args, unsigned nargs) {
+    assert(nargs == taint_trace_nargs[op]);
+    // opcode and shadows, and at most 10 bytes per argument
+    if (trace_len + 2 + 10 * TAINT_TRACE_MAX_ARGS > TRACE_BUF_SIZE) {
+        trace_flush();
+    }
+    uint8_t *p = trace_buf + trace_len;
+    *p++ = op | shad_id(s1) << 4;
+    *p++ = shad_id(s2) | shad_id(s3) << 4;
+    for (unsigned i = 0; i < nargs; i++) {
+        uint64_t v = args[i];
+        while (v >= 0x80) {
+            *p++ = (v & 0x7f) | 0x80;
+            v >>= 7;
+        }
+        *p++ = v;
+    }
+    trace_len = p - trace_buf;
+    trace_records++;
+}
+
+bool taint_trace_open(const char *path, ShadowState *shadow) {
+    trace_file = fopen(path, "wb");
+    if (!trace_file) {
+        perror(path);
+        return false;
+    }
+
+    trace_shads[TT_RAM] = &shadow->ram;
+    trace_shads[TT_LLV] = &shadow->llv;
+    trace_shads[TT_RET] = &shadow->ret;
+    trace_shads[TT_GRV] = &shadow->grv;
+    trace_shads[TT_GSV] = &shadow->gsv;
+    trace_shads[TT_HD] = &shadow->hd;
+    trace_shads[TT_IO] = &shadow->io;
+
+    TaintTraceHeader header = {};
+    strncpy(header.magic, TAINT_TRACE_MAGIC, sizeof(header.magic));
+    header.version = TAINT_TRACE_VERSION;
+    header.num_shads = TT_NUM_SHADS;
+    for (unsigned i = 1; i < TT_NUM_SHADS; i++) {
+        header.shad_size[i] = trace_shads[i]->get_size();
+    }
+    fwrite(&header, sizeof(header), 1, trace_file);
+
+    taint_tracing = true;
+    std::cerr << PANDA_MSG "writing taint op trace to " << path << std::endl;
+    return true;
+}
+
+void taint_trace_close() {
+    if (!trace_file) return;
+    trace_flush();
+    fclose(trace_file);
+    trace_file = nullptr;
+    taint_tracing = false;
+    std::cerr << PANDA_MSG "taint op trace: " << trace_records << " records"
+              << std::endl;
+}
@@ -0,0 +1,104 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#ifndef __TAINT_TRACE_H_
+#define __TAINT_TRACE_H_
+
+#include <cstdint>
+
+/*
+ * Taint op traces.
+ *
+ * With the trace option, taint2 writes every taint operation it carries
+ * out, with the concrete shadow addresses it was applied to, so that
+ * propagation can be run again offline (see offline/taint_offline.cpp)
+ * without replaying the guest.
+ *
+ * A trace starts with a TaintTraceHeader. Each record that follows is a
+ * byte holding the opcode in its low nibble and the first shadow operand
+ * in its high nibble, a byte holding the second and third shadows (low
+ * nibble first), and then taint_trace_nargs[op] arguments, each an
+ * unsigned LEB128 number. Shadows are numbered as in TaintTraceShad.
+ */
+
+#define TAINT_TRACE_MAGIC "PANDATT"
+#define TAINT_TRACE_VERSION 1
+
+enum TaintTraceShad {
+    TT_NONE, TT_RAM, TT_LLV, TT_RET, TT_GRV, TT_GSV, TT_HD, TT_IO,
+    TT_NUM_SHADS
+};
+
+enum TaintTraceOp {
+    TT_COPY,         // dst, src: dest, src, size
+    TT_PARALLEL,     // shad: dest, src1, src2, size
+    TT_MIX,          // shad: dest, dest_size, src, src_size
+    TT_MIX_COMPUTE,  // shad: dest, dest_size, src1, src2, src_size
+    TT_MUL_COMPUTE,  // shad: dest, dest_size, src1, src2, src_size, arg1, arg2
+    TT_POINTER,      // dst, ptr, src (none = ptr only): dest, ptr, ptr_size,
+                     //     src, size
+    TT_DELETE,       // shad: dest, size
+    TT_SET,          // dst, src: dest, dest_size, src
+    TT_SEXT,         // shad: dest, dest_size, src, src_size
+    TT_LABEL,        // shad: addr, label
+    TT_LABEL_ADD,    // shad: addr, label
+    TT_PUSH_FRAME,   // shad: framesize
+    TT_POP_FRAME,    // shad: framesize
+    TT_RESET_FRAME,  // shad
+    TT_BLOCK,        // pc, guest instruction count
+    TT_BRANCH,       // shad: addr, size
+    TT_NUM_OPS
+};
+
+static const unsigned taint_trace_nargs[TT_NUM_OPS] = {
+    3, 4, 4, 5, 7, 5, 2, 3, 4, 2, 2, 1, 1, 0, 2, 2
+};
+
+#define TAINT_TRACE_MAX_ARGS 7
+
+struct TaintTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_shads;
+    uint64_t shad_size[TT_NUM_SHADS]; // indexed by TaintTraceShad
+};
+
+class Shad;
+struct ShadowState;
+
+extern "C" {
+
+// Set while a trace is being written.
+extern bool taint_tracing;
+
+// Writes one record; shadows that don't apply are NULL.
+void taint_trace_record(int op, Shad *s1, Shad *s2, Shad *s3,
+                        const uint64_t *args, unsigned nargs);
+
+}
+
+// The leading 0 of args_ lets ops without arguments use it too.
+#define TAINT_TRACE(op, s1, s2, s3, ...)                              \
+    do {                                                              \
+        if (taint_tracing) {                                          \
+            uint64_t args_[] = { 0, ## __VA_ARGS__ };                 \
+            taint_trace_record(op, s1, s2, s3, args_ + 1,             \
+                               sizeof(args_) / sizeof(args_[0]) - 1); \
+        }                                                             \
+    } while (0)
+
+bool taint_trace_open(const char *path, ShadowState *shadow);
+void taint_trace_close();
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * label_set_bench.cpp
+ * Microbenchmark of label_set_union throughput and label set memory use.
+ *
+ * Simulates taint propagation over a small "shadow memory" of label sets:
+ * bytes are labeled with consecutive labels, as file_taint does, and then
+ * repeatedly combined with their neighbors or with random other bytes, and
+ * occasionally relabeled. Sets growing past max_taintset_card labels are
+ * dropped, as taint2 does. Every so often the sets no longer stored anywhere
+ * are collected, as taint2 does between basic blocks.
+ *
+ * usage: label_set_bench [unions] [shadow bytes] [union cache size]
+ *            [collect interval] [max_taintset_card]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include <random>
+#include <vector>
+
+#include "label_set.h"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *when) {
+    LabelSetStats s = label_set_stats();
+    printf("%s: %" PRIu64 " sets (%" PRIu64 " bitmaps) %.1f MiB, "
+           "table %.1f MiB, %" PRIu64 " cached unions %.1f MiB\n",
+           when, s.sets, s.bitmap_sets, s.set_bytes / 1048576.0,
+           s.table_bytes / 1048576.0, s.cache_entries,
+           s.cache_bytes / 1048576.0);
+}
+
+int main(int argc, char **argv) {
+    uint64_t unions = argc > 1 ? strtoull(argv[1], NULL, 0) : 10000000;
+    uint64_t bytes = argc > 2 ? strtoull(argv[2], NULL, 0) : 1 << 16;
+    uint64_t cache_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 1 << 20;
+    uint64_t interval = argc > 4 ? strtoull(argv[4], NULL, 0) : 1 << 20;
+    uint64_t max_card = argc > 5 ? strtoull(argv[5], NULL, 0) : 64;
+
+    label_set_set_union_cache_size(cache_size);
+
+    std::mt19937_64 rng(42);
+    std::vector<LabelSetP> shadow(bytes);
+    for (uint64_t i = 0; i < bytes; i++) {
+        shadow[i] = label_set_singleton(i);
+    }
+
+    double start = now();
+    uint64_t last_collect = 0;
+    for (uint64_t n = 0; n < unions; n++) {
+        uint64_t r = rng();
+        uint64_t dst = r % bytes;
+        uint64_t src;
+        switch ((r >> 32) % 16) {
+            case 0:
+                // relabel
+                shadow[dst] = label_set_singleton(r >> 40);
+                continue;
+            case 1:
+                // random combination, e.g. a hash or table lookup
+                src = (r >> 16) % bytes;
+                break;
+            default:
+                // word-sized arithmetic on neighboring bytes
+                src = (dst + 1 + (r >> 40) % 7) % bytes;
+                break;
+        }
+        LabelSetP ls = label_set_union(shadow[dst], shadow[src]);
+        shadow[dst] = (max_card && ls && ls->size() > max_card) ? NULL : ls;
+
+        if (interval && n - last_collect >= interval) {
+            for (LabelSetP ls : shadow) label_set_mark(ls);
+            label_set_sweep();
+            last_collect = n;
+        }
+    }
+    double elapsed = now() - start;
+
+    LabelSetStats s = label_set_stats();
+    printf("%" PRIu64 " unions in %.3f sec: %.2f M unions/sec, "
+           "%.1f%% cache hits, %" PRIu64 " evictions\n",
+           unions, elapsed, unions / elapsed / 1e6,
+           100.0 * s.cache_hits / (s.unions ? s.unions : 1),
+           s.cache_evictions);
+    printf("%" PRIu64 " collections freed %" PRIu64 " sets\n",
+           s.collections, s.sets_freed);
+    report("before final collection");
+    for (LabelSetP ls : shadow) label_set_mark(ls);
+    label_set_sweep();
+    report("after final collection");
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("max rss %ld MiB\n", ru.ru_maxrss / 1024);
+    return 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * shad_bench.cpp
+ * Microbenchmark of the FastShad taint-op kernels.
+ *
+ * Runs a synthetic stream of the operations taint_ops.cpp issues against the
+ * LLVM register shadow -- copies, mixes, parallel computes and deletes of
+ * 1 to 16 byte registers, most of them untainted -- once through the virtual
+ * per-byte Shad interface, as taint_ops.cpp used to, and once through the
+ * FastShad kernels. Both runs must leave identical shadow memory.
+ *
+ * usage: shad_bench [ops] [percent of registers tainted] [passes]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <random>
+#include <vector>
+
+#include "shad.h"
+
+bool track_taint_state = false;
+uint32_t max_tcn = 0;
+uint32_t max_taintset_card = 0;
+
+void taint_state_changed(Shad *shad, uint64_t addr, uint64_t size) {}
+
+static const uint64_t NREGS = 4096;
+static const uint64_t REGSIZE = 16;
+
+struct Op {
+    int kind;
+    uint64_t dest, src1, src2, size;
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The per-byte loops taint_ops.cpp used for every shadow.
+static TaintData mixed_bytes(Shad *shad, uint64_t addr, uint64_t size) {
+    TaintData td(shad->query_full(addr));
+    for (uint64_t i = 1; i < size; ++i) {
+        td = TaintData::make_union(td, shad->query_full(addr + i), false);
+    }
+    td.increment_tcn();
+    return td;
+}
+
+static void run_bytes(Shad *shad, const std::vector<Op> &ops) {
+    for (const Op &op : ops) {
+        switch (op.kind) {
+            case 0:
+                Shad::copy(shad, op.dest, shad, op.src1, op.size);
+                break;
+            case 1: {
+                TaintData td = mixed_bytes(shad, op.src1, op.size);
+                for (uint64_t i = 0; i < op.size; ++i) {
+                    shad->set_full(op.dest + i, td);
+                }
+                break;
+            }
+            case 2:
+                for (uint64_t i = 0; i < op.size; ++i) {
+                    shad->set_full(op.dest + i, TaintData::make_union(
+                            shad->query_full(op.src1 + i),
+                            shad->query_full(op.src2 + i), true));
+                }
+                break;
+            case 3:
+                shad->remove(op.dest, op.size);
+                break;
+        }
+    }
+}
+
+// The same operations through the FastShad kernels.
+static void run_kernels(FastShad *shad, const std::vector<Op> &ops) {
+    for (const Op &op : ops) {
+        switch (op.kind) {
+            case 0:
+                FastShad::copy_range(shad, op.dest, shad, op.src1, op.size);
+                break;
+            case 1: {
+                TaintData td;
+                if (op.size == 1 || shad->any_tainted(op.src1, op.size)) {
+                    td = TaintData(shad->FastShad::query_full(op.src1));
+                    for (uint64_t i = 1; i < op.size; ++i) {
+                        td = TaintData::make_union(td,
+                                shad->FastShad::query_full(op.src1 + i),
+                                false);
+                    }
+                    td.increment_tcn();
+                }
+                shad->set_range(op.dest, op.size, td);
+                break;
+            }
+            case 2:
+                if (!shad->any_tainted(op.src1, op.size) &&
+                        !shad->any_tainted(op.src2, op.size)) {
+                    shad->set_range(op.dest, op.size, TaintData());
+                    break;
+                }
+                for (uint64_t i = 0; i < op.size; ++i) {
+                    shad->FastShad::set_full(op.dest + i,
+                            TaintData::make_union(
+                                shad->FastShad::query_full(op.src1 + i),
+                                shad->FastShad::query_full(op.src2 + i),
+                                true));
+                }
+                break;
+            case 3:
+                shad->remove(op.dest, op.size);
+                break;
+        }
+    }
+}
+
+static void seed(FastShad *shad, unsigned percent) {
+    std::mt19937_64 rng(1);
+    shad->remove(0, NREGS * REGSIZE);
+    for (uint64_t r = 0; r < NREGS; r++) {
+        if (rng() % 100 >= percent) continue;
+        for (uint64_t i = 0; i < REGSIZE; i++) {
+            shad->label(r * REGSIZE + i, label_set_singleton(r * REGSIZE + i));
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    uint64_t nops = argc > 1 ? strtoull(argv[1], NULL, 0) : 1 << 20;
+    unsigned percent = argc > 2 ? atoi(argv[2]) : 5;
+    unsigned passes = argc > 3 ? atoi(argv[3]) : 20;
+
+    static const uint64_t sizes[] = { 1, 2, 4, 8, 16 };
+    std::mt19937_64 rng(42);
+    std::vector<Op> ops(nops);
+    for (Op &op : ops) {
+        uint64_t r = rng();
+        op.kind = r % 4;
+        op.size = sizes[(r >> 8) % 5];
+        op.dest = ((r >> 16) % NREGS) * REGSIZE;
+        op.src1 = ((r >> 32) % NREGS) * REGSIZE;
+        op.src2 = ((r >> 48) % NREGS) * REGSIZE;
+        // deletes are rare next to moves and arithmetic
+        if (op.kind == 3 && (r >> 12) % 4) op.kind = 1;
+    }
+
+    FastShad bytes("bytes", NREGS * REGSIZE);
+    FastShad kernels("kernels", NREGS * REGSIZE);
+
+    // warm up the union cache, so that neither timed run pays for building
+    // the label sets
+    seed(&bytes, percent);
+    run_bytes(&bytes, ops);
+
+    seed(&bytes, percent);
+    seed(&kernels, percent);
+
+    // several passes over an op stream that fits in cache, so that reading
+    // it doesn't dominate
+    double start = now();
+    for (unsigned p = 0; p < passes; p++) run_bytes(&bytes, ops);
+    double t_bytes = now() - start;
+
+    start = now();
+    for (unsigned p = 0; p < passes; p++) run_kernels(&kernels, ops);
+    double t_kernels = now() - start;
+
+    for (uint64_t i = 0; i < NREGS * REGSIZE; i++) {
+        if (!(bytes.query_full(i) == kernels.query_full(i))) {
+            printf("shadow mismatch at %" PRIu64 "\n", i);
+            return 1;
+        }
+    }
+
+    nops *= passes;
+    printf("%" PRIu64 " ops, %u%% of registers tainted\n", nops, percent);
+    printf("per-byte: %.3f sec, %.2f M ops/sec\n", t_bytes,
+           nops / t_bytes / 1e6);
+    printf("kernels:  %.3f sec, %.2f M ops/sec (%.2fx)\n", t_kernels,
+           nops / t_kernels / 1e6, t_bytes / t_kernels);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#!/usr/bin/env python2.7
+
+# Measure the cost of callstack_instr on a replay, in blocks/second.
+#
+# usage: callstack_bench.py <qemu> <replay_base> [--runs N] [--mem SIZE]
+#            [--baseline-qemu QEMU]
+#
+# The recording is replayed without plugins and with callstack_instr loaded.
+# The block count comes from callstack_instr, which prints it on unload; a
+# replay executes the same blocks every time, so it applies to the run
+# without the plugin too. To compare against another version of the plugin,
+# pass the qemu it was built into as --baseline-qemu.
+
+import argparse
+import re
+import sys
+
+from replay_bench import run_replay_output
+
+BLOCKS_RE = re.compile(r"callstack_instr: (\d+) blocks, (\d+) stacks")
+
+def best_run(qemu, replay_base, extra_args, runs, mem):
+    best = None
+    output = ""
+    for i in range(runs):
+        (t, output) = run_replay_output(qemu, replay_base, extra_args, mem)
+        best = t if best is None else min(best, t)
+    return (best, output)
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark callstack_instr on a replay.")
+    parser.add_argument("qemu", help="path to qemu-system-<arch>")
+    parser.add_argument("replay_base", help="recording name, without -rr-snp/-rr-nondet.log")
+    parser.add_argument("--runs", type=int, default=3,
+                        help="number of replays per configuration (best is reported)")
+    parser.add_argument("--mem", default=None,
+                        help="guest RAM size the recording was made with (qemu -m)")
+    parser.add_argument("--baseline-qemu", default=None,
+                        help="qemu with another build of callstack_instr to compare against")
+    args = parser.parse_args()
+
+    configs = [("none", args.qemu, "")]
+    if args.baseline_qemu:
+        configs.append(("baseline", args.baseline_qemu, "-panda callstack_instr"))
+    configs.append(("callstack_instr", args.qemu, "-panda callstack_instr"))
+
+    results = []
+    blocks = None
+    for (name, qemu, extra_args) in configs:
+        (t, output) = best_run(qemu, args.replay_base, extra_args, args.runs, args.mem)
+        m = BLOCKS_RE.search(output)
+        if m:
+            blocks = int(m.group(1))
+            print "%-16s %8.2f sec, %s stacks at exit" % (name, t, m.group(2))
+        else:
+            print "%-16s %8.2f sec" % (name, t)
+        results.append((name, t))
+
+    if blocks is None:
+        print >>sys.stderr, "callstack_instr didn't report a block count"
+        sys.exit(1)
+
+    print
+    print "%d blocks" % blocks
+    print "%-16s %10s %12s" % ("config", "best sec", "Mblocks/sec")
+    for (name, t) in results:
+        print "%-16s %10.2f %12.2f" % (name, t, blocks / t / 1e6)
+
+if __name__ == "__main__":
+    main()
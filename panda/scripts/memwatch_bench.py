@@ -0,0 +1,76 @@
+#!/usr/bin/env python2.7
+
+# Compare the replay cost of watching one memory range with a memcb watch
+# region against enabling the memory callbacks for every access.
+#
+# usage: memwatch_bench.py <qemu> <replay_base> --addr ADDR [--size SIZE]
+#            [--phys] [--runs N] [--mem SIZE]
+#
+# The recording is replayed without plugins, with memwatch watching the
+# range, and with memwatch filtering every access itself (global=y). Both
+# memwatch runs must count the same reads and writes.
+
+import argparse
+import re
+import sys
+
+from replay_bench import run_replay_output
+
+COUNTS_RE = re.compile(r"memwatch: \[[^)]*\): (\d+) reads, (\d+) writes")
+
+def best_run(qemu, replay_base, extra_args, runs, mem):
+    best = None
+    output = ""
+    for i in range(runs):
+        (t, output) = run_replay_output(qemu, replay_base, extra_args, mem)
+        best = t if best is None else min(best, t)
+    return (best, output)
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark memcb watch regions against global memcb.")
+    parser.add_argument("qemu", help="path to qemu-system-<arch>")
+    parser.add_argument("replay_base", help="recording name, without -rr-snp/-rr-nondet.log")
+    parser.add_argument("--addr", required=True, help="start of the range to watch")
+    parser.add_argument("--size", default=None, help="size of the range (default: one page)")
+    parser.add_argument("--phys", action="store_true", help="ADDR is a physical address")
+    parser.add_argument("--runs", type=int, default=3,
+                        help="number of replays per configuration (best is reported)")
+    parser.add_argument("--mem", default=None,
+                        help="guest RAM size the recording was made with (qemu -m)")
+    args = parser.parse_args()
+
+    memwatch = "-panda memwatch:addr=%s" % args.addr
+    if args.size:
+        memwatch += ",size=%s" % args.size
+    if args.phys:
+        memwatch += ",phys=y"
+    configs = [
+        ("none", ""),
+        ("watch", memwatch),
+        ("global", memwatch + ",global=y"),
+    ]
+
+    results = []
+    counts = {}
+    for (name, extra_args) in configs:
+        (t, output) = best_run(args.qemu, args.replay_base, extra_args, args.runs, args.mem)
+        m = COUNTS_RE.search(output)
+        if m:
+            counts[name] = (int(m.group(1)), int(m.group(2)))
+            print "%-8s %8.2f sec, %d reads, %d writes" % ((name, t) + counts[name])
+        else:
+            print "%-8s %8.2f sec" % (name, t)
+        results.append((name, t))
+
+    if counts.get("watch") != counts.get("global"):
+        print >>sys.stderr, "watch and global counts differ"
+        sys.exit(1)
+
+    baseline = results[0][1]
+    print
+    print "%-8s %10s %9s" % ("config", "best sec", "slowdown")
+    for (name, t) in results:
+        print "%-8s %10.2f %8.2fx" % (name, t, t / baseline)
+
+if __name__ == "__main__":
+    main()
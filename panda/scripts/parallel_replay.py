@@ -0,0 +1,171 @@
+#!/usr/bin/env python2.7
+
+# Run an analysis over a recording in parallel, one process per segment.
+#
+# usage: parallel_replay.py <qemu> <replay_base> <pandalog> [--segments N]
+#            [--jobs J] [--workdir DIR] [--panda-args ARGS] [--mem SIZE]
+#
+# The recording is first cut into N back-to-back replays with
+# scissors:segments=N, a single replay without any analysis plugins.
+# Each segment is then replayed with the given plugins and its own
+# pandalog, up to J at a time, and the segment pandalogs are merged into
+# <pandalog>, with instruction counts shifted back to those of the
+# original recording. Pass --mem if the recording was made with a -m
+# other than the default.
+#
+# e.g. to run asidstory over rr-boot on 8 cores:
+#   parallel_replay.py i386-softmmu/qemu-system-i386 \
+#       $PANDA_REGRESSION_DIR/replays/rr-boot/rr-boot-test boot.plog \
+#       --segments 8 --panda-args "-os linux-32-debian:3.2.0-4-686-pae -panda asidstory"
+#
+# Segments already present in the work directory are reused, so the same
+# split can be analyzed with different plugins. Analyses that carry state
+# across the whole replay (e.g. taint) will of course see each segment
+# start from scratch.
+
+import argparse
+import multiprocessing
+import os
+import shlex
+import struct
+import subprocess
+import sys
+import time
+import zlib
+
+from plog_reader import PLogReader
+
+# from panda/include/panda/plog-cc.hpp
+PL_CURRENT_VERSION = 2
+PL_CHUNKSIZE = 16 * 1024 * 1024
+PL_HEADER_SIZE = 128
+NO_INSTR = 2**64 - 1
+
+class PLogWriter(object):
+    def __init__(self, fn):
+        self.f = open(fn, "wb")
+        self.f.seek(PL_HEADER_SIZE)
+        self.dir = []
+        self.buf = []
+        self.buf_size = 0
+        self.buf_instr = None
+        self.last_instr = None
+
+    def write(self, msg):
+        data = msg.SerializeToString()
+        data = struct.pack("<I", len(data)) + data
+        # all entries for an instruction go in the same chunk
+        if (self.buf and msg.instr != self.last_instr
+                and self.buf_size + len(data) >= PL_CHUNKSIZE):
+            self.flush()
+        if not self.buf:
+            self.buf_instr = msg.instr
+        self.buf.append(data)
+        self.buf_size += len(data)
+        self.last_instr = msg.instr
+
+    def flush(self):
+        if not self.buf:
+            return
+        self.dir.append((self.buf_instr, self.f.tell(), len(self.buf)))
+        self.f.write(zlib.compress("".join(self.buf), 9))
+        self.buf = []
+        self.buf_size = 0
+
+    def close(self):
+        self.flush()
+        dir_pos = self.f.tell()
+        self.f.write(struct.pack("<I", len(self.dir)))
+        for entry in self.dir:
+            self.f.write(struct.pack("<QQQ", *entry))
+        self.f.seek(0)
+        self.f.write(struct.pack("<IIQII", PL_CURRENT_VERSION, 0, dir_pos,
+                                 PL_CHUNKSIZE, 0))
+        self.f.close()
+
+# qemu arguments for the guest RAM size, if not the default
+def mem_args(mem):
+    return ["-m", mem] if mem else []
+
+def split(qemu, replay_base, base, segments, mem):
+    cmd = [qemu, "-display", "none", "-replay", replay_base,
+           "-panda", "scissors:name=%s,segments=%d" % (base, segments)]
+    cmd += mem_args(mem)
+    print "splitting %s into %d segments" % (replay_base, segments)
+    subprocess.check_call(cmd, stdout=open(base + "-split.out", "w"),
+                          stderr=subprocess.STDOUT)
+
+def run_segment(job):
+    (qemu, name, panda_args, mem) = job
+    cmd = [qemu, "-display", "none", "-replay", name,
+           "-pandalog", name + ".plog"] + mem_args(mem) + shlex.split(panda_args)
+    start = time.time()
+    with open(name + ".out", "w") as out:
+        ret = subprocess.call(cmd, stdout=out, stderr=subprocess.STDOUT)
+    return (name, ret, time.time() - start)
+
+def merge(segments, pandalog):
+    out = PLogWriter(pandalog)
+    for (i, (name, start, end)) in enumerate(segments):
+        with PLogReader(name + ".plog") as plr:
+            for (j, msg) in enumerate(plr):
+                # every pandalog starts with an empty entry; keep only one
+                if j == 0 and i > 0:
+                    continue
+                if msg.instr != NO_INSTR:
+                    msg.instr += start
+                out.write(msg)
+    out.close()
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay a recording in parallel segments.")
+    parser.add_argument("qemu", help="path to qemu-system-<arch>")
+    parser.add_argument("replay_base", help="recording name, without -rr-snp/-rr-nondet.log")
+    parser.add_argument("pandalog", help="merged pandalog to write")
+    parser.add_argument("--segments", type=int, default=multiprocessing.cpu_count())
+    parser.add_argument("--jobs", type=int, default=multiprocessing.cpu_count(),
+                        help="number of segments to replay at once")
+    parser.add_argument("--workdir", default=None,
+                        help="where to keep segments (default: <pandalog>.segments)")
+    parser.add_argument("--panda-args", default="",
+                        help="qemu arguments for the analysis, e.g. \"-panda asidstory\"")
+    parser.add_argument("--mem", default=None,
+                        help="guest RAM size the recording was made with (qemu -m)")
+    args = parser.parse_args()
+
+    workdir = args.workdir or args.pandalog + ".segments"
+    if not os.path.isdir(workdir):
+        os.makedirs(workdir)
+    base = os.path.join(workdir, os.path.basename(args.replay_base))
+
+    manifest = base + "-segments"
+    if not os.path.exists(manifest) or \
+            len(open(manifest).readlines()) != args.segments:
+        start = time.time()
+        split(args.qemu, args.replay_base, base, args.segments, args.mem)
+        print "split in %.2f sec" % (time.time() - start)
+    segments = []
+    for line in open(manifest):
+        (name, start, end) = line.split()
+        segments.append((name, int(start), int(end)))
+
+    start = time.time()
+    pool = multiprocessing.Pool(args.jobs)
+    jobs = [(args.qemu, name, args.panda_args, args.mem)
+            for (name, _, _) in segments]
+    failed = False
+    for (name, ret, t) in pool.imap(run_segment, jobs):
+        print "%-40s %8.2f sec%s" % (os.path.basename(name), t,
+                                     "" if ret == 0 else "  FAILED, see %s.out" % name)
+        failed = failed or ret != 0
+    pool.close()
+    pool.join()
+    print "replayed %d segments in %.2f sec" % (len(segments), time.time() - start)
+    if failed:
+        sys.exit(1)
+
+    merge(segments, args.pandalog)
+    print "wrote %s" % args.pandalog
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,76 @@
+#!/usr/bin/env python2.7
+
+# Time replays of a recording under a number of PANDA configurations.
+#
+# usage: replay_bench.py <qemu> <replay_base> [--runs N] [--mem SIZE]
+#            [--config NAME=ARGS]...
+#
+# e.g. to compare chained and unchained replay of the rr-boot recording:
+#   replay_bench.py i386-softmmu/qemu-system-i386 \
+#       $PANDA_REGRESSION_DIR/replays/rr-boot/rr-boot-test \
+#       --config unchained= --config chained=-replay-chaining
+#
+# Without any --config the chained vs. unchained comparison is run. Pass
+# --mem if the recording was made with a -m other than the default.
+
+import argparse
+import shlex
+import subprocess
+import sys
+import time
+
+DEFAULT_CONFIGS = [
+    ("unchained", ""),
+    ("chained", "-replay-chaining"),
+]
+
+def run_replay(qemu, replay_base, extra_args, mem=None):
+    return run_replay_output(qemu, replay_base, extra_args, mem)[0]
+
+# Like run_replay, but also returns qemu's output, for callers that parse
+# what plugins print.
+def run_replay_output(qemu, replay_base, extra_args, mem=None):
+    cmd = [qemu, "-display", "none", "-replay", replay_base]
+    if mem:
+        cmd += ["-m", mem]
+    cmd += shlex.split(extra_args)
+    start = time.time()
+    output = subprocess.check_output(cmd, stderr=subprocess.STDOUT)
+    elapsed = time.time() - start
+    if "Replay completed successfully" not in output:
+        print >>sys.stderr, output
+        raise RuntimeError("replay did not complete: %s" % " ".join(cmd))
+    return (elapsed, output)
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark PANDA replay speed.")
+    parser.add_argument("qemu", help="path to qemu-system-<arch>")
+    parser.add_argument("replay_base", help="recording name, without -rr-snp/-rr-nondet.log")
+    parser.add_argument("--runs", type=int, default=3,
+                        help="number of replays per configuration (best is reported)")
+    parser.add_argument("--mem", default=None,
+                        help="guest RAM size the recording was made with (qemu -m)")
+    parser.add_argument("--config", action="append", default=[],
+                        metavar="NAME=ARGS",
+                        help="named set of extra qemu arguments to benchmark")
+    args = parser.parse_args()
+
+    configs = [tuple(c.split("=", 1)) for c in args.config] or DEFAULT_CONFIGS
+
+    results = []
+    for (name, extra_args) in configs:
+        times = []
+        for i in range(args.runs):
+            t = run_replay(args.qemu, args.replay_base, extra_args, args.mem)
+            print "%-16s run %d: %8.2f sec" % (name, i, t)
+            times.append(t)
+        results.append((name, min(times)))
+
+    baseline = results[0][1]
+    print
+    print "%-16s %10s %8s" % ("config", "best sec", "speedup")
+    for (name, t) in results:
+        print "%-16s %10.2f %7.2fx" % (name, t, baseline / t)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,109 @@
+#!/usr/bin/env python2.7
+
+# Measure reverse-step latency of time-travel debugging.
+#
+# usage: reverse_step_bench.py <qemu> <replay_base> <instr> [--steps N]
+#            [--checkpoint-args ARGS] [--port PORT] [--mem SIZE]
+#
+# Starts a replay with the checkpoint plugin and the gdb stub, runs forward
+# to guest instruction count <instr>, then issues N reverse-steps over the
+# gdb remote protocol, reporting how long each one takes to stop again.
+# Pass --mem if the recording was made with a -m other than the default.
+#
+# e.g. to compare incremental and full-only checkpoints:
+#   reverse_step_bench.py i386-softmmu/qemu-system-i386 \
+#       $PANDA_REGRESSION_DIR/replays/rr-boot/rr-boot-test 50000000
+#   reverse_step_bench.py ... --checkpoint-args full_interval=1
+
+import argparse
+import socket
+import subprocess
+import time
+
+def checksum(data):
+    return "%02x" % (sum(ord(c) for c in data) % 256)
+
+class GdbRemote(object):
+    def __init__(self, port):
+        for _ in range(100):
+            try:
+                self.sock = socket.create_connection(("localhost", port))
+                break
+            except socket.error:
+                time.sleep(0.1)
+        else:
+            raise RuntimeError("could not connect to gdb stub on port %d" % port)
+        self.buf = ""
+
+    def send(self, data):
+        self.sock.sendall("$%s#%s" % (data, checksum(data)))
+
+    def recv(self):
+        # skip acks and read one packet
+        while True:
+            while "#" not in self.buf or len(self.buf) < self.buf.index("#") + 3:
+                chunk = self.sock.recv(4096)
+                if not chunk:
+                    raise RuntimeError("gdb stub closed the connection")
+                self.buf += chunk
+            start = self.buf.find("$")
+            end = self.buf.index("#")
+            if start < 0 or start > end:
+                self.buf = self.buf[end + 3:]
+                continue
+            packet = self.buf[start + 1:end]
+            self.buf = self.buf[end + 3:]
+            self.sock.sendall("+")
+            return packet
+
+    def command(self, data):
+        self.send(data)
+        return self.recv()
+
+    def panda_cmd(self, *args):
+        return self.command(":".join(("qPandaCmd",) + args)).decode("hex")
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark reverse-step latency.")
+    parser.add_argument("qemu", help="path to qemu-system-<arch>")
+    parser.add_argument("replay_base", help="recording name, without -rr-snp/-rr-nondet.log")
+    parser.add_argument("instr", type=int, help="instruction count to reverse-step from")
+    parser.add_argument("--steps", type=int, default=20)
+    parser.add_argument("--checkpoint-args", default="",
+                        help="arguments for the checkpoint plugin, e.g. full_interval=1")
+    parser.add_argument("--port", type=int, default=1234)
+    parser.add_argument("--mem", default=None,
+                        help="guest RAM size the recording was made with (qemu -m)")
+    args = parser.parse_args()
+
+    plugin = "checkpoint"
+    if args.checkpoint_args:
+        plugin += ":" + args.checkpoint_args
+    cmd = [args.qemu, "-display", "none", "-replay", args.replay_base,
+           "-S", "-gdb", "tcp::%d" % args.port, "-panda", plugin]
+    if args.mem:
+        cmd += ["-m", args.mem]
+    qemu = subprocess.Popen(cmd, stdout=open("/dev/null", "w"))
+    try:
+        gdb = GdbRemote(args.port)
+        gdb.panda_cmd("rrbreakpoint", str(args.instr))
+        gdb.command("c")
+        print "stopped at instr %s" % gdb.panda_cmd("when")
+
+        times = []
+        for i in range(args.steps):
+            start = time.time()
+            gdb.command("bs")
+            times.append(time.time() - start)
+            print "reverse-step %3d: %8.3f sec, now at instr %s" % (
+                i, times[-1], gdb.panda_cmd("when"))
+
+        times.sort()
+        print
+        print "min %.3f  median %.3f  max %.3f sec" % (
+            times[0], times[len(times) / 2], times[-1])
+    finally:
+        qemu.kill()
+
+if __name__ == "__main__":
+    main()
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include "panda/plugin.h"
 #include "panda/callback_support.h"
+#include "panda/cb_profile.h"
 #include "panda/common.h"
 
 #include "panda/rr/rr_log.h"
@@ -14,10 +15,8 @@ void panda_callbacks_hd_transfer(CPUState *cpu, Hd_transfer_type type, uint64_t
 {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_REPLAY_HD_TRANSFER];
-             plist != NULL;
-             plist = panda_cb_list_next(plist)) {
-                 plist->entry.replay_hd_transfer(cpu, type, src_addr, dest_addr, num_bytes);
+        PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_HD_TRANSFER) {
+                 PANDA_CB_CALL(plist, plist->entry.replay_hd_transfer(cpu, type, src_addr, dest_addr, num_bytes));
         }
     }
 }
@@ -25,20 +24,16 @@ void panda_callbacks_hd_transfer(CPUState *cpu, Hd_transfer_type type, uint64_t
 void panda_callbacks_handle_packet(CPUState *cpu, uint8_t *buf, size_t size, uint8_t direction, uint64_t old_buf_addr) {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_REPLAY_HANDLE_PACKET];
-             plist != NULL;
-             plist = panda_cb_list_next(plist)) {
-                 plist->entry.replay_handle_packet(cpu, buf, size, direction, old_buf_addr);
+        PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_HANDLE_PACKET) {
+                 PANDA_CB_CALL(plist, plist->entry.replay_handle_packet(cpu, buf, size, direction, old_buf_addr));
         }
     }
 }
 void panda_callbacks_net_transfer(CPUState *cpu, Net_transfer_type type, uint64_t src_addr, uint64_t dst_addr, uint32_t num_bytes) {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_REPLAY_NET_TRANSFER];
-             plist != NULL;
-             plist = panda_cb_list_next(plist)) {
-                 plist->entry.replay_net_transfer(cpu, type, src_addr, dst_addr, num_bytes);
+        PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_NET_TRANSFER) {
+                 PANDA_CB_CALL(plist, plist->entry.replay_net_transfer(cpu, type, src_addr, dst_addr, num_bytes));
         }
     }
 }
@@ -47,9 +42,8 @@ void panda_callbacks_net_transfer(CPUState *cpu, Net_transfer_type type, uint64_
 void panda_callbacks_before_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write) {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_REPLAY_BEFORE_DMA];
-             plist != NULL; plist = panda_cb_list_next(plist)) {
-            plist->entry.replay_before_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l);
+        PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_BEFORE_DMA) {
+            PANDA_CB_CALL(plist, plist->entry.replay_before_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l));
         }
     }
 }
@@ -57,9 +51,8 @@ void panda_callbacks_before_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf,
 void panda_callbacks_after_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf, hwaddr l, int is_write) {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-       for (plist = panda_cbs[PANDA_CB_REPLAY_AFTER_DMA];
-            plist != NULL; plist = panda_cb_list_next(plist)) {
-            plist->entry.replay_after_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l);
+        PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_AFTER_DMA) {
+            PANDA_CB_CALL(plist, plist->entry.replay_after_dma(cpu, is_write, (uint8_t *) buf, (uint64_t) addr1, l));
         }
     }
 }
@@ -67,36 +60,32 @@ void panda_callbacks_after_dma(CPUState *cpu, hwaddr addr1, const uint8_t *buf,
 // These are used in cpu-exec.c
 void panda_callbacks_before_block_exec(CPUState *cpu, TranslationBlock *tb) {
     panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC];
-         plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.before_block_exec(cpu, tb);
+    PANDA_CB_FOREACH(plist, PANDA_CB_BEFORE_BLOCK_EXEC) {
+        PANDA_CB_CALL(plist, plist->entry.before_block_exec(cpu, tb));
     }
 }
 
 
 void panda_callbacks_after_block_exec(CPUState *cpu, TranslationBlock *tb) {
     panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_AFTER_BLOCK_EXEC];
-         plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.after_block_exec(cpu, tb);
+    PANDA_CB_FOREACH(plist, PANDA_CB_AFTER_BLOCK_EXEC) {
+        PANDA_CB_CALL(plist, plist->entry.after_block_exec(cpu, tb));
     }
 }
 
 
 void panda_callbacks_before_block_translate(CPUState *cpu, target_ulong pc) {
     panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_TRANSLATE];
-         plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.before_block_translate(cpu, pc);
+    PANDA_CB_FOREACH(plist, PANDA_CB_BEFORE_BLOCK_TRANSLATE) {
+        PANDA_CB_CALL(plist, plist->entry.before_block_translate(cpu, pc));
     }
 }
 
 
 void panda_callbacks_after_block_translate(CPUState *cpu, TranslationBlock *tb) {
     panda_cb_list *plist;
-    for (plist = panda_cbs[PANDA_CB_AFTER_BLOCK_TRANSLATE];
-         plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.after_block_translate(cpu, tb);
+    PANDA_CB_FOREACH(plist, PANDA_CB_AFTER_BLOCK_TRANSLATE) {
+        PANDA_CB_CALL(plist, plist->entry.after_block_translate(cpu, tb));
     }
 }
 
@@ -114,16 +103,16 @@ void panda_before_find_fast(void) {
     if (panda_flush_tb()) {
         tb_flush(first_cpu);
     }
+    panda_cb_tables_reclaim();
 }
 
 
 bool panda_callbacks_after_find_fast(CPUState *cpu, TranslationBlock *tb, bool bb_invalidate_done, bool *invalidate) {
     panda_cb_list *plist;
     if (!bb_invalidate_done) {
-        for(plist = panda_cbs[PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT];
-            plist != NULL; plist = panda_cb_list_next(plist)) {
-            *invalidate |=
-                plist->entry.before_block_exec_invalidate_opt(cpu, tb);
+        PANDA_CB_FOREACH(plist, PANDA_CB_BEFORE_BLOCK_EXEC_INVALIDATE_OPT) {
+            PANDA_CB_CALL(plist, *invalidate |=
+                plist->entry.before_block_exec_invalidate_opt(cpu, tb));
         }
         return true;
     }
@@ -135,9 +124,8 @@ bool panda_callbacks_after_find_fast(CPUState *cpu, TranslationBlock *tb, bool b
 bool panda_callbacks_insn_translate(CPUState *env, target_ulong pc) {
     panda_cb_list *plist;
     bool panda_exec_cb = false;
-    for(plist = panda_cbs[PANDA_CB_INSN_TRANSLATE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        panda_exec_cb |= plist->entry.insn_translate(env, pc);
+    PANDA_CB_FOREACH(plist, PANDA_CB_INSN_TRANSLATE) {
+        PANDA_CB_CALL(plist, panda_exec_cb |= plist->entry.insn_translate(env, pc));
     }
     return panda_exec_cb;
 }
@@ -145,9 +133,8 @@ bool panda_callbacks_insn_translate(CPUState *env, target_ulong pc) {
 bool panda_callbacks_after_insn_translate(CPUState *env, target_ulong pc) {
     panda_cb_list *plist;
     bool panda_exec_cb = false;
-    for(plist = panda_cbs[PANDA_CB_AFTER_INSN_TRANSLATE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        panda_exec_cb |= plist->entry.after_insn_translate(env, pc);
+    PANDA_CB_FOREACH(plist, PANDA_CB_AFTER_INSN_TRANSLATE) {
+        PANDA_CB_CALL(plist, panda_exec_cb |= plist->entry.after_insn_translate(env, pc));
     }
     return panda_exec_cb;
 }
@@ -173,17 +160,15 @@ void panda_callbacks_before_mem_read(CPUState *env, target_ulong pc,
                                      target_ulong addr, uint32_t data_size,
                                      void *ram_ptr) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_READ]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_before_read(env, env->panda_guest_pc, addr,
-                                          data_size);
+    PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_BEFORE_READ) {
+        PANDA_CB_CALL(plist, plist->entry.virt_mem_before_read(env, env->panda_guest_pc, addr,
+                                                               data_size));
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]) {
+    if (panda_cb_any(PANDA_CB_PHYS_MEM_BEFORE_READ)) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_before_read(env, env->panda_guest_pc, paddr,
-                                              data_size);
+        PANDA_CB_FOREACH(plist, PANDA_CB_PHYS_MEM_BEFORE_READ) {
+            PANDA_CB_CALL(plist, plist->entry.phys_mem_before_read(env, env->panda_guest_pc, paddr,
+                                                                   data_size));
         }
     }
 }
@@ -193,17 +178,15 @@ void panda_callbacks_after_mem_read(CPUState *env, target_ulong pc,
                                     target_ulong addr, uint32_t data_size,
                                     uint64_t result, void *ram_ptr) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_READ]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_after_read(env, env->panda_guest_pc, addr,
-                                         data_size, &result);
+    PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_AFTER_READ) {
+        PANDA_CB_CALL(plist, plist->entry.virt_mem_after_read(env, env->panda_guest_pc, addr,
+                                                              data_size, &result));
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]) {
+    if (panda_cb_any(PANDA_CB_PHYS_MEM_AFTER_READ)) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_READ]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_after_read(env, env->panda_guest_pc, paddr,
-                                             data_size, &result);
+        PANDA_CB_FOREACH(plist, PANDA_CB_PHYS_MEM_AFTER_READ) {
+            PANDA_CB_CALL(plist, plist->entry.phys_mem_after_read(env, env->panda_guest_pc, paddr,
+                                                                  data_size, &result));
         }
     }
 }
@@ -213,17 +196,15 @@ void panda_callbacks_before_mem_write(CPUState *env, target_ulong pc,
                                       target_ulong addr, uint32_t data_size,
                                       uint64_t val, void *ram_ptr) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_BEFORE_WRITE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_before_write(env, env->panda_guest_pc, addr,
-                                           data_size, &val);
+    PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_BEFORE_WRITE) {
+        PANDA_CB_CALL(plist, plist->entry.virt_mem_before_write(env, env->panda_guest_pc, addr,
+                                                                data_size, &val));
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]) {
+    if (panda_cb_any(PANDA_CB_PHYS_MEM_BEFORE_WRITE)) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_BEFORE_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_before_write(env, env->panda_guest_pc, paddr,
-                                               data_size, &val);
+        PANDA_CB_FOREACH(plist, PANDA_CB_PHYS_MEM_BEFORE_WRITE) {
+            PANDA_CB_CALL(plist, plist->entry.phys_mem_before_write(env, env->panda_guest_pc, paddr,
+                                                                    data_size, &val));
         }
     }
 }
@@ -233,17 +214,15 @@ void panda_callbacks_after_mem_write(CPUState *env, target_ulong pc,
                                      target_ulong addr, uint32_t data_size,
                                      uint64_t val, void *ram_ptr) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_VIRT_MEM_AFTER_WRITE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.virt_mem_after_write(env, env->panda_guest_pc, addr,
-                                          data_size, &val);
+    PANDA_CB_FOREACH(plist, PANDA_CB_VIRT_MEM_AFTER_WRITE) {
+        PANDA_CB_CALL(plist, plist->entry.virt_mem_after_write(env, env->panda_guest_pc, addr,
+                                                               data_size, &val));
     }
-    if (panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]) {
+    if (panda_cb_any(PANDA_CB_PHYS_MEM_AFTER_WRITE)) {
         hwaddr paddr = get_paddr(env, addr, ram_ptr);
-        for(plist = panda_cbs[PANDA_CB_PHYS_MEM_AFTER_WRITE]; plist != NULL;
-            plist = panda_cb_list_next(plist)) {
-            plist->entry.phys_mem_after_write(env, env->panda_guest_pc, paddr,
-                                              data_size, &val);
+        PANDA_CB_FOREACH(plist, PANDA_CB_PHYS_MEM_AFTER_WRITE) {
+            PANDA_CB_CALL(plist, plist->entry.phys_mem_after_write(env, env->panda_guest_pc, paddr,
+                                                                   data_size, &val));
         }
     }
 }
@@ -252,17 +231,15 @@ void panda_callbacks_after_mem_write(CPUState *env, target_ulong pc,
 // vl.c
 void panda_callbacks_after_machine_init(void) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_AFTER_MACHINE_INIT]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.after_machine_init(first_cpu);
+    PANDA_CB_FOREACH(plist, PANDA_CB_AFTER_MACHINE_INIT) {
+        PANDA_CB_CALL(plist, plist->entry.after_machine_init(first_cpu));
     }
 }
 
 void panda_callbacks_top_loop(void) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_TOP_LOOP]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.top_loop(first_cpu);
+    PANDA_CB_FOREACH(plist, PANDA_CB_TOP_LOOP) {
+        PANDA_CB_CALL(plist, plist->entry.top_loop(first_cpu));
     }
 }
 
@@ -270,25 +247,29 @@ void panda_callbacks_top_loop(void) {
 // target-i386/misc_helpers.c
 void panda_callbacks_cpuid(CPUState *env) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_GUEST_HYPERCALL]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.guest_hypercall(env);
+    PANDA_CB_FOREACH(plist, PANDA_CB_GUEST_HYPERCALL) {
+        PANDA_CB_CALL(plist, plist->entry.guest_hypercall(env));
     }
 }
 
 
 void panda_callbacks_cpu_restore_state(CPUState *env, TranslationBlock *tb) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_CPU_RESTORE_STATE]; plist != NULL;
-        plist = panda_cb_list_next(plist)) {
-        plist->entry.cb_cpu_restore_state(env, tb);
+    PANDA_CB_FOREACH(plist, PANDA_CB_CPU_RESTORE_STATE) {
+        PANDA_CB_CALL(plist, plist->entry.cb_cpu_restore_state(env, tb));
     }
 }
 
 
 void panda_callbacks_asid_changed(CPUState *env, target_ulong old_asid, target_ulong new_asid) {
     panda_cb_list *plist;
-    for(plist = panda_cbs[PANDA_CB_ASID_CHANGED]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.asid_changed(env, old_asid, new_asid);
+    panda_v2p_cache_flush();
+    // global pages survive the switch, but may be watched in one asid only
+    if (panda_memcb_watch_per_asid) {
+        tlb_flush(env);
+    }
+    PANDA_CB_FOREACH(plist, PANDA_CB_ASID_CHANGED) {
+        PANDA_CB_CALL(plist, plist->entry.asid_changed(env, old_asid, new_asid));
     }
 }
 
@@ -297,9 +278,8 @@ void panda_callbacks_serial_receive(CPUState *cpu, uint64_t fifo_addr,
 {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_REPLAY_SERIAL_RECEIVE]; plist != NULL;
-             plist = panda_cb_list_next(plist)) {
-            plist->entry.replay_serial_receive(cpu, fifo_addr, value);
+        PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_SERIAL_RECEIVE) {
+            PANDA_CB_CALL(plist, plist->entry.replay_serial_receive(cpu, fifo_addr, value));
         }
     }
 }
@@ -309,9 +289,8 @@ void panda_callbacks_serial_read(CPUState *cpu, uint64_t fifo_addr,
 {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_REPLAY_SERIAL_READ]; plist != NULL;
-             plist = panda_cb_list_next(plist)) {
-            plist->entry.replay_serial_read(cpu, fifo_addr, port_addr, value);
+        PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_SERIAL_READ) {
+            PANDA_CB_CALL(plist, plist->entry.replay_serial_read(cpu, fifo_addr, port_addr, value));
         }
     }
 }
@@ -321,9 +300,8 @@ void panda_callbacks_serial_send(CPUState *cpu, uint64_t fifo_addr,
 {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_REPLAY_SERIAL_SEND]; plist != NULL;
-             plist = panda_cb_list_next(plist)) {
-            plist->entry.replay_serial_send(cpu, fifo_addr, value);
+        PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_SERIAL_SEND) {
+            PANDA_CB_CALL(plist, plist->entry.replay_serial_send(cpu, fifo_addr, value));
         }
     }
 }
@@ -333,9 +311,8 @@ void panda_callbacks_serial_write(CPUState *cpu, uint64_t fifo_addr,
 {
     if (rr_mode == RR_REPLAY) {
         panda_cb_list *plist;
-        for (plist = panda_cbs[PANDA_CB_REPLAY_SERIAL_WRITE]; plist != NULL;
-             plist = panda_cb_list_next(plist)) {
-            plist->entry.replay_serial_write(cpu, fifo_addr, port_addr, value);
+        PANDA_CB_FOREACH(plist, PANDA_CB_REPLAY_SERIAL_WRITE) {
+            PANDA_CB_CALL(plist, plist->entry.replay_serial_write(cpu, fifo_addr, port_addr, value));
         }
     }
 }
@@ -31,6 +31,7 @@ PANDAENDCOMMENT */
 #endif
 
 #include "panda/common.h"
+#include "panda/cb_profile.h"
 
 const gchar *panda_bool_true_strings[] =  {"y", "yes", "true", "1", NULL};
 const gchar *panda_bool_false_strings[] = {"n", "no", "false", "0", NULL};
@@ -44,6 +45,16 @@ WARNING: This is all gloriously thread-unsafe!!!
 // Array of pointers to PANDA callback lists, one per callback type
 panda_cb_list *panda_cbs[PANDA_CB_LAST];
 
+// Enabled callbacks of each type, for dispatch. Replaced tables are freed
+// between blocks, as a dispatch may be going through them when they are.
+static panda_cb_list *panda_cb_empty_table[1] = { NULL };
+panda_cb_list **panda_cb_tables[PANDA_CB_LAST] = {
+    [0 ... PANDA_CB_LAST - 1] = panda_cb_empty_table
+};
+uint64_t panda_cbs_enabled = 0;
+static GPtrArray *panda_cb_retired_tables;
+QEMU_BUILD_BUG_ON(PANDA_CB_LAST > 64);
+
 // Storage for command line options
 const gchar *panda_argv[MAX_PANDA_PLUGIN_ARGS];
 int panda_argc;
@@ -62,6 +73,7 @@ bool panda_please_flush_tb = false;
 bool panda_update_pc = false;
 bool panda_use_memcb = false;
 bool panda_tb_chaining = true;
+bool panda_retry_access = false;
 
 bool panda_help_wanted = false;
 bool panda_plugin_load_failed = false;
@@ -190,6 +202,7 @@ void panda_do_unload_plugin(int plugin_idx){
     else {
         uninit_fn(plugin);
     }
+    panda_cb_profile_retire(plugin);
     panda_unregister_callbacks(plugin);
     panda_delete_plugin(plugin_idx);
     dlclose(plugin);
@@ -214,6 +227,9 @@ void panda_unload_plugin_idx(int plugin_idx) {
 }
 
 void panda_unload_plugins(void) {
+    if (panda_cb_profiling) {
+        panda_cb_profile_report(stderr, fprintf);
+    }
     // Unload them starting from the end to avoid having to shuffle everything
     // down each time
     while (nb_panda_plugins > 0) {
@@ -229,6 +245,54 @@ void *panda_get_plugin_by_name(const char *plugin_name) {
     return NULL;
 }
 
+/**
+ * @brief Rebuilds the dispatch table of callback type \p type from its list.
+ */
+static void panda_cb_table_update(panda_cb_type type) {
+    int n = 0;
+    for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+        if (plist->enabled) n++;
+    }
+
+    panda_cb_list **table = panda_cb_empty_table;
+    if (n > 0) {
+        table = g_new(panda_cb_list *, n + 1);
+        int i = 0;
+        for (panda_cb_list *plist = panda_cbs[type]; plist != NULL; plist = plist->next) {
+            if (plist->enabled) table[i++] = plist;
+        }
+        table[i] = NULL;
+        panda_cbs_enabled |= PANDA_CB_BIT(type);
+    } else {
+        panda_cbs_enabled &= ~PANDA_CB_BIT(type);
+    }
+
+    panda_cb_list **old = panda_cb_tables[type];
+    atomic_rcu_set(&panda_cb_tables[type], table);
+    if (old != panda_cb_empty_table) {
+        if (!panda_cb_retired_tables) panda_cb_retired_tables = g_ptr_array_new();
+        g_ptr_array_add(panda_cb_retired_tables, old);
+    }
+}
+
+static void panda_cb_tables_update(void) {
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        panda_cb_table_update(i);
+    }
+}
+
+/**
+ * @brief Frees the dispatch tables replaced since the last call. Only call
+ * it between blocks, when no callback is being dispatched.
+ */
+void panda_cb_tables_reclaim(void) {
+    if (!panda_cb_retired_tables) return;
+    for (guint i = 0; i < panda_cb_retired_tables->len; i++) {
+        g_free(g_ptr_array_index(panda_cb_retired_tables, i));
+    }
+    g_ptr_array_set_size(panda_cb_retired_tables, 0);
+}
+
 /**
  * @brief Adds callback to the tail of the callback list and enables it.
  *
@@ -258,6 +322,7 @@ void panda_register_callback(void *plugin, panda_cb_type type, panda_cb cb) {
     else {
         panda_cbs[type] = new_list;
     }
+    panda_cb_table_update(type);
 }
 
 /**
@@ -284,6 +349,7 @@ void panda_disable_callback(void *plugin, panda_cb_type type, panda_cb cb) {
     }
     // no callback found to disable
     assert(found);
+    panda_cb_table_update(type);
 }
 
 /**
@@ -310,6 +376,7 @@ void panda_enable_callback(void *plugin, panda_cb_type type, panda_cb cb) {
     }
     // no callback found to enable
     assert(found);
+    panda_cb_table_update(type);
 }
 
 /**
@@ -320,6 +387,7 @@ void panda_enable_callback(void *plugin, panda_cb_type type, panda_cb cb) {
  * different.
  */
 void panda_unregister_callbacks(void *plugin) {
+    memcb_unwatch_plugin(plugin);
     for (int i = 0; i < PANDA_CB_LAST; i++) {
         panda_cb_list *plist;
         plist = panda_cbs[i];
@@ -351,6 +419,7 @@ void panda_unregister_callbacks(void *plugin) {
         // update head
         panda_cbs[i] = plist_head;
     }
+    panda_cb_tables_update();
 }
 
 /**
@@ -371,6 +440,7 @@ void panda_enable_plugin(void *plugin) {
             plist = plist->next;
         }
     }
+    panda_cb_tables_update();
 }
 
 /**
@@ -391,14 +461,15 @@ void panda_disable_plugin(void *plugin) {
             plist = plist->next;
         }
     }
+    panda_cb_tables_update();
 }
 
 /**
  * @brief Allows to navigate the callback linked list skipping disabled callbacks.
  */
 panda_cb_list* panda_cb_list_next(panda_cb_list* plist) {
-    for (panda_cb_list* node = plist->next; plist != NULL; plist = plist->next) {
-        if (!node || node->enabled) return node;
+    for (panda_cb_list* node = plist->next; node != NULL; node = node->next) {
+        if (node->enabled) return node;
     }
     return NULL;
 }
@@ -431,6 +502,136 @@ void panda_disable_memcb(void) {
     panda_use_memcb = false;
 }
 
+typedef struct {
+    int id;
+    void *owner;
+    bool physical;
+    uint64_t start, end; // [start, end)
+    target_ulong asid;
+} MemcbWatch;
+
+static GArray *memcb_watches;
+static int memcb_watch_next_id = 1;
+bool panda_memcb_watching = false;
+bool panda_memcb_watch_per_asid = false;
+static bool memcb_watch_physical = false;
+
+static void memcb_watches_changed(void) {
+    bool was_watching = panda_memcb_watching;
+    panda_memcb_watching = memcb_watches->len > 0;
+    panda_memcb_watch_per_asid = memcb_watch_physical = false;
+    for (guint i = 0; i < memcb_watches->len; i++) {
+        MemcbWatch *w = &g_array_index(memcb_watches, MemcbWatch, i);
+        if (w->physical) {
+            memcb_watch_physical = true;
+        } else if (w->asid != PANDA_WATCH_ANY_ASID) {
+            panda_memcb_watch_per_asid = true;
+        }
+    }
+
+    // refill the TLB with the watched pages flagged
+    CPUState *cpu;
+    CPU_FOREACH(cpu) {
+        tlb_flush(cpu);
+    }
+    // which helpers the TLB slow path calls is fixed at translation time
+    if (was_watching != panda_memcb_watching) {
+        panda_do_flush_tb();
+    }
+}
+
+int panda_memcb_watch(void *plugin, bool physical, uint64_t addr,
+                      uint64_t size, target_ulong asid) {
+    assert(size > 0);
+    if (!memcb_watches) {
+        memcb_watches = g_array_new(false, false, sizeof(MemcbWatch));
+    }
+    MemcbWatch w = {
+        .id = memcb_watch_next_id++,
+        .owner = plugin,
+        .physical = physical,
+        .start = addr,
+        .end = addr + size,
+        .asid = asid,
+    };
+    g_array_append_val(memcb_watches, w);
+    memcb_watches_changed();
+    return w.id;
+}
+
+void panda_memcb_unwatch(int id) {
+    for (guint i = 0; memcb_watches && i < memcb_watches->len; i++) {
+        if (g_array_index(memcb_watches, MemcbWatch, i).id == id) {
+            g_array_remove_index(memcb_watches, i);
+            memcb_watches_changed();
+            return;
+        }
+    }
+}
+
+static void memcb_unwatch_plugin(void *plugin) {
+    bool changed = false;
+    for (guint i = 0; memcb_watches && i < memcb_watches->len; ) {
+        if (g_array_index(memcb_watches, MemcbWatch, i).owner == plugin) {
+            g_array_remove_index(memcb_watches, i);
+            changed = true;
+        } else {
+            i++;
+        }
+    }
+    if (changed) memcb_watches_changed();
+}
+
+/**
+ * @brief Whether a watch region overlaps the page at \p vaddr, which maps
+ * physical page \p paddr.
+ */
+bool panda_memcb_watch_page(CPUState *cpu, target_ulong vaddr, hwaddr paddr) {
+    target_ulong asid = panda_memcb_watch_per_asid ? panda_current_asid(cpu) : 0;
+    for (guint i = 0; i < memcb_watches->len; i++) {
+        MemcbWatch *w = &g_array_index(memcb_watches, MemcbWatch, i);
+        uint64_t page = w->physical ? paddr : vaddr;
+        if (!w->physical && w->asid != PANDA_WATCH_ANY_ASID && w->asid != asid) {
+            continue;
+        }
+        if (page < w->end && w->start < page + TARGET_PAGE_SIZE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Whether a watch region overlaps the \p size bytes at virtual
+ * address \p addr.
+ */
+bool panda_memcb_watched(CPUState *cpu, target_ulong addr, uint32_t size) {
+    target_ulong asid = panda_memcb_watch_per_asid ? panda_current_asid(cpu) : 0;
+    hwaddr paddr = -1;
+    if (memcb_watch_physical) {
+        // From the v2p cache, so only the first access to a page after a
+        // TLB flush or asid change walks the page tables.
+        hwaddr page = panda_virt_to_phys_page(cpu, addr & TARGET_PAGE_MASK);
+        if (page != -1) {
+            paddr = page | (addr & ~TARGET_PAGE_MASK);
+        }
+    }
+    for (guint i = 0; i < memcb_watches->len; i++) {
+        MemcbWatch *w = &g_array_index(memcb_watches, MemcbWatch, i);
+        uint64_t a = addr;
+        if (w->physical) {
+            if (paddr == -1) continue;
+            a = paddr;
+        } else if (w->asid != PANDA_WATCH_ANY_ASID && w->asid != asid) {
+            continue;
+        }
+        if (a < w->end && w->start < a + size) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void panda_enable_tb_chaining(void){
     panda_tb_chaining = true;
 }
@@ -439,6 +640,10 @@ void panda_disable_tb_chaining(void){
     panda_tb_chaining = false;
 }
 
+void panda_retry_mem_access(void) {
+    panda_retry_access = true;
+}
+
 #ifdef CONFIG_LLVM
 void panda_enable_llvm(void) {
     panda_do_flush_tb();
@@ -451,10 +656,22 @@ void panda_disable_llvm(void) {
     panda_do_flush_tb();
     execute_llvm = 0;
     generate_llvm = 0;
+    dual_exec_llvm = 0;
     tcg_llvm_destroy();
     tcg_llvm_ctx = NULL;
 }
 
+void panda_enable_llvm_dual_exec(void) {
+    panda_do_flush_tb();
+    dual_exec_llvm = 1;
+}
+
+void panda_disable_llvm_dual_exec(void) {
+    panda_do_flush_tb();
+    dual_exec_llvm = 0;
+    execute_llvm = generate_llvm;
+}
+
 void panda_enable_llvm_helpers(void) {
     init_llvm_helpers();
 }
@@ -955,13 +1172,29 @@ void hmp_panda_list_plugins(Monitor *mon, const QDict *qdict) {
         plugin_item = plugin_item->next;
 
     }
+    panda_cb_profile_report((FILE *)mon, monitor_fprintf);
+}
+
+void hmp_panda_cb_profile(Monitor *mon, const QDict *qdict) {
+    const char *cmd = qdict_get_str(qdict, "cmd");
+    if (strcmp(cmd, "on") == 0) {
+        panda_cb_profile_start(qdict_get_try_int(qdict, "period", 64));
+    } else if (strcmp(cmd, "off") == 0) {
+        panda_cb_profile_stop();
+    } else if (strcmp(cmd, "reset") == 0) {
+        panda_cb_profile_reset();
+    } else if (strcmp(cmd, "show") == 0) {
+        panda_cb_profile_report((FILE *)mon, monitor_fprintf);
+    } else {
+        monitor_printf(mon, "usage: cb_profile on [period]|off|reset|show\n");
+    }
 }
 
 void hmp_panda_plugin_cmd(Monitor *mon, const QDict *qdict) {
     panda_cb_list *plist;
     const char *cmd = qdict_get_try_str(qdict, "cmd");
-    for(plist = panda_cbs[PANDA_CB_MONITOR]; plist != NULL; plist = panda_cb_list_next(plist)) {
-        plist->entry.monitor(mon, cmd);
+    PANDA_CB_FOREACH(plist, PANDA_CB_MONITOR) {
+        PANDA_CB_CALL(plist, plist->entry.monitor(mon, cmd));
     }
 }
 
@@ -0,0 +1,193 @@
+/* PANDABEGINCOMMENT
+ *
+ * Authors:
+ *  Tim Leek               tleek@ll.mit.edu
+ *  Ryan Whelan            rwhelan@ll.mit.edu
+ *  Joshua Hodosh          josh.hodosh@ll.mit.edu
+ *  Michael Zhivich        mzhivich@ll.mit.edu
+ *  Brendan Dolan-Gavitt   brendandg@gatech.edu
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ *
+PANDAENDCOMMENT */
+
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/host-utils.h"
+#include <glib.h>
+
+#include "panda/plugin.h"
+#include "panda/cb_profile.h"
+
+extern int nb_panda_plugins;
+extern panda_plugin panda_plugins[MAX_PANDA_PLUGINS];
+
+bool panda_cb_profiling = false;
+uint64_t panda_cb_profile_period = 1;
+
+static const char *panda_cb_type_names[] = {
+    "before_block_translate",
+    "after_block_translate",
+    "before_block_exec_invalidate_opt",
+    "before_block_exec",
+    "after_block_exec",
+    "insn_translate",
+    "insn_exec",
+    "after_insn_translate",
+    "after_insn_exec",
+    "virt_mem_before_read",
+    "virt_mem_before_write",
+    "phys_mem_before_read",
+    "phys_mem_before_write",
+    "virt_mem_after_read",
+    "virt_mem_after_write",
+    "phys_mem_after_read",
+    "phys_mem_after_write",
+    "hd_read",
+    "hd_write",
+    "guest_hypercall",
+    "monitor",
+    "cpu_restore_state",
+    "before_replay_loadvm",
+    "asid_changed",
+    "replay_hd_transfer",
+    "replay_net_transfer",
+    "replay_serial_receive",
+    "replay_serial_read",
+    "replay_serial_send",
+    "replay_serial_write",
+    "replay_before_dma",
+    "replay_after_dma",
+    "replay_handle_packet",
+    "after_machine_init",
+    "top_loop",
+};
+QEMU_BUILD_BUG_ON(ARRAY_SIZE(panda_cb_type_names) != PANDA_CB_LAST);
+
+// Counts for one plugin's callbacks of one type.
+typedef struct {
+    char name[256];
+    panda_cb_type type;
+    uint64_t calls;
+    uint64_t samples;
+    uint64_t cycles;
+} CbProfile;
+
+// counts of the callbacks of plugins that have been unloaded
+static GArray *retired;
+
+static const char *plugin_name(void *plugin) {
+    for (int i = 0; i < nb_panda_plugins; i++) {
+        if (panda_plugins[i].plugin == plugin) return panda_plugins[i].name;
+    }
+    return "?";
+}
+
+// Adds calls, samples and cycles to the counts for name and type.
+static void profile_add(GArray *profiles, const char *name, panda_cb_type type,
+                        uint64_t calls, uint64_t samples, uint64_t cycles) {
+    if (calls == 0) return;
+    CbProfile *p = NULL;
+    for (guint i = 0; i < profiles->len; i++) {
+        CbProfile *q = &g_array_index(profiles, CbProfile, i);
+        if (q->type == type && strcmp(q->name, name) == 0) {
+            p = q;
+            break;
+        }
+    }
+    if (!p) {
+        CbProfile np = { .type = type };
+        pstrcpy(np.name, sizeof(np.name), name);
+        g_array_append_val(profiles, np);
+        p = &g_array_index(profiles, CbProfile, profiles->len - 1);
+    }
+    p->calls += calls;
+    p->samples += samples;
+    p->cycles += cycles;
+}
+
+static double profile_est_cycles(const CbProfile *p) {
+    return p->samples ? (double) p->cycles * p->calls / p->samples : 0;
+}
+
+static gint profile_cmp(gconstpointer a, gconstpointer b) {
+    double ca = profile_est_cycles(a), cb = profile_est_cycles(b);
+    return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+void panda_cb_profile_configure(void) {
+    panda_arg_list *args = panda_get_args("general");
+    uint64_t period = panda_parse_uint64_opt(args, "cb_profile", 0,
+        "profile callbacks, timing one in this many calls (0: off)");
+    panda_free_args(args);
+    if (period) panda_cb_profile_start(period);
+}
+
+void panda_cb_profile_start(uint64_t period) {
+    panda_cb_profile_period = period ? pow2ceil(period) : 1;
+    panda_cb_profiling = true;
+}
+
+void panda_cb_profile_stop(void) {
+    panda_cb_profiling = false;
+}
+
+void panda_cb_profile_reset(void) {
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        for (panda_cb_list *plist = panda_cbs[i]; plist; plist = plist->next) {
+            plist->calls = plist->samples = plist->cycles = 0;
+        }
+    }
+    if (retired) g_array_set_size(retired, 0);
+}
+
+void panda_cb_profile_retire(void *plugin) {
+    if (!retired) retired = g_array_new(false, false, sizeof(CbProfile));
+    const char *name = plugin_name(plugin);
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        for (panda_cb_list *plist = panda_cbs[i]; plist; plist = plist->next) {
+            if (plist->owner != plugin) continue;
+            profile_add(retired, name, i, plist->calls, plist->samples,
+                        plist->cycles);
+        }
+    }
+}
+
+void panda_cb_profile_report(FILE *f, fprintf_function pr) {
+    GArray *profiles = g_array_new(false, false, sizeof(CbProfile));
+    for (int i = 0; i < PANDA_CB_LAST; i++) {
+        for (panda_cb_list *plist = panda_cbs[i]; plist; plist = plist->next) {
+            profile_add(profiles, plugin_name(plist->owner), i, plist->calls,
+                        plist->samples, plist->cycles);
+        }
+    }
+    for (guint i = 0; retired && i < retired->len; i++) {
+        CbProfile *p = &g_array_index(retired, CbProfile, i);
+        profile_add(profiles, p->name, p->type, p->calls, p->samples,
+                    p->cycles);
+    }
+    if (profiles->len == 0) {
+        g_array_free(profiles, true);
+        return;
+    }
+    g_array_sort(profiles, profile_cmp);
+
+    double total = 0;
+    for (guint i = 0; i < profiles->len; i++) {
+        total += profile_est_cycles(&g_array_index(profiles, CbProfile, i));
+    }
+    pr(f, "callback profile (1 in %" PRIu64 " calls timed%s):\n",
+       panda_cb_profile_period, panda_cb_profiling ? "" : ", stopped");
+    pr(f, "%-20s %-32s %14s %16s %10s %6s\n", "plugin", "callback", "calls",
+       "est. ticks", "ticks/call", "%");
+    for (guint i = 0; i < profiles->len; i++) {
+        CbProfile *p = &g_array_index(profiles, CbProfile, i);
+        double est = profile_est_cycles(p);
+        pr(f, "%-20s %-32s %14" PRIu64 " %16.0f %10.1f %6.2f\n", p->name,
+           panda_cb_type_names[p->type], p->calls, est,
+           p->samples ? (double) p->cycles / p->samples : 0.0,
+           total ? 100 * est / total : 0.0);
+    }
+    g_array_free(profiles, true);
+}
@@ -14,6 +14,11 @@
 
 #include "exec/memory.h"
 #include "exec/exec-all.h"
+#include "exec/ram_addr.h"
+#include "qemu/bitmap.h"
+#include "qemu/cutils.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/timer.h"
 #include "io/channel-file.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
@@ -39,13 +44,28 @@ static int memfd_create(const char *name, unsigned int flags)
 #include "panda/checkpoint.h"
 
 extern RR_log_entry *rr_queue_head;
-Checkpoint* checkpoints[MAX_CHECKPOINTS] = {NULL}; 
+
+// All checkpoints, sorted by guest_instr_count.
+static Checkpoint **checkpoints = NULL;
+static size_t num_checkpoints = 0;
+static size_t checkpoints_size = 0;
 
 extern unsigned long long rr_number_of_log_entries[RR_LAST];
 extern unsigned long long rr_size_of_log_entries[RR_LAST];
 extern unsigned long long rr_max_num_queue_entries;
 static size_t total_usage = 0;
-static size_t next_checkpoint_num = 0;
+
+unsigned panda_checkpoint_full_interval = 16;
+size_t panda_checkpoint_budget = 0;
+
+// The checkpoint the machine state was last saved to or restored from, i.e.
+// the parent of the next incremental checkpoint. Since then the migration
+// dirty log tracks which RAM pages have changed.
+static Checkpoint *last_checkpoint = NULL;
+static unsigned long *dirty_pages = NULL;
+
+// Dirty pages are copied out through a buffer this big.
+#define CHECKPOINT_STAGING_SIZE (1 << 20)
 
 /*
  * Returns closest checkpoint containing target_instr_count 
@@ -53,28 +73,28 @@ static size_t next_checkpoint_num = 0;
  * Return -1 if not found
  */
 int get_closest_checkpoint_num(uint64_t target_instr_count) {
-
-    // Check base cases 
-    if (checkpoints[next_checkpoint_num-1]->guest_instr_count < target_instr_count) {
-        return next_checkpoint_num;
-    } 
-
-    if (target_instr_count == 0) {
-        return 1;
-    }
-
-    for (int i = 1; i < next_checkpoint_num; i++) {
-        if (checkpoints[i-1]->guest_instr_count < target_instr_count && target_instr_count <= checkpoints[i]->guest_instr_count) {
-            return i; 
+    // first checkpoint at or after target
+    size_t lo = 0, hi = num_checkpoints;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (checkpoints[mid]->guest_instr_count < target_instr_count) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
 
+    if (lo > 0) {
+        return lo;
+    }
+    if (target_instr_count == 0 && num_checkpoints > 0) {
+        return 1;
+    }
     return -1;
-
 }
 
 size_t get_num_checkpoints(void) {
-    return next_checkpoint_num;
+    return num_checkpoints;
 }
 
 /*
@@ -82,15 +102,472 @@ size_t get_num_checkpoints(void) {
  * If idx <= 0, return last one
  */
 Checkpoint* get_checkpoint(int num) {
-    if (num <= 0) {
-        return checkpoints[next_checkpoint_num-1]; 
-    } else if (num <= next_checkpoint_num) {
+    if (num_checkpoints == 0) {
+        return NULL;
+    } else if (num <= 0) {
+        return checkpoints[num_checkpoints-1]; 
+    } else if (num <= num_checkpoints) {
         return checkpoints[num-1];
     }
 
     return NULL;
 }
 
+static void checkpoint_insert(Checkpoint *checkpoint) {
+    // after any others at the same instr count
+    size_t lo = 0, hi = num_checkpoints;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (checkpoints[mid]->guest_instr_count <= checkpoint->guest_instr_count) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (num_checkpoints == checkpoints_size) {
+        checkpoints_size = checkpoints_size ? checkpoints_size * 2 : 64;
+        checkpoints = g_renew(Checkpoint *, checkpoints, checkpoints_size);
+    }
+    memmove(&checkpoints[lo + 1], &checkpoints[lo],
+            (num_checkpoints - lo) * sizeof(Checkpoint *));
+    checkpoints[lo] = checkpoint;
+    num_checkpoints++;
+}
+
+/*
+ * Move the dirty bits of all RAM pages from the migration dirty log into
+ * dirty_pages, clearing both the log and what dirty_pages held before.
+ * Returns the number of dirty pages.
+ */
+static uint64_t checkpoint_sync_dirty(void) {
+    uint64_t num_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    uint64_t num_dirty = 0;
+    RAMBlock *block;
+    CPUState *cpu;
+
+    if (!dirty_pages) {
+        dirty_pages = bitmap_new(num_pages);
+    }
+    bitmap_zero(dirty_pages, num_pages);
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(dirty_pages,
+                block->offset, block->used_length);
+    }
+    rcu_read_unlock();
+
+    // Pages the TLB already considers dirty are written without going
+    // through the dirty log, so make the next write to each page fault.
+    CPU_FOREACH(cpu) {
+        tlb_flush(cpu);
+    }
+    return num_dirty;
+}
+
+/*
+ * Whether the dirty log has seen every RAM write since it was last synced.
+ * Anything that does a savevm (scissors, segment output) syncs the log for
+ * itself and stops it when done, after which incremental checkpoints would
+ * silently miss pages. If so, restart it; the caller then has to save or
+ * restore all of RAM.
+ */
+static bool checkpoint_dirty_log_intact(void) {
+    if (memory_global_dirty_log_enabled()) {
+        return true;
+    }
+    memory_global_dirty_log_start();
+    return false;
+}
+
+static void checkpoint_pwrite(int fd, const void *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        assert(n > 0);
+        buf = (const uint8_t *)buf + n;
+        len -= n;
+        off += n;
+    }
+}
+
+static void checkpoint_pread(int fd, void *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+        assert(n > 0);
+        buf = (uint8_t *)buf + n;
+        len -= n;
+        off += n;
+    }
+}
+
+// QEMUFile reading or writing fd from off on.
+static QEMUFile *checkpoint_fd_fopen(int fd, off_t off, bool output) {
+    fd = dup(fd);
+    assert(fd >= 0);
+    lseek(fd, off, SEEK_SET);
+
+    QIOChannelFile *iochannel = qio_channel_file_new_fd(fd);
+    QEMUFile *file = output
+        ? qemu_fopen_channel_output(QIO_CHANNEL(iochannel))
+        : qemu_fopen_channel_input(QIO_CHANNEL(iochannel));
+    object_unref(OBJECT(iochannel));
+    return file;
+}
+
+// Device state lives after the RAM pages in the checkpoint's memfd.
+static QEMUFile *checkpoint_fopen(Checkpoint *checkpoint, bool output) {
+    return checkpoint_fd_fopen(checkpoint->memfd, checkpoint->dev_offset,
+                               output);
+}
+
+/*
+ * Write the contents of the given RAM pages to fd, one after the other
+ * starting at off.
+ */
+static void checkpoint_write_pages(int fd, off_t off, const uint64_t *pages,
+                                   uint64_t num_pages) {
+    uint8_t *buf = g_malloc(CHECKPOINT_STAGING_SIZE);
+    size_t staged = 0;
+
+    rcu_read_lock();
+    for (uint64_t i = 0; i < num_pages; i++) {
+        memcpy(buf + staged,
+               qemu_map_ram_ptr(NULL, pages[i] << TARGET_PAGE_BITS),
+               TARGET_PAGE_SIZE);
+        staged += TARGET_PAGE_SIZE;
+        if (staged == CHECKPOINT_STAGING_SIZE || i + 1 == num_pages) {
+            checkpoint_pwrite(fd, buf, staged,
+                              off + ((i + 1) << TARGET_PAGE_BITS) - staged);
+            staged = 0;
+        }
+    }
+    rcu_read_unlock();
+    g_free(buf);
+}
+
+// The pages dirtied since the dirty log was last synced, in order.
+static uint64_t *checkpoint_dirty_page_list(uint64_t *num_dirty) {
+    uint64_t num_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    uint64_t page, i = 0;
+
+    *num_dirty = checkpoint_sync_dirty();
+    uint64_t *pages = g_new(uint64_t, *num_dirty);
+    for (page = find_first_bit(dirty_pages, num_pages); page < num_pages;
+            page = find_next_bit(dirty_pages, num_pages, page + 1)) {
+        pages[i++] = page;
+    }
+    return pages;
+}
+
+/*
+ * Write all of RAM to checkpoint->memfd at its ram_addr, leaving holes for
+ * zero pages. Returns the number of bytes written.
+ */
+static size_t checkpoint_save_ram_image(Checkpoint *checkpoint) {
+    size_t written = 0;
+    RAMBlock *block;
+
+    checkpoint->pages = NULL;
+    checkpoint->num_pages = 0;
+    checkpoint->dev_offset = last_ram_offset();
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        uint8_t *host = block->host;
+        ram_addr_t run = 0, off;
+        for (off = 0; off <= block->used_length; off += TARGET_PAGE_SIZE) {
+            if (off < block->used_length
+                    && !buffer_is_zero(host + off, TARGET_PAGE_SIZE)) {
+                continue;
+            }
+            // [run, off) are nonzero pages
+            if (off > run) {
+                checkpoint_pwrite(checkpoint->memfd, host + run, off - run,
+                                  block->offset + run);
+                written += off - run;
+            }
+            run = off + TARGET_PAGE_SIZE;
+        }
+    }
+    rcu_read_unlock();
+    return written;
+}
+
+/*
+ * Write the pages dirtied since last_checkpoint to checkpoint->memfd, one
+ * after the other. Returns the number of bytes written.
+ */
+static size_t checkpoint_save_dirty_pages(Checkpoint *checkpoint) {
+    checkpoint->pages = checkpoint_dirty_page_list(&checkpoint->num_pages);
+    checkpoint->dev_offset = checkpoint->num_pages * TARGET_PAGE_SIZE;
+    checkpoint_write_pages(checkpoint->memfd, 0, checkpoint->pages,
+                           checkpoint->num_pages);
+    return checkpoint->dev_offset;
+}
+
+static int checkpoint_page_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Copy page's contents as of checkpoint back into RAM.
+static void checkpoint_restore_page(Checkpoint *checkpoint, uint64_t page) {
+    void *host = qemu_map_ram_ptr(NULL, page << TARGET_PAGE_BITS);
+    Checkpoint *c;
+
+    for (c = checkpoint; c->parent; c = c->parent) {
+        uint64_t *p = bsearch(&page, c->pages, c->num_pages, sizeof(uint64_t),
+                              checkpoint_page_cmp);
+        if (p) {
+            checkpoint_pread(c->memfd, host, TARGET_PAGE_SIZE,
+                             (p - c->pages) << TARGET_PAGE_BITS);
+            return;
+        }
+    }
+    checkpoint_pread(c->memfd, host, TARGET_PAGE_SIZE,
+                     page << TARGET_PAGE_BITS);
+}
+
+// Most recent checkpoint both a and b were built on, if any.
+static Checkpoint *checkpoint_common_ancestor(Checkpoint *a, Checkpoint *b) {
+    while (a->depth > b->depth) a = a->parent;
+    while (b->depth > a->depth) b = b->parent;
+    while (a != b) {
+        a = a->parent;
+        b = b->parent;
+    }
+    return a;
+}
+
+/*
+ * Restore RAM to its state at checkpoint, copying back only the pages that
+ * can differ from it: those written since last_checkpoint, and those that
+ * differ between last_checkpoint and checkpoint, i.e. the pages stored by
+ * the checkpoints between them and their common ancestor.
+ */
+static uint64_t checkpoint_restore_changed_pages(Checkpoint *checkpoint,
+                                                 Checkpoint *ancestor) {
+    uint64_t num_pages = last_ram_offset() >> TARGET_PAGE_BITS;
+    uint64_t page, restored = 0;
+    Checkpoint *c;
+
+    checkpoint_sync_dirty();
+    for (c = last_checkpoint; c != ancestor; c = c->parent) {
+        for (uint64_t i = 0; i < c->num_pages; i++) {
+            set_bit(c->pages[i], dirty_pages);
+        }
+    }
+    for (c = checkpoint; c != ancestor; c = c->parent) {
+        for (uint64_t i = 0; i < c->num_pages; i++) {
+            set_bit(c->pages[i], dirty_pages);
+        }
+    }
+
+    rcu_read_lock();
+    for (page = find_first_bit(dirty_pages, num_pages); page < num_pages;
+            page = find_next_bit(dirty_pages, num_pages, page + 1)) {
+        checkpoint_restore_page(checkpoint, page);
+        restored++;
+    }
+    rcu_read_unlock();
+    return restored;
+}
+
+// Restore all of RAM from the full checkpoint at the root of checkpoint's
+// chain, then apply the incremental ones after it in order.
+static uint64_t checkpoint_restore_all_pages(Checkpoint *checkpoint) {
+    Checkpoint **chain = g_new(Checkpoint *, checkpoint->depth + 1);
+    Checkpoint *c = checkpoint;
+    uint64_t restored = 0;
+    RAMBlock *block;
+
+    for (int i = checkpoint->depth; i >= 0; i--, c = c->parent) {
+        chain[i] = c;
+    }
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        checkpoint_pread(chain[0]->memfd, block->host, block->used_length,
+                         block->offset);
+        restored += block->used_length >> TARGET_PAGE_BITS;
+    }
+    for (int i = 1; i <= checkpoint->depth; i++) {
+        for (uint64_t j = 0; j < chain[i]->num_pages; j++) {
+            checkpoint_pread(chain[i]->memfd,
+                    qemu_map_ram_ptr(NULL, chain[i]->pages[j] << TARGET_PAGE_BITS),
+                    TARGET_PAGE_SIZE, j << TARGET_PAGE_BITS);
+        }
+        restored += chain[i]->num_pages;
+    }
+    rcu_read_unlock();
+
+    g_free(chain);
+    return restored;
+}
+
+static void checkpoint_copy_fd(int from, off_t from_off, int to, off_t to_off,
+                               size_t len) {
+    uint8_t *buf = g_malloc(CHECKPOINT_STAGING_SIZE);
+    while (len > 0) {
+        size_t n = MIN(len, CHECKPOINT_STAGING_SIZE);
+        checkpoint_pread(from, buf, n, from_off);
+        checkpoint_pwrite(to, buf, n, to_off);
+        from_off += n;
+        to_off += n;
+        len -= n;
+    }
+    g_free(buf);
+}
+
+/*
+ * Fold incremental checkpoint x into its child y: y takes over the pages of
+ * x it doesn't store itself, and x's parent.
+ */
+static void checkpoint_merge_into_child(Checkpoint *x, Checkpoint *y) {
+    uint64_t *pages = g_new(uint64_t, x->num_pages + y->num_pages);
+    uint8_t *buf = g_malloc(CHECKPOINT_STAGING_SIZE);
+    uint64_t i = 0, j = 0, n = 0;
+    size_t staged = 0;
+    struct stat st;
+
+    int memfd = memfd_create("checkpoint", 0);
+    assert(memfd >= 0);
+
+    while (i < x->num_pages || j < y->num_pages) {
+        Checkpoint *src;
+        uint64_t idx;
+        if (j < y->num_pages
+                && (i == x->num_pages || y->pages[j] <= x->pages[i])) {
+            if (i < x->num_pages && x->pages[i] == y->pages[j]) {
+                i++;
+            }
+            src = y;
+            idx = j++;
+        } else {
+            src = x;
+            idx = i++;
+        }
+        pages[n++] = src->pages[idx];
+        checkpoint_pread(src->memfd, buf + staged, TARGET_PAGE_SIZE,
+                         idx << TARGET_PAGE_BITS);
+        staged += TARGET_PAGE_SIZE;
+        if (staged == CHECKPOINT_STAGING_SIZE) {
+            checkpoint_pwrite(memfd, buf, staged, (n << TARGET_PAGE_BITS) - staged);
+            staged = 0;
+        }
+    }
+    if (staged) {
+        checkpoint_pwrite(memfd, buf, staged, (n << TARGET_PAGE_BITS) - staged);
+    }
+    g_free(buf);
+
+    fstat(y->memfd, &st);
+    size_t dev_size = st.st_size - y->dev_offset;
+    checkpoint_copy_fd(y->memfd, y->dev_offset, memfd, n << TARGET_PAGE_BITS,
+                       dev_size);
+
+    close(y->memfd);
+    g_free(y->pages);
+    total_usage -= y->memfd_usage;
+
+    y->memfd = memfd;
+    y->pages = pages;
+    y->num_pages = n;
+    y->dev_offset = n << TARGET_PAGE_BITS;
+    y->memfd_usage = y->dev_offset + dev_size;
+    y->parent = x->parent;
+    total_usage += y->memfd_usage;
+}
+
+/*
+ * Whether checkpoints[i] can be dropped. We always keep the first one, so
+ * there's somewhere to go back to, and the one incremental checkpoints are
+ * currently taken relative to. Full checkpoints can't be dropped while
+ * others build on them: promoting a child to a full checkpoint would cost as
+ * much memory as it frees.
+ */
+static bool checkpoint_evictable(size_t i) {
+    Checkpoint *x = checkpoints[i];
+    if (i == 0 || x == last_checkpoint) {
+        return false;
+    }
+    if (x->parent == NULL) {
+        for (size_t j = 0; j < num_checkpoints; j++) {
+            if (checkpoints[j]->parent == x) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void checkpoint_evict(size_t i) {
+    Checkpoint *x = checkpoints[i];
+
+    for (size_t j = 0; j < num_checkpoints; j++) {
+        if (checkpoints[j]->parent == x) {
+            checkpoint_merge_into_child(x, checkpoints[j]);
+        }
+    }
+    memmove(&checkpoints[i], &checkpoints[i + 1],
+            (num_checkpoints - i - 1) * sizeof(Checkpoint *));
+    num_checkpoints--;
+
+    // chains through x just got shorter
+    for (size_t j = 0; j < num_checkpoints; j++) {
+        Checkpoint *c = checkpoints[j];
+        c->depth = 0;
+        for (Checkpoint *p = c->parent; p; p = p->parent) {
+            c->depth++;
+        }
+    }
+
+    total_usage -= x->memfd_usage;
+    close(x->memfd);
+    g_free(x->pages);
+    free(x);
+}
+
+/*
+ * Drop checkpoints until we're within panda_checkpoint_budget. The victim is
+ * the one whose removal leaves the smallest gap between its neighbors
+ * relative to its distance from the current position, which keeps
+ * checkpoints dense near it and logarithmically spaced further away.
+ */
+static void checkpoint_enforce_budget(uint64_t instr_count) {
+    while (panda_checkpoint_budget && total_usage > panda_checkpoint_budget) {
+        ssize_t victim = -1;
+        double best = 0;
+
+        for (size_t i = 1; i < num_checkpoints; i++) {
+            if (!checkpoint_evictable(i)) continue;
+
+            uint64_t count = checkpoints[i]->guest_instr_count;
+            uint64_t prev = checkpoints[i-1]->guest_instr_count;
+            uint64_t next = i + 1 < num_checkpoints
+                ? checkpoints[i+1]->guest_instr_count
+                : count;
+            uint64_t dist = count > instr_count
+                ? count - instr_count
+                : instr_count - count;
+            double score = (double)(next - prev) / (dist + 1);
+            if (victim < 0 || score < best) {
+                victim = i;
+                best = score;
+            }
+        }
+
+        if (victim < 0) {
+            printf("panda_checkpoint: over budget, but no checkpoint can be evicted\n");
+            return;
+        }
+        printf("Evicting checkpoint @ %lu\n",
+                checkpoints[victim]->guest_instr_count);
+        checkpoint_evict(victim);
+    }
+}
+
 /*
  * Perform replay checkpoint which we can later rewind to.
  *
@@ -99,25 +576,9 @@ Checkpoint* get_checkpoint(int num) {
 void *panda_checkpoint(void) {
     assert(rr_in_replay());
 
-    if (next_checkpoint_num >= MAX_CHECKPOINTS) { 
-        printf("panda_checkpoint: Cannot make any more checkpoints!\n");
-        return NULL;
-    }
-
     uint64_t instr_count = rr_get_guest_instr_count();
 
-    /* Find last existing checkpoint before this point */
-    //Checkpoint *check = NULL;
-    //for (int i = 0; i < next_checkpoint_num; i++) {
-        //check = checkpoints[i];
-        //if (check->guest_instr_count > instr_count) break;
-    //}
-
     Checkpoint *checkpoint = (Checkpoint *)malloc(sizeof(Checkpoint));
-
-    // TODO: Do we want to insert checkpoint in list in order?
-    checkpoints[next_checkpoint_num] = checkpoint;
-    next_checkpoint_num++;
     checkpoint->guest_instr_count = instr_count;
     checkpoint->nondet_log_position = rr_queue_head
         ? rr_queue_head->header.file_pos
@@ -130,34 +591,53 @@ void *panda_checkpoint(void) {
     checkpoint->max_num_queue_entries = rr_max_num_queue_entries;
     checkpoint->next_progress = rr_next_progress;
 
+    int64_t start_time = get_clock();
+    bool full = !checkpoint_dirty_log_intact()
+        || last_checkpoint == NULL
+        || last_checkpoint->depth + 1 >= panda_checkpoint_full_interval;
+
     checkpoint->memfd = memfd_create("checkpoint", 0);
     assert(checkpoint->memfd >= 0);
 
-    QIOChannelFile *iochannel = qio_channel_file_new_fd(checkpoint->memfd);
-    QEMUFile *file = qemu_fopen_channel_output(QIO_CHANNEL(iochannel));
+    if (full) {
+        checkpoint->parent = NULL;
+        checkpoint->depth = 0;
+        // track changes from this checkpoint on
+        checkpoint_sync_dirty();
+        checkpoint->memfd_usage = checkpoint_save_ram_image(checkpoint);
+    } else {
+        checkpoint->parent = last_checkpoint;
+        checkpoint->depth = last_checkpoint->depth + 1;
+        checkpoint->memfd_usage = checkpoint_save_dirty_pages(checkpoint);
+    }
+    last_checkpoint = checkpoint;
 
     global_state_store_running();
-    qemu_savevm_state(file, NULL);
-
+    QEMUFile *file = checkpoint_fopen(checkpoint, true);
+    qemu_save_device_state(file);
     qemu_fflush(file);
-    checkpoint->memfd_usage = lseek(checkpoint->memfd, 0, SEEK_CUR);
+    checkpoint->memfd_usage += qemu_ftell(file);
+    qemu_fclose(file);
     total_usage += checkpoint->memfd_usage;
+    checkpoint->create_time = (get_clock() - start_time) / 1e9;
+
+    printf("Created %s checkpoint @ %lu. Size %.1f MB in %.3f s. "
+            "Total usage %.1f GB\n",
+            full ? "full" : "incremental", instr_count,
+            ((float) checkpoint->memfd_usage) / (1 << 20),
+            checkpoint->create_time, ((float) total_usage) / (1 << 30));
 
-    printf("Created checkpoint @ %lu. Size %.1f MB. Total usage %.1f GB\n",
-            instr_count, ((float) checkpoint->memfd_usage) / (1 << 20),
-            ((float) total_usage) / (1 << 30));
+    checkpoint_insert(checkpoint);
+    checkpoint_enforce_budget(instr_count);
 
     return checkpoint;
 }
 
 
 void panda_restore_by_num(int num) {
-    if (num <= 0) {
-        panda_restore(checkpoints[next_checkpoint_num-1]); 
-    } else if (num <= next_checkpoint_num) {
-        if (checkpoints[num-1] != NULL) {
-            panda_restore(checkpoints[num-1]);
-        }
+    Checkpoint *checkpoint = get_checkpoint(num);
+    if (checkpoint != NULL) {
+        panda_restore(checkpoint);
     }
 }
 
@@ -166,12 +646,26 @@ void panda_restore(void *opaque) {
     
     Checkpoint *checkpoint = (Checkpoint *)opaque;
     printf("Restarting checkpoint @ instr count %lu\n", checkpoint->guest_instr_count);
-        
-    lseek(checkpoint->memfd, 0, SEEK_SET);
 
-    QIOChannelFile *iochannel = qio_channel_file_new_fd(checkpoint->memfd);
-    QEMUFile *file = qemu_fopen_channel_input(QIO_CHANNEL(iochannel));
+    int64_t start_time = get_clock();
+    uint64_t restored;
+
+    // Reset first: anything the reset writes to RAM goes through the dirty
+    // log and is restored along with what the guest wrote.
     qemu_system_reset(VMRESET_SILENT);
+    // Without an intact dirty log we can't tell what changed since
+    // last_checkpoint, so restore everything.
+    bool intact = checkpoint_dirty_log_intact();
+    Checkpoint *ancestor = intact && last_checkpoint
+        ? checkpoint_common_ancestor(last_checkpoint, checkpoint)
+        : NULL;
+    if (ancestor) {
+        restored = checkpoint_restore_changed_pages(checkpoint, ancestor);
+    } else {
+        restored = checkpoint_restore_all_pages(checkpoint);
+    }
+
+    QEMUFile *file = checkpoint_fopen(checkpoint, false);
     MigrationIncomingState* mis = migration_incoming_get_current();
     mis->from_src_file = file;
 
@@ -179,12 +673,18 @@ void panda_restore(void *opaque) {
     assert(snapshot_ret >= 0);
 
     migration_incoming_state_destroy();
+    qemu_fclose(file);
+
+    // Restoring wrote RAM directly; track changes from the checkpoint on.
+    checkpoint_sync_dirty();
+    last_checkpoint = checkpoint;
+
+    printf("Restored %lu pages in %.3f s\n", restored,
+            (get_clock() - start_time) / 1e9);
 
     first_cpu->rr_guest_instr_count = checkpoint->guest_instr_count;
     first_cpu->panda_guest_pc = panda_current_pc(first_cpu);
-    rr_nondet_log->bytes_read = checkpoint->nondet_log_position;
-    fseek(rr_nondet_log->fp, checkpoint->nondet_log_position, SEEK_SET);
-    rr_queue_head = rr_queue_tail = NULL;
+    rr_nondet_log_seek(checkpoint->nondet_log_position);
 
     memcpy(rr_number_of_log_entries, checkpoint->number_of_log_entries,
             sizeof(rr_number_of_log_entries));
@@ -197,3 +697,226 @@ void panda_restore(void *opaque) {
         cpu_loop_exit(first_cpu);
     }
 }
+
+/*
+ * Keyframes
+ *
+ * Keyframes are checkpoints taken while recording and written to disk next
+ * to the nondet log, so that a replay can start from one of them instead of
+ * the beginning. Like checkpoints, every panda_checkpoint_full_interval-th
+ * one stores all nonzero RAM pages and the others the pages dirtied since
+ * the previous keyframe.
+ */
+
+static int keyframes_fd = -1;
+static RR_keyframe_header keyframes_header;
+static RR_keyframe *keyframes = NULL;
+static off_t keyframes_end;
+
+bool panda_keyframes_open(const char *path) {
+    keyframes_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0660);
+    if (keyframes_fd < 0) {
+        perror("panda_keyframes_open");
+        return false;
+    }
+
+    memset(&keyframes_header, 0, sizeof(keyframes_header));
+    memcpy(keyframes_header.magic, RR_KEYFRAME_MAGIC,
+           sizeof(keyframes_header.magic));
+    keyframes_header.version = RR_KEYFRAME_VERSION;
+    keyframes_header.ram_size = last_ram_offset();
+    keyframes_end = sizeof(keyframes_header);
+    return true;
+}
+
+// All nonzero pages of RAM, in order.
+static uint64_t *keyframe_nonzero_page_list(uint64_t *num_nonzero) {
+    uint64_t *pages = g_new(uint64_t, last_ram_offset() >> TARGET_PAGE_BITS);
+    RAMBlock *block;
+
+    *num_nonzero = 0;
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        for (ram_addr_t off = 0; off < block->used_length;
+                off += TARGET_PAGE_SIZE) {
+            if (!buffer_is_zero(block->host + off, TARGET_PAGE_SIZE)) {
+                pages[(*num_nonzero)++] =
+                    (block->offset + off) >> TARGET_PAGE_BITS;
+            }
+        }
+    }
+    rcu_read_unlock();
+    return pages;
+}
+
+/*
+ * Append a keyframe for the current point of the recording. Has to be called
+ * between blocks, before cpu_handle_interrupt logs the next interrupt_request.
+ */
+void panda_keyframe(void) {
+    assert(rr_in_record() && keyframes_fd >= 0);
+
+    uint32_t n = keyframes_header.num_keyframes;
+    RR_keyframe *keyframe;
+    uint64_t *pages;
+    int64_t start_time = get_clock();
+
+    keyframes = g_renew(RR_keyframe, keyframes, n + 1);
+    keyframe = &keyframes[n];
+    memset(keyframe, 0, sizeof(*keyframe));
+    keyframe->guest_instr_count = rr_get_guest_instr_count();
+    keyframe->nondet_log_position = rr_record_log_position();
+    keyframe->full = !checkpoint_dirty_log_intact()
+        || (n % panda_checkpoint_full_interval) == 0;
+    keyframe->interrupt_request = panda_current_interrupt_request;
+
+    if (keyframe->full) {
+        // track changes from this keyframe on
+        checkpoint_sync_dirty();
+        pages = keyframe_nonzero_page_list(&keyframe->num_pages);
+    } else {
+        pages = checkpoint_dirty_page_list(&keyframe->num_pages);
+    }
+
+    keyframe->pages_pos = keyframes_end;
+    checkpoint_pwrite(keyframes_fd, pages,
+                      keyframe->num_pages * sizeof(uint64_t),
+                      keyframe->pages_pos);
+    checkpoint_write_pages(keyframes_fd,
+            keyframe->pages_pos + keyframe->num_pages * sizeof(uint64_t),
+            pages, keyframe->num_pages);
+    g_free(pages);
+
+    keyframe->dev_pos = keyframe->pages_pos
+        + keyframe->num_pages * (sizeof(uint64_t) + TARGET_PAGE_SIZE);
+    global_state_store_running();
+    QEMUFile *file = checkpoint_fd_fopen(keyframes_fd, keyframe->dev_pos, true);
+    qemu_save_device_state(file);
+    qemu_fflush(file);
+    keyframe->dev_size = qemu_ftell(file);
+    qemu_fclose(file);
+
+    keyframes_end = keyframe->dev_pos + keyframe->dev_size;
+    keyframes_header.num_keyframes++;
+
+    printf("Created %s keyframe @ %lu. Size %.1f MB in %.3f s\n",
+            keyframe->full ? "full" : "incremental",
+            keyframe->guest_instr_count,
+            ((float) (keyframes_end - keyframe->pages_pos)) / (1 << 20),
+            (get_clock() - start_time) / 1e9);
+}
+
+void panda_keyframes_close(void) {
+    if (keyframes_fd < 0) return;
+
+    keyframes_header.index_pos = keyframes_end;
+    checkpoint_pwrite(keyframes_fd, keyframes,
+                      keyframes_header.num_keyframes * sizeof(RR_keyframe),
+                      keyframes_header.index_pos);
+    checkpoint_pwrite(keyframes_fd, &keyframes_header,
+                      sizeof(keyframes_header), 0);
+    close(keyframes_fd);
+    keyframes_fd = -1;
+    g_free(keyframes);
+    keyframes = NULL;
+    memory_global_dirty_log_stop();
+}
+
+// Copy the pages stored by keyframe back into RAM.
+static void keyframe_restore_pages(int fd, RR_keyframe *keyframe) {
+    uint64_t *pages = g_new(uint64_t, keyframe->num_pages);
+    uint8_t *buf = g_malloc(CHECKPOINT_STAGING_SIZE);
+    off_t data_pos = keyframe->pages_pos + keyframe->num_pages * sizeof(uint64_t);
+    uint64_t per_buf = CHECKPOINT_STAGING_SIZE >> TARGET_PAGE_BITS;
+
+    checkpoint_pread(fd, pages, keyframe->num_pages * sizeof(uint64_t),
+                     keyframe->pages_pos);
+    rcu_read_lock();
+    for (uint64_t i = 0; i < keyframe->num_pages; i += per_buf) {
+        uint64_t n = MIN(per_buf, keyframe->num_pages - i);
+        checkpoint_pread(fd, buf, n << TARGET_PAGE_BITS,
+                         data_pos + (i << TARGET_PAGE_BITS));
+        for (uint64_t j = 0; j < n; j++) {
+            memcpy(qemu_map_ram_ptr(NULL, pages[i + j] << TARGET_PAGE_BITS),
+                   buf + (j << TARGET_PAGE_BITS), TARGET_PAGE_SIZE);
+        }
+    }
+    rcu_read_unlock();
+    g_free(buf);
+    g_free(pages);
+}
+
+/*
+ * Restore the machine to the last keyframe in the file at path at or before
+ * instr_count, filling in *keyframe. Returns false, leaving the machine
+ * untouched, if there is no such keyframe.
+ */
+bool panda_keyframe_restore(const char *path, uint64_t instr_count,
+                            RR_keyframe *keyframe) {
+    RR_keyframe_header header;
+    RR_keyframe *index;
+    int64_t start_time = get_clock();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || memcmp(header.magic, RR_KEYFRAME_MAGIC, sizeof(header.magic))
+            || header.version != RR_KEYFRAME_VERSION
+            || header.ram_size != last_ram_offset()) {
+        fprintf(stderr, "%s: not a keyframe file for this machine\n", path);
+        close(fd);
+        return false;
+    }
+
+    index = g_new(RR_keyframe, header.num_keyframes);
+    checkpoint_pread(fd, index, header.num_keyframes * sizeof(RR_keyframe),
+                     header.index_pos);
+
+    // last keyframe at or before instr_count, and the full one it builds on
+    uint32_t lo = 0, hi = header.num_keyframes;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (index[mid].guest_instr_count <= instr_count) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        g_free(index);
+        close(fd);
+        return false;
+    }
+    uint32_t last = lo - 1, first = last;
+    while (!index[first].full) first--;
+
+    qemu_system_reset(VMRESET_SILENT);
+    RAMBlock *block;
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        memset(block->host, 0, block->used_length);
+    }
+    rcu_read_unlock();
+    for (uint32_t i = first; i <= last; i++) {
+        keyframe_restore_pages(fd, &index[i]);
+    }
+
+    QEMUFile *file = checkpoint_fd_fopen(fd, index[last].dev_pos, false);
+    MigrationIncomingState* mis = migration_incoming_get_current();
+    mis->from_src_file = file;
+    int snapshot_ret = qemu_loadvm_state(file);
+    assert(snapshot_ret >= 0);
+    migration_incoming_state_destroy();
+    qemu_fclose(file);
+
+    *keyframe = index[last];
+    printf("Restored keyframe @ %lu from %u keyframes in %.3f s\n",
+            keyframe->guest_instr_count, last - first + 1,
+            (get_clock() - start_time) / 1e9);
+
+    g_free(index);
+    close(fd);
+    return true;
+}
@@ -115,6 +115,119 @@ target_ulong panda_current_pc(CPUState *cpu) {
     return pc;
 }
 
+/*
+ * Translation cache for panda_virt_to_phys_page. It is direct mapped and
+ * only ever holds translations of the current asid: TLB flushes, including
+ * single page ones, and asid changes advance v2p_gen, which invalidates
+ * every entry at once. Guests must flush the TLB after changing a mapping,
+ * so page table writes are covered by the flush that follows them. Failed
+ * walks are not cached.
+ */
+#define V2P_CACHE_BITS 10
+#define V2P_CACHE_SIZE (1 << V2P_CACHE_BITS)
+
+typedef struct {
+    CPUState *cpu;
+    target_ulong vpage;
+    hwaddr ppage;
+    uint32_t gen;   // 0 never matches
+} V2PEntry;
+
+static V2PEntry v2p_cache[V2P_CACHE_SIZE];
+static uint32_t v2p_gen = 1;
+static uint64_t v2p_walks;
+static uint64_t v2p_walks_avoided;
+
+static inline V2PEntry *v2p_entry(target_ulong page) {
+    return &v2p_cache[(page >> TARGET_PAGE_BITS) & (V2P_CACHE_SIZE - 1)];
+}
+
+hwaddr panda_virt_to_phys_page(CPUState *env, target_ulong page) {
+    V2PEntry *e = v2p_entry(page);
+    hwaddr phys_page;
+
+    if (e->gen == v2p_gen && e->vpage == page && e->cpu == env) {
+        v2p_walks_avoided++;
+        return e->ppage;
+    }
+    v2p_walks++;
+    phys_page = cpu_get_phys_page_debug(env, page);
+    if (phys_page != -1) {
+        e->cpu = env;
+        e->vpage = page;
+        e->ppage = phys_page;
+        e->gen = v2p_gen;
+    }
+    return phys_page;
+}
+
+void panda_v2p_cache_flush(void) {
+    if (unlikely(++v2p_gen == 0)) {
+        memset(v2p_cache, 0, sizeof(v2p_cache));
+        v2p_gen = 1;
+    }
+}
+
+/*
+ * The walk doesn't tell us the size of the mapping a page came from, and
+ * invalidating one page of a 2M/4M mapping invalidates all of it, whether
+ * or not the TLB holds the large page. So drop everything.
+ */
+void panda_v2p_cache_flush_page(target_ulong addr) {
+    panda_v2p_cache_flush();
+}
+
+void panda_v2p_cache_stats(uint64_t *walks, uint64_t *avoided) {
+    *walks = v2p_walks;
+    *avoided = v2p_walks_avoided;
+}
+
+int panda_virtual_memory_read_vec(CPUState *env, PandaVirtRead *reads, int n) {
+    // the guest cannot run during the batch, so the last translation can be
+    // reused without consulting the cache
+    target_ulong last_page = -1;
+    hwaddr last_phys = -1;
+    int failed = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        target_ulong addr = reads[i].addr;
+        uint8_t *buf = reads[i].buf;
+        int len = reads[i].len;
+        int ret = 0;
+
+        while (len > 0) {
+            target_ulong page = addr & TARGET_PAGE_MASK;
+            int l = (page + TARGET_PAGE_SIZE) - addr;
+            if (page != last_page) {
+                last_page = page;
+                last_phys = panda_virt_to_phys_page(env, page);
+            }
+            if (last_phys == -1) {
+                // no physical page mapped
+                ret = -1;
+                break;
+            }
+            if (l > len) {
+                l = len;
+            }
+            ret = panda_physical_memory_rw(last_phys + (addr & ~TARGET_PAGE_MASK),
+                                           buf, l, false);
+            if (ret != MEMTX_OK) {
+                break;
+            }
+            len -= l;
+            buf += l;
+            addr += l;
+        }
+        reads[i].ret = ret;
+        if (ret != 0) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
 /**
  * @brief Wrapper around QEMU's disassembly function.
  */
@@ -183,6 +296,12 @@ void panda_set_os_name(char *os_name) {
 void panda_cleanup(void) {
     // PANDA: unload plugins
     panda_unload_plugins();
+    uint64_t walks, avoided;
+    panda_v2p_cache_stats(&walks, &avoided);
+    if (walks + avoided > 0) {
+        fprintf(stderr, PANDA_MSG "v2p cache: %" PRIu64 " page walks, %"
+                PRIu64 " avoided\n", walks, avoided);
+    }
     if (pandalog) {
         pandalog_cc_close();
     }
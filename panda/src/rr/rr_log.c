@@ -45,6 +45,8 @@
 #include "qmp-commands.h"
 #include "hmp.h"
 #include "panda/rr/rr_log.h"
+#include "panda/rr/rr_zlog.h"
+#include "panda/checkpoint.h"
 #include "migration/migration.h"
 #include "include/exec/address-spaces.h"
 #include "include/exec/exec-all.h"
@@ -53,6 +55,8 @@
 #include "sysemu/sysemu.h"
 #include "panda/callback_support.h"
 #include "exec/gdbstub.h"
+#include "qemu/atomic.h"
+#include "qemu/thread.h"
 
 /******************************************************************************************/
 /* GLOBALS */
@@ -77,6 +81,13 @@ RR_log* rr_nondet_log = NULL;
 
 bool rr_replay_complete = false;
 
+// Allow chaining of TBs in replay; see rr_update_instr_limit()
+bool rr_replay_chaining = false;
+bool rr_record_compress = false;
+uint64_t rr_keyframe_interval = 0;
+uint64_t rr_replay_from = 0;
+uint64_t rr_next_keyframe = UINT64_MAX;
+
 #define RR_RECORD_FROM_REQUEST 2
 #define RR_RECORD_REQUEST 1
 
@@ -262,11 +273,27 @@ static inline void rr_assert_fail(const char* exp, const char* file, int line,
 /******************************************************************************************/
 
 static inline size_t rr_fwrite(void *ptr, size_t size, size_t nmemb) {
+    if (rr_nondet_log->zlog) {
+        rr_zlog_write(rr_nondet_log->zlog, ptr, size * nmemb);
+        return nmemb;
+    }
     size_t result = fwrite(ptr, size, nmemb, rr_nondet_log->fp);
     rr_assert(result == nmemb);
     return result;
 }
 
+uint64_t rr_record_log_position(void) {
+    if (rr_nondet_log->zlog) {
+        return rr_zlog_tell(rr_nondet_log->zlog);
+    }
+    return ftello(rr_nondet_log->fp);
+}
+
+void rr_take_keyframe(void) {
+    panda_keyframe();
+    rr_next_keyframe = rr_get_guest_instr_count() + rr_keyframe_interval;
+}
+
 // mz write the current log item to file
 static inline void rr_write_item(RR_log_entry item)
 {
@@ -274,6 +301,11 @@ static inline void rr_write_item(RR_log_entry item)
     if (!rr_in_record()) return;
     rr_assert(rr_nondet_log != NULL);
 
+    if (rr_nondet_log->zlog) {
+        rr_zlog_entry(rr_nondet_log->zlog,
+                      item.header.prog_point.guest_instr_count);
+    }
+
 #define RR_WRITE_ITEM(field) rr_fwrite(&(field), sizeof(field), 1)
     // keep replay format the same.
     RR_WRITE_ITEM(item.header.prog_point.guest_instr_count);
@@ -662,6 +694,8 @@ static inline void rr_record_end_of_log(void) {
 /* REPLAY */
 /******************************************************************************************/
 
+static void rr_buf_free(void *buf, size_t len);
+
 static inline void free_entry_params(RR_log_entry* entry)
 {
     // mz cleanup associated resources
@@ -669,19 +703,23 @@ static inline void free_entry_params(RR_log_entry* entry)
     case RR_SKIPPED_CALL:
         switch (entry->variant.call_args.kind) {
         case RR_CALL_CPU_MEM_RW:
-            g_free(entry->variant.call_args.variant.cpu_mem_rw_args.buf);
+            rr_buf_free(entry->variant.call_args.variant.cpu_mem_rw_args.buf,
+                        entry->variant.call_args.variant.cpu_mem_rw_args.len);
             entry->variant.call_args.variant.cpu_mem_rw_args.buf = NULL;
             break;
         case RR_CALL_CPU_MEM_UNMAP:
-            g_free(entry->variant.call_args.variant.cpu_mem_unmap.buf);
+            rr_buf_free(entry->variant.call_args.variant.cpu_mem_unmap.buf,
+                        entry->variant.call_args.variant.cpu_mem_unmap.len);
             entry->variant.call_args.variant.cpu_mem_unmap.buf = NULL;
             break;
         case RR_CALL_CPU_REG_WRITE:
-            g_free(entry->variant.call_args.variant.cpu_reg_write_args.buf);
+            rr_buf_free(entry->variant.call_args.variant.cpu_reg_write_args.buf,
+                        entry->variant.call_args.variant.cpu_reg_write_args.len);
             entry->variant.call_args.variant.cpu_reg_write_args.buf = NULL;
             break;
         case RR_CALL_HANDLE_PACKET:
-            g_free(entry->variant.call_args.variant.handle_packet_args.buf);
+            rr_buf_free(entry->variant.call_args.variant.handle_packet_args.buf,
+                        entry->variant.call_args.variant.handle_packet_args.size);
             entry->variant.call_args.variant.handle_packet_args.buf = NULL;
             break;
         default: break;
@@ -750,22 +788,122 @@ static inline void rr_queue_pop_front(void) {
     }
 }
 
-// Add an entry to the back of the queue.
-// Returns pointer to item just read.
-static RR_log_entry *rr_read_item(void) {
-    RR_log_entry *item = rr_queue_alloc_back();
+/******************************************************************************************/
+/* PREFETCH */
+/******************************************************************************************/
 
-    rr_assert(rr_in_replay());
-    rr_assert(!rr_log_is_empty());
-    rr_assert(rr_nondet_log->fp != NULL);
+// The nondet log is decoded ahead of the vCPU by a producer thread into a
+// lock-free single-producer/single-consumer ring, so that rr_fill_queue only
+// has to copy out ready entries. The producer reads the file in large blocks
+// and carves skipped call buffers from a circular arena, which the consumer
+// releases in FIFO order as entries leave rr_queue. Buffers that don't fit in
+// the arena come from g_malloc instead: the producer must never wait on
+// rr_queue draining, since rr_fill_queue may be waiting on the producer.
+#define RR_PREFETCH_LEN 4096
+#define RR_ARENA_SIZE (64 << 20)
+#define RR_READ_BUF_SIZE (1 << 20)
+
+typedef struct {
+    RR_log_entry entry;
+    uint64_t end_pos; // file position just past this entry
+} RR_prefetch_slot;
+
+static struct {
+    QemuThread thread;
+    bool running;
+    bool stop;
+
+    // ring of decoded entries. tail is advanced by the producer, head by the
+    // consumer; both are free-running and taken modulo RR_PREFETCH_LEN.
+    RR_prefetch_slot *ring;
+    unsigned head;
+    unsigned tail;
+    QemuEvent data_ev;  // set by the producer after publishing an entry
+    QemuEvent space_ev; // set by the consumer after taking one
+
+    // skipped call buffers. [arena_tail, arena_head) is live.
+    uint8_t *arena;
+    size_t arena_head; // producer only
+    size_t arena_tail; // written by the consumer
+
+    // buffered reader, producer only
+    uint8_t *buf;
+    size_t buf_pos;
+    size_t buf_len;
+    uint64_t file_pos;
+} rr_prefetch;
+
+static void rr_reader_read(void *ptr, size_t len) {
+    uint8_t *out = (uint8_t *)ptr;
+    rr_prefetch.file_pos += len;
+    while (len > 0) {
+        if (rr_prefetch.buf_pos == rr_prefetch.buf_len) {
+            if (len >= RR_READ_BUF_SIZE) {
+                // big DMA buffers go straight to their destination
+                size_t result = fread(out, 1, len, rr_nondet_log->fp);
+                rr_assert(result == len);
+                return;
+            }
+            rr_prefetch.buf_len = fread(rr_prefetch.buf, 1, RR_READ_BUF_SIZE,
+                                        rr_nondet_log->fp);
+            rr_prefetch.buf_pos = 0;
+            rr_assert(rr_prefetch.buf_len > 0);
+        }
+        size_t n = MIN(len, rr_prefetch.buf_len - rr_prefetch.buf_pos);
+        memcpy(out, rr_prefetch.buf + rr_prefetch.buf_pos, n);
+        rr_prefetch.buf_pos += n;
+        out += n;
+        len -= n;
+    }
+}
 
-    item->header.file_pos = rr_nondet_log->bytes_read;
+static inline bool rr_in_arena(void *buf) {
+    return rr_prefetch.arena && (uint8_t *)buf >= rr_prefetch.arena &&
+        (uint8_t *)buf < rr_prefetch.arena + RR_ARENA_SIZE;
+}
 
-#define RR_READ_ITEM(field) rr_fread(&(field), sizeof(field), 1)
+static void *rr_arena_alloc(size_t len) {
+    size_t head = rr_prefetch.arena_head;
+    size_t tail = atomic_load_acquire(&rr_prefetch.arena_tail);
+    size_t start;
+
+    // Keep head != tail unless the arena is empty.
+    if (len == 0) {
+        return NULL;
+    } else if (head >= tail && len <= RR_ARENA_SIZE - head) {
+        start = head;
+    } else if (head >= tail && len < tail) {
+        start = 0; // wrap, wasting the end of the arena
+    } else if (head < tail && len < tail - head) {
+        start = head;
+    } else {
+        return g_malloc(len);
+    }
+    rr_prefetch.arena_head = start + len;
+    return rr_prefetch.arena + start;
+}
+
+// Entries leave rr_queue in the order they were decoded, so releasing a
+// buffer frees everything in the arena up to its end.
+static void rr_buf_free(void *buf, size_t len) {
+    if (rr_in_arena(buf)) {
+        atomic_store_release(&rr_prefetch.arena_tail,
+                             ((uint8_t *)buf - rr_prefetch.arena) + len);
+    } else {
+        g_free(buf);
+    }
+}
+
+// Decode the next entry of the log into item. Runs on the prefetch thread.
+static void rr_decode_item(RR_log_entry *item) {
+    memset(item, 0, sizeof(*item));
+    item->header.file_pos = rr_prefetch.file_pos;
+
+#define RR_READ_ITEM(field) rr_reader_read(&(field), sizeof(field))
     // mz read header
     RR_READ_ITEM(item->header.prog_point.guest_instr_count);
-    rr_fread(&(item->header.kind), 1, 1);
-    rr_fread(&(item->header.callsite_loc), 1, 1);
+    rr_reader_read(&(item->header.kind), 1);
+    rr_reader_read(&(item->header.callsite_loc), 1);
 
     // mz read the rest of the item
     switch (item->header.kind) {
@@ -795,36 +933,36 @@ static RR_log_entry *rr_read_item(void) {
             break;
         case RR_SKIPPED_CALL: {
             RR_skipped_call_args* args = &item->variant.call_args;
-            rr_fread(&(args->kind), 1, 1);
+            rr_reader_read(&(args->kind), 1);
             switch (args->kind) {
                 case RR_CALL_CPU_MEM_RW:
                     RR_READ_ITEM(args->variant.cpu_mem_rw_args);
                     // mz buffer length in args->variant.cpu_mem_rw_args.len
                     args->variant.cpu_mem_rw_args.buf =
-                        g_malloc(args->variant.cpu_mem_rw_args.len);
+                        rr_arena_alloc(args->variant.cpu_mem_rw_args.len);
                     // mz read the buffer
-                    rr_fread(args->variant.cpu_mem_rw_args.buf, 1,
+                    rr_reader_read(args->variant.cpu_mem_rw_args.buf,
                             args->variant.cpu_mem_rw_args.len);
                     break;
                 case RR_CALL_CPU_MEM_UNMAP:
                     RR_READ_ITEM(args->variant.cpu_mem_unmap);
                     args->variant.cpu_mem_unmap.buf =
-                        g_malloc(args->variant.cpu_mem_unmap.len);
-                    rr_fread(args->variant.cpu_mem_unmap.buf, 1,
+                        rr_arena_alloc(args->variant.cpu_mem_unmap.len);
+                    rr_reader_read(args->variant.cpu_mem_unmap.buf,
                                 args->variant.cpu_mem_unmap.len);
                     break;
                 case RR_CALL_CPU_REG_WRITE:
                     RR_READ_ITEM(args->variant.cpu_reg_write_args);
                     args->variant.cpu_reg_write_args.buf =
-                        g_malloc(args->variant.cpu_reg_write_args.len);
-                    rr_fread(args->variant.cpu_reg_write_args.buf, 1,
+                        rr_arena_alloc(args->variant.cpu_reg_write_args.len);
+                    rr_reader_read(args->variant.cpu_reg_write_args.buf,
                                 args->variant.cpu_reg_write_args.len);
                     break;
                 case RR_CALL_MEM_REGION_CHANGE:
                     RR_READ_ITEM(args->variant.mem_region_change_args);
                     args->variant.mem_region_change_args.name =
                         g_malloc0(args->variant.mem_region_change_args.len + 1);
-                    rr_fread(args->variant.mem_region_change_args.name, 1,
+                    rr_reader_read(args->variant.mem_region_change_args.name,
                             args->variant.mem_region_change_args.len);
                     break;
                 case RR_CALL_HD_TRANSFER:
@@ -840,13 +978,13 @@ static RR_log_entry *rr_read_item(void) {
                     // mz XXX HACK
                     args->old_buf_addr = (uint64_t)args->variant.handle_packet_args.buf;
                     // mz buffer length in args->variant.cpu_mem_rw_args.len
-                    // mz always allocate a new one. we free it when the item is added
-                    // to the recycle list
+                    // mz always allocate a new one. we free it when the item is
+                    // popped from the queue
                     args->variant.handle_packet_args.buf =
-                        g_malloc(args->variant.handle_packet_args.size);
+                        rr_arena_alloc(args->variant.handle_packet_args.size);
                     // mz read the buffer
-                    rr_fread(args->variant.handle_packet_args.buf,
-                            args->variant.handle_packet_args.size, 1);
+                    rr_reader_read(args->variant.handle_packet_args.buf,
+                            args->variant.handle_packet_args.size);
                     break;
                 case RR_CALL_SERIAL_RECEIVE:
                     RR_READ_ITEM(args->variant.serial_receive_args);
@@ -872,6 +1010,99 @@ static RR_log_entry *rr_read_item(void) {
             // mz unimplemented
             rr_assert(0 && "Unimplemented replay log entry!");
     }
+}
+
+static void *rr_prefetch_thread(void *opaque) {
+    while (rr_prefetch.file_pos < rr_nondet_log->size) {
+        // wait for a free slot
+        while (rr_prefetch.tail - atomic_load_acquire(&rr_prefetch.head)
+                == RR_PREFETCH_LEN) {
+            qemu_event_reset(&rr_prefetch.space_ev);
+            if (atomic_read(&rr_prefetch.stop)) return NULL;
+            if (rr_prefetch.tail - atomic_load_acquire(&rr_prefetch.head)
+                    == RR_PREFETCH_LEN) {
+                qemu_event_wait(&rr_prefetch.space_ev);
+            }
+        }
+        if (atomic_read(&rr_prefetch.stop)) return NULL;
+
+        RR_prefetch_slot *slot =
+            &rr_prefetch.ring[rr_prefetch.tail % RR_PREFETCH_LEN];
+        rr_decode_item(&slot->entry);
+        slot->end_pos = rr_prefetch.file_pos;
+        atomic_store_release(&rr_prefetch.tail, rr_prefetch.tail + 1);
+        qemu_event_set(&rr_prefetch.data_ev);
+    }
+    return NULL;
+}
+
+// Start decoding the log from file position pos.
+static void rr_prefetch_start(uint64_t pos) {
+    if (!rr_prefetch.ring) {
+        rr_prefetch.ring = g_new(RR_prefetch_slot, RR_PREFETCH_LEN);
+        rr_prefetch.arena = g_malloc(RR_ARENA_SIZE);
+        rr_prefetch.buf = g_malloc(RR_READ_BUF_SIZE);
+        qemu_event_init(&rr_prefetch.data_ev, false);
+        qemu_event_init(&rr_prefetch.space_ev, false);
+    }
+    rr_assert(!rr_prefetch.running);
+    fseek(rr_nondet_log->fp, pos, SEEK_SET);
+    rr_prefetch.file_pos = pos;
+    rr_prefetch.buf_pos = rr_prefetch.buf_len = 0;
+    rr_prefetch.head = rr_prefetch.tail = 0;
+    rr_prefetch.arena_head = rr_prefetch.arena_tail = 0;
+    rr_prefetch.stop = false;
+    rr_prefetch.running = true;
+    qemu_thread_create(&rr_prefetch.thread, "rr_prefetch", rr_prefetch_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+}
+
+// Stop the producer and drop anything it decoded but we haven't consumed.
+static void rr_prefetch_stop(void) {
+    if (!rr_prefetch.running) return;
+    atomic_set(&rr_prefetch.stop, true);
+    qemu_event_set(&rr_prefetch.space_ev);
+    qemu_thread_join(&rr_prefetch.thread);
+    rr_prefetch.running = false;
+    while (rr_prefetch.head != rr_prefetch.tail) {
+        free_entry_params(&rr_prefetch.ring[rr_prefetch.head % RR_PREFETCH_LEN].entry);
+        rr_prefetch.head++;
+    }
+}
+
+static void rr_prefetch_destroy(void) {
+    rr_prefetch_stop();
+    g_free(rr_prefetch.ring);
+    g_free(rr_prefetch.arena);
+    g_free(rr_prefetch.buf);
+    rr_prefetch.ring = NULL;
+    rr_prefetch.arena = NULL;
+    rr_prefetch.buf = NULL;
+    qemu_event_destroy(&rr_prefetch.data_ev);
+    qemu_event_destroy(&rr_prefetch.space_ev);
+}
+
+// Add an entry to the back of the queue.
+// Returns pointer to item just read.
+static RR_log_entry *rr_read_item(void) {
+    rr_assert(rr_in_replay());
+    rr_assert(!rr_log_is_empty());
+    rr_assert(rr_prefetch.running);
+
+    // wait for the producer
+    while (atomic_load_acquire(&rr_prefetch.tail) == rr_prefetch.head) {
+        qemu_event_reset(&rr_prefetch.data_ev);
+        if (atomic_load_acquire(&rr_prefetch.tail) == rr_prefetch.head) {
+            qemu_event_wait(&rr_prefetch.data_ev);
+        }
+    }
+
+    RR_prefetch_slot *slot = &rr_prefetch.ring[rr_prefetch.head % RR_PREFETCH_LEN];
+    RR_log_entry *item = rr_queue_alloc_back();
+    *item = slot->entry;
+    rr_nondet_log->bytes_read = slot->end_pos;
+    atomic_store_release(&rr_prefetch.head, rr_prefetch.head + 1);
+    qemu_event_set(&rr_prefetch.space_ev);
 
     // mz let's do some counting
     rr_size_of_log_entries[item->header.kind] +=
@@ -881,6 +1112,17 @@ static RR_log_entry *rr_read_item(void) {
     return item;
 }
 
+// Reposition replay at file position pos of the nondet log (e.g. when
+// restoring a checkpoint). Anything queued or prefetched is discarded.
+void rr_nondet_log_seek(uint64_t pos) {
+    while (rr_queue_head) {
+        rr_queue_pop_front();
+    }
+    rr_prefetch_stop();
+    rr_nondet_log->bytes_read = pos;
+    rr_prefetch_start(pos);
+}
+
 // mz fill the queue of log entries from the file
 void rr_fill_queue(void) {
     unsigned long long num_entries = 0;
@@ -906,6 +1148,28 @@ void rr_fill_queue(void) {
     if (num_entries > rr_max_num_queue_entries) {
         rr_max_num_queue_entries = num_entries;
     }
+    rr_update_instr_limit();
+}
+
+// Chained TBs must return to the main loop once the event at the tail of the
+// queue is due. The tail only changes when the queue is refilled, so this is
+// the one place the limit needs updating.
+void rr_update_instr_limit(void) {
+    uint64_t until_interrupt;
+
+    if (!first_cpu) return;
+    if (!rr_replay_chaining_enabled() || !rr_queue_tail) {
+        // Nothing bounds the chain; the queue is refilled from inside the
+        // TB, which calls back here.
+        first_cpu->rr_instr_limit = UINT64_MAX;
+        return;
+    }
+    until_interrupt = rr_num_instr_before_next_interrupt();
+    if (until_interrupt == (uint64_t)-1) {
+        first_cpu->rr_instr_limit = UINT64_MAX;
+    } else {
+        first_cpu->rr_instr_limit = rr_get_guest_instr_count() + until_interrupt;
+    }
 }
 
 // Makes sure queue is full and returns fron entry.
@@ -1221,26 +1485,34 @@ void rr_create_record_log(const char* filename)
     // This way, when we print progress, we can use something better than size
     // of log consumed
     //(as that can jump //sporadically).
-    rr_fwrite(&(rr_nondet_log->last_prog_point.guest_instr_count),
-            sizeof(rr_nondet_log->last_prog_point.guest_instr_count), 1);
+    // A compressed log keeps it in its own header.
+    if (rr_record_compress) {
+        rr_nondet_log->zlog =
+            rr_zlog_open_write(rr_nondet_log->fp, RR_ZLOG_CHUNK_SIZE);
+    } else {
+        rr_fwrite(&(rr_nondet_log->last_prog_point.guest_instr_count),
+                sizeof(rr_nondet_log->last_prog_point.guest_instr_count), 1);
+    }
 }
 
 // create replay log
 void rr_create_replay_log(const char* filename)
 {
-    struct stat statbuf = {0};
     // create log
     rr_nondet_log = g_new0(RR_log, 1);
     rr_assert(rr_nondet_log != NULL);
 
     rr_nondet_log->type = REPLAY;
     rr_nondet_log->name = g_strdup(filename);
-    rr_nondet_log->fp = fopen(rr_nondet_log->name, "r");
+    // compressed logs read back as if they weren't
+    rr_nondet_log->fp = rr_zlog_fopen_read(rr_nondet_log->name,
+                                           &rr_nondet_log->zlog);
     rr_assert(rr_nondet_log->fp != NULL);
 
     // mz fill in log size
-    stat(rr_nondet_log->name, &statbuf);
-    rr_nondet_log->size = statbuf.st_size;
+    fseeko(rr_nondet_log->fp, 0, SEEK_END);
+    rr_nondet_log->size = ftello(rr_nondet_log->fp);
+    rewind(rr_nondet_log->fp);
     rr_nondet_log->bytes_read = 0;
     if (rr_debug_whisper()) {
         qemu_log("opened %s for read.  len=%llu bytes.\n", rr_nondet_log->name,
@@ -1249,14 +1521,23 @@ void rr_create_replay_log(const char* filename)
     // mz read the last program point from the log header.
     rr_fread(&(rr_nondet_log->last_prog_point.guest_instr_count),
             sizeof(rr_nondet_log->last_prog_point.guest_instr_count), 1);
+
+    rr_prefetch_start(rr_nondet_log->bytes_read);
 }
 
 // close file and free associated memory
 void rr_destroy_log(void)
 {
+    if (rr_nondet_log->type == REPLAY) {
+        rr_prefetch_destroy();
+    }
     if (rr_nondet_log->fp) {
         // mz if in record, update the header with the last written prog point.
-        if (rr_nondet_log->type == RECORD) {
+        if (rr_nondet_log->type == RECORD && rr_nondet_log->zlog) {
+            rr_zlog_close_write(rr_nondet_log->zlog,
+                    rr_nondet_log->last_prog_point.guest_instr_count);
+            rr_nondet_log->zlog = NULL;
+        } else if (rr_nondet_log->type == RECORD) {
             rewind(rr_nondet_log->fp);
             rr_fwrite(&(rr_nondet_log->last_prog_point.guest_instr_count),
                     sizeof(rr_nondet_log->last_prog_point.guest_instr_count), 1);
@@ -1341,6 +1622,14 @@ static inline void rr_get_nondet_log_file_name(char* rr_name, char* rr_path,
     snprintf(file_name, file_name_len, "%s/%s-rr-nondet.log", rr_path, rr_name);
 }
 
+static inline void rr_get_keyframes_file_name(char* rr_name, char* rr_path,
+                                              char* file_name,
+                                              size_t file_name_len)
+{
+    rr_assert(rr_name != NULL && rr_path != NULL);
+    snprintf(file_name, file_name_len, "%s/%s-rr-keyframes", rr_path, rr_name);
+}
+
 void rr_reset_state(CPUState* cpu)
 {
     tb_flush(cpu);
@@ -1479,6 +1768,13 @@ int rr_do_begin_record(const char* file_name_full, CPUState* cpu_state)
     rr_create_record_log(name_buf);
     // reset record/replay counters and flags
     rr_reset_state(cpu_state);
+    if (rr_keyframe_interval) {
+        rr_get_keyframes_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+        printf("writing keyframes:\t%s\n", name_buf);
+        if (panda_keyframes_open(name_buf)) {
+            rr_next_keyframe = rr_keyframe_interval;
+        }
+    }
     g_free(rr_path_base);
     g_free(rr_name_base);
     // set global to turn on recording
@@ -1511,6 +1807,8 @@ void rr_do_end_record(void)
 
     // log_all_cpu_states();
 
+    panda_keyframes_close();
+    rr_next_keyframe = UINT64_MAX;
     rr_destroy_log();
 
     g_free(rr_path_base);
@@ -1523,22 +1821,13 @@ void rr_do_end_record(void)
 
 extern void panda_cleanup(void);
 
-// file_name_full should be full path to the record/replay log
-int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
-{
 #ifdef CONFIG_SOFTMMU
+// Load the snapshot a replay starts from.
+static int rr_load_replay_snapshot(char* rr_name, char* rr_path)
+{
     char name_buf[1024];
-    // decompose file_name_base into path & file.
-    char* rr_path = g_strdup(file_name_full);
-    char* rr_name = g_strdup(file_name_full);
-    __attribute__((unused)) int snapshot_ret;
-    rr_path = dirname(rr_path);
-    rr_name = basename(rr_name);
-    if (rr_debug_whisper()) {
-        qemu_log("Begin vm replay for file_name_full = %s\n", file_name_full);
-        qemu_log("path = [%s]  file_name_base = [%s]\n", rr_path, rr_name);
-    }
-    // first retrieve snapshot
+    int snapshot_ret;
+
     rr_get_snapshot_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
     if (rr_debug_whisper()) {
         qemu_log("reading snapshot:\t%s\n", name_buf);
@@ -1559,11 +1848,46 @@ int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
     qemu_fclose(snp);
     migration_incoming_state_destroy();
 
-    if (snapshot_ret < 0) {
-        fprintf(stderr, "Failed to load vmstate\n");
-        return snapshot_ret;
+    return snapshot_ret;
+}
+#endif
+
+// file_name_full should be full path to the record/replay log
+int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
+{
+#ifdef CONFIG_SOFTMMU
+    char name_buf[1024];
+    // decompose file_name_base into path & file.
+    char* rr_path = g_strdup(file_name_full);
+    char* rr_name = g_strdup(file_name_full);
+    __attribute__((unused)) int snapshot_ret;
+    rr_path = dirname(rr_path);
+    rr_name = basename(rr_name);
+    if (rr_debug_whisper()) {
+        qemu_log("Begin vm replay for file_name_full = %s\n", file_name_full);
+        qemu_log("path = [%s]  file_name_base = [%s]\n", rr_path, rr_name);
+    }
+    // start from a keyframe if asked to, otherwise from the snapshot
+    RR_keyframe keyframe = {0};
+    bool from_keyframe = false;
+    if (rr_replay_from) {
+        rr_get_keyframes_file_name(rr_name, rr_path, name_buf, sizeof(name_buf));
+        from_keyframe = panda_keyframe_restore(name_buf, rr_replay_from,
+                                               &keyframe);
+        if (!from_keyframe) {
+            printf("no keyframe at or before instr %" PRIu64
+                   ", replaying from the start\n", rr_replay_from);
+        }
+    }
+
+    if (!from_keyframe) {
+        snapshot_ret = rr_load_replay_snapshot(rr_name, rr_path);
+        if (snapshot_ret < 0) {
+            fprintf(stderr, "Failed to load vmstate\n");
+            return snapshot_ret;
+        }
+        printf("... done.\n");
     }
-    printf("... done.\n");
     // log_all_cpu_states();
 
     // save the time so we can report how long replay takes
@@ -1575,6 +1899,12 @@ int rr_do_begin_replay(const char* file_name_full, CPUState* cpu_state)
     rr_create_replay_log(name_buf);
     // reset record/replay counters and flags
     rr_reset_state(cpu_state);
+    if (from_keyframe) {
+        cpu_state->rr_guest_instr_count = keyframe.guest_instr_count;
+        panda_current_interrupt_request = keyframe.interrupt_request;
+        rr_nondet_log_seek(keyframe.nondet_log_position);
+        rr_next_progress = rr_get_percentage() + 1;
+    }
     // set global to turn on replay
     rr_mode = RR_REPLAY;
 
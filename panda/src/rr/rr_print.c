@@ -7,6 +7,7 @@
 #include <panda/include/panda/rr/rr_log.h>
 #include "qemu/osdep.h"
 #include "cpu.h"
+#include "panda/rr/rr_zlog.h"
 
 /******************************************************************************************/
 /* GLOBALS */
@@ -305,7 +306,6 @@ static RR_log_entry *rr_read_item(void) {
 
 // create replay log
 void rr_create_replay_log (const char *filename) {
-  struct stat statbuf = {0};
   // create log
   rr_nondet_log = (RR_log *) g_malloc (sizeof (RR_log));
   assert (rr_nondet_log != NULL);
@@ -313,12 +313,13 @@ void rr_create_replay_log (const char *filename) {
 
   rr_nondet_log->type = REPLAY;
   rr_nondet_log->name = g_strdup(filename);
-  rr_nondet_log->fp = fopen(rr_nondet_log->name, "r");
+  rr_nondet_log->fp = rr_zlog_fopen_read(rr_nondet_log->name, NULL);
   assert(rr_nondet_log->fp != NULL);
 
   //mz fill in log size
-  stat(rr_nondet_log->name, &statbuf);
-  rr_nondet_log->size = statbuf.st_size;
+  fseeko(rr_nondet_log->fp, 0, SEEK_END);
+  rr_nondet_log->size = ftello(rr_nondet_log->fp);
+  rewind(rr_nondet_log->fp);
   fprintf (stdout, "opened %s for read.  len=%llu bytes.\n",
      rr_nondet_log->name, rr_nondet_log->size);
   //mz read the last program point from the log header.
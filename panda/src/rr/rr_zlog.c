@@ -0,0 +1,362 @@
+/*
+ * PANDA compressed nondet log
+ *
+ * Stores the record/replay nondet log as independently compressed chunks
+ * plus a trailing directory, so it can be replayed and seeked without
+ * unpacking. See panda/rr/rr_zlog.h for the layout.
+ */
+
+#include "qemu/osdep.h"
+
+#include <zlib.h>
+
+#include "panda/rr/rr_zlog.h"
+
+struct RR_zlog {
+    FILE *fp;
+    RR_zlog_header header;
+    RR_zlog_chunk *dir;
+    uint32_t dir_cap;
+
+    // current chunk, uncompressed, and scratch space for its compressed form
+    uint8_t *buf;
+    size_t buf_len;
+    size_t buf_cap;
+    uint8_t *zbuf;
+    size_t zbuf_cap;
+
+    // index in dir of the chunk in buf (being written, or last loaded), or -1
+    int64_t chunk;
+    // instr count of the last entry written
+    uint64_t last_instr;
+    // position in the uncompressed log
+    uint64_t pos;
+};
+
+static void *rr_zlog_grow(void *p, size_t *cap, size_t need) {
+    if (need <= *cap) return p;
+    while (*cap < need) {
+        *cap = *cap ? *cap * 2 : 4096;
+    }
+    p = realloc(p, *cap);
+    assert(p != NULL);
+    return p;
+}
+
+// Makes room in the directory for one more chunk.
+static void rr_zlog_dir_reserve(RR_zlog *zlog) {
+    if (zlog->header.num_chunks == zlog->dir_cap) {
+        zlog->dir_cap = zlog->dir_cap ? zlog->dir_cap * 2 : 64;
+        zlog->dir = realloc(zlog->dir, zlog->dir_cap * sizeof(RR_zlog_chunk));
+        assert(zlog->dir != NULL);
+    }
+}
+
+static void rr_zlog_free(RR_zlog *zlog) {
+    free(zlog->dir);
+    free(zlog->buf);
+    free(zlog->zbuf);
+    free(zlog);
+}
+
+/******************************************************************************************/
+/* RECORD */
+/******************************************************************************************/
+
+RR_zlog *rr_zlog_open_write(FILE *fp, uint32_t chunk_size) {
+    RR_zlog *zlog = calloc(1, sizeof(*zlog));
+    assert(zlog != NULL);
+    zlog->fp = fp;
+    memcpy(zlog->header.magic, RR_ZLOG_MAGIC, sizeof(zlog->header.magic));
+    zlog->header.version = RR_ZLOG_VERSION;
+    zlog->header.chunk_size = chunk_size;
+    zlog->chunk = -1;
+    // the uncompressed log starts with the last instr count, which we keep
+    // in our own header instead.
+    zlog->pos = sizeof(uint64_t);
+
+    // dir_pos is 0 until rr_zlog_close_write rewrites the header, which
+    // tells readers to scan the chunk frames instead.
+    size_t n = fwrite(&zlog->header, sizeof(zlog->header), 1, fp);
+    assert(n == 1);
+    fflush(fp);
+    return zlog;
+}
+
+static void rr_zlog_flush_chunk(RR_zlog *zlog) {
+    if (zlog->chunk < 0) return;
+
+    uLongf zsize = compressBound(zlog->buf_len);
+    zlog->zbuf = rr_zlog_grow(zlog->zbuf, &zlog->zbuf_cap, zsize);
+    int ret = compress2(zlog->zbuf, &zsize, zlog->buf, zlog->buf_len,
+                        Z_DEFAULT_COMPRESSION);
+    assert(ret == Z_OK);
+    assert(zlog->buf_len <= UINT32_MAX);
+
+    RR_zlog_chunk *c = &zlog->dir[zlog->chunk];
+    RR_zlog_frame frame = {
+        .instr = c->instr,
+        .last_instr = zlog->last_instr,
+        .zsize = zsize,
+        .size = zlog->buf_len,
+    };
+    size_t n = fwrite(&frame, sizeof(frame), 1, zlog->fp);
+    assert(n == 1);
+    c->file_pos = ftello(zlog->fp);
+    c->zsize = zsize;
+    c->size = zlog->buf_len;
+    n = fwrite(zlog->zbuf, 1, zsize, zlog->fp);
+    assert(n == zsize);
+    // so that a crash loses at most the chunk being filled
+    fflush(zlog->fp);
+
+    zlog->buf_len = 0;
+    zlog->chunk = -1;
+}
+
+// Called before writing each log entry; starts a new chunk if the current
+// one is full, so that every chunk starts on an entry.
+void rr_zlog_entry(RR_zlog *zlog, uint64_t instr) {
+    if (zlog->chunk >= 0 && zlog->buf_len >= zlog->header.chunk_size) {
+        rr_zlog_flush_chunk(zlog);
+    }
+    if (zlog->chunk < 0) {
+        rr_zlog_dir_reserve(zlog);
+        zlog->chunk = zlog->header.num_chunks++;
+        memset(&zlog->dir[zlog->chunk], 0, sizeof(RR_zlog_chunk));
+        zlog->dir[zlog->chunk].instr = instr;
+        zlog->dir[zlog->chunk].pos = zlog->pos;
+    }
+    zlog->last_instr = instr;
+}
+
+void rr_zlog_write(RR_zlog *zlog, const void *ptr, size_t len) {
+    assert(zlog->chunk >= 0);
+    zlog->buf = rr_zlog_grow(zlog->buf, &zlog->buf_cap, zlog->buf_len + len);
+    memcpy(zlog->buf + zlog->buf_len, ptr, len);
+    zlog->buf_len += len;
+    zlog->pos += len;
+}
+
+uint64_t rr_zlog_tell(RR_zlog *zlog) {
+    return zlog->pos;
+}
+
+void rr_zlog_close_write(RR_zlog *zlog, uint64_t last_instr) {
+    size_t n;
+
+    rr_zlog_flush_chunk(zlog);
+
+    zlog->header.dir_pos = ftello(zlog->fp);
+    zlog->header.last_instr = last_instr;
+    zlog->header.size = zlog->pos;
+    n = fwrite(zlog->dir, sizeof(RR_zlog_chunk), zlog->header.num_chunks,
+               zlog->fp);
+    assert(n == zlog->header.num_chunks);
+
+    fseeko(zlog->fp, 0, SEEK_SET);
+    n = fwrite(&zlog->header, sizeof(zlog->header), 1, zlog->fp);
+    assert(n == 1);
+    fflush(zlog->fp);
+
+    rr_zlog_free(zlog);
+}
+
+/******************************************************************************************/
+/* REPLAY */
+/******************************************************************************************/
+
+// Rebuilds the directory of a log whose recording never finished from the
+// chunk frames, up to the last chunk that was completely written.
+static void rr_zlog_scan(RR_zlog *zlog) {
+    RR_zlog_frame frame;
+    off_t file_size;
+
+    fseeko(zlog->fp, 0, SEEK_END);
+    file_size = ftello(zlog->fp);
+    fseeko(zlog->fp, sizeof(RR_zlog_header), SEEK_SET);
+
+    zlog->header.num_chunks = 0;
+    zlog->header.size = sizeof(uint64_t);
+    zlog->header.last_instr = 0;
+    while (fread(&frame, sizeof(frame), 1, zlog->fp) == 1) {
+        RR_zlog_chunk c = {
+            .instr = frame.instr,
+            .pos = zlog->header.size,
+            .file_pos = ftello(zlog->fp),
+            .zsize = frame.zsize,
+            .size = frame.size,
+        };
+        if (c.file_pos + frame.zsize > (uint64_t)file_size) break;
+
+        rr_zlog_dir_reserve(zlog);
+        zlog->dir[zlog->header.num_chunks++] = c;
+        zlog->header.size += frame.size;
+        zlog->header.last_instr = frame.last_instr;
+        fseeko(zlog->fp, frame.zsize, SEEK_CUR);
+    }
+
+    fprintf(stderr, "Compressed nondet log was not closed; recovered %u "
+            "chunks, up to instr %" PRIu64 "\n",
+            zlog->header.num_chunks, zlog->header.last_instr);
+}
+
+// Returns NULL (with fp rewound) if fp isn't a compressed log.
+static RR_zlog *rr_zlog_open_read(FILE *fp) {
+    RR_zlog_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1
+            || memcmp(header.magic, RR_ZLOG_MAGIC, sizeof(header.magic))) {
+        rewind(fp);
+        return NULL;
+    }
+    if (header.version != RR_ZLOG_VERSION) {
+        fprintf(stderr, "Unsupported compressed nondet log version %u\n",
+                header.version);
+        abort();
+    }
+
+    RR_zlog *zlog = calloc(1, sizeof(*zlog));
+    assert(zlog != NULL);
+    zlog->fp = fp;
+    zlog->header = header;
+    zlog->chunk = -1;
+    if (header.dir_pos == 0) {
+        rr_zlog_scan(zlog);
+        return zlog;
+    }
+
+    zlog->dir_cap = header.num_chunks;
+    zlog->dir = calloc(header.num_chunks + 1, sizeof(RR_zlog_chunk));
+    assert(zlog->dir != NULL);
+
+    fseeko(fp, header.dir_pos, SEEK_SET);
+    size_t n = fread(zlog->dir, sizeof(RR_zlog_chunk), header.num_chunks, fp);
+    assert(n == header.num_chunks);
+    return zlog;
+}
+
+// Index of the chunk containing uncompressed position pos.
+static int64_t rr_zlog_chunk_at(RR_zlog *zlog, uint64_t pos) {
+    int64_t lo = 0, hi = zlog->header.num_chunks - 1;
+    while (lo < hi) {
+        int64_t mid = (lo + hi + 1) / 2;
+        if (zlog->dir[mid].pos <= pos) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+static void rr_zlog_load_chunk(RR_zlog *zlog, int64_t i) {
+    RR_zlog_chunk *c = &zlog->dir[i];
+    zlog->buf = rr_zlog_grow(zlog->buf, &zlog->buf_cap, c->size);
+    zlog->zbuf = rr_zlog_grow(zlog->zbuf, &zlog->zbuf_cap, c->zsize);
+
+    fseeko(zlog->fp, c->file_pos, SEEK_SET);
+    size_t n = fread(zlog->zbuf, 1, c->zsize, zlog->fp);
+    assert(n == c->zsize);
+    uLongf size = c->size;
+    int ret = uncompress(zlog->buf, &size, zlog->zbuf, c->zsize);
+    assert(ret == Z_OK && size == c->size);
+
+    zlog->buf_len = size;
+    zlog->chunk = i;
+}
+
+static ssize_t rr_zlog_cookie_read(void *cookie, char *out, size_t len) {
+    RR_zlog *zlog = cookie;
+    size_t done = 0;
+
+    while (done < len && zlog->pos < zlog->header.size) {
+        size_t n;
+        if (zlog->pos < sizeof(uint64_t)) {
+            // instr count header, not part of any chunk
+            n = MIN(len - done, sizeof(uint64_t) - zlog->pos);
+            memcpy(out + done,
+                   (uint8_t *)&zlog->header.last_instr + zlog->pos, n);
+        } else {
+            if (zlog->chunk < 0
+                    || zlog->pos < zlog->dir[zlog->chunk].pos
+                    || zlog->pos >= zlog->dir[zlog->chunk].pos + zlog->buf_len) {
+                rr_zlog_load_chunk(zlog, rr_zlog_chunk_at(zlog, zlog->pos));
+            }
+            uint64_t off = zlog->pos - zlog->dir[zlog->chunk].pos;
+            n = MIN(len - done, zlog->buf_len - off);
+            memcpy(out + done, zlog->buf + off, n);
+        }
+        done += n;
+        zlog->pos += n;
+    }
+    return done;
+}
+
+static int rr_zlog_cookie_seek(void *cookie, off64_t *offset, int whence) {
+    RR_zlog *zlog = cookie;
+    int64_t pos;
+
+    switch (whence) {
+        case SEEK_SET:
+            pos = *offset;
+            break;
+        case SEEK_CUR:
+            pos = zlog->pos + *offset;
+            break;
+        case SEEK_END:
+            pos = zlog->header.size + *offset;
+            break;
+        default:
+            return -1;
+    }
+    if (pos < 0) return -1;
+
+    zlog->pos = pos;
+    *offset = pos;
+    return 0;
+}
+
+static int rr_zlog_cookie_close(void *cookie) {
+    RR_zlog *zlog = cookie;
+    int ret = fclose(zlog->fp);
+    rr_zlog_free(zlog);
+    return ret;
+}
+
+FILE *rr_zlog_fopen_read(const char *path, RR_zlog **zlog_out) {
+    FILE *fp = fopen(path, "r");
+    if (zlog_out) *zlog_out = NULL;
+    if (fp == NULL) return NULL;
+
+    RR_zlog *zlog = rr_zlog_open_read(fp);
+    if (zlog == NULL) return fp;
+
+    cookie_io_functions_t io = {
+        .read = rr_zlog_cookie_read,
+        .write = NULL,
+        .seek = rr_zlog_cookie_seek,
+        .close = rr_zlog_cookie_close,
+    };
+    FILE *zfp = fopencookie(zlog, "r", io);
+    assert(zfp != NULL);
+    if (zlog_out) *zlog_out = zlog;
+    return zfp;
+}
+
+uint64_t rr_zlog_find_instr(RR_zlog *zlog, uint64_t instr) {
+    int64_t lo = 0, hi = zlog->header.num_chunks - 1;
+    if (hi < 0 || zlog->dir[0].instr > instr) return sizeof(uint64_t);
+    while (lo < hi) {
+        int64_t mid = (lo + hi + 1) / 2;
+        if (zlog->dir[mid].instr <= instr) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return zlog->dir[lo].pos;
+}
+
+const RR_zlog_header *rr_zlog_get_header(RR_zlog *zlog) {
+    return &zlog->header;
+}
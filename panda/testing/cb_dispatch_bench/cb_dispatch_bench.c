@@ -0,0 +1,139 @@
+/*
+ * cb_dispatch_bench.c
+ * Microbenchmark of PANDA callback dispatch.
+ *
+ * Dispatches a mem callback the way callback_support.c used to -- an
+ * unconditional call into the dispatcher, which walks the linked callback
+ * list skipping disabled entries with panda_cb_list_next -- and the way it
+ * does now, testing panda_cbs_enabled at the call site and walking the
+ * NULL-terminated table of enabled callbacks. The structures are copies of
+ * the ones in panda/plugin.h, which can't be included outside a target
+ * build. Each registered plugin has an enabled, trivial callback, and a
+ * disabled one ahead of it.
+ *
+ * usage: cb_dispatch_bench [dispatches]
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ * See the COPYING file in the top-level directory.
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#define MAX_PLUGINS 8
+#define CB_TYPE 9 // PANDA_CB_VIRT_MEM_BEFORE_READ
+
+typedef struct cb_list cb_list;
+struct cb_list {
+    void (*cb)(uint64_t pc, uint64_t addr, uint32_t size);
+    void *owner;
+    cb_list *next;
+    cb_list *prev;
+    bool enabled;
+};
+
+static cb_list *cbs;
+static cb_list **table;
+static uint64_t cbs_enabled;
+static cb_list *empty_table[1] = { NULL };
+
+static uint64_t sink;
+
+static void __attribute__((noinline)) callback(uint64_t pc, uint64_t addr,
+                                               uint32_t size) {
+    sink += addr;
+}
+
+static cb_list *cb_list_next(cb_list *plist) {
+    for (cb_list *node = plist->next; node != NULL; node = node->next) {
+        if (node->enabled) return node;
+    }
+    return NULL;
+}
+
+static void __attribute__((noinline)) dispatch_list(uint64_t pc,
+                                                    uint64_t addr,
+                                                    uint32_t size) {
+    cb_list *plist;
+    for (plist = cbs; plist != NULL; plist = cb_list_next(plist)) {
+        // a disabled head was called too; keep that out of the comparison
+        if (plist->enabled) plist->cb(pc, addr, size);
+    }
+}
+
+static void __attribute__((noinline)) dispatch_table(uint64_t pc,
+                                                     uint64_t addr,
+                                                     uint32_t size) {
+    cb_list *plist;
+    for (cb_list **it = table; (plist = *it) != NULL; it++) {
+        plist->cb(pc, addr, size);
+    }
+}
+
+static void setup(int nplugins) {
+    static cb_list nodes[2 * MAX_PLUGINS];
+    cbs = NULL;
+    cb_list *last = NULL;
+    for (int i = 0; i < 2 * nplugins; i++) {
+        cb_list *n = &nodes[i];
+        n->cb = callback;
+        n->owner = (void *)(uintptr_t)(i / 2 + 1);
+        n->enabled = i % 2;
+        n->next = NULL;
+        n->prev = last;
+        if (last) last->next = n; else cbs = n;
+        last = n;
+    }
+
+    if (table != empty_table) free(table);
+    table = empty_table;
+    cbs_enabled = 0;
+    if (nplugins) {
+        table = malloc((nplugins + 1) * sizeof(*table));
+        int j = 0;
+        for (cb_list *n = cbs; n; n = n->next) {
+            if (n->enabled) table[j++] = n;
+        }
+        table[j] = NULL;
+        cbs_enabled = 1ULL << CB_TYPE;
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 0) : 100000000;
+    const int plugins[] = { 0, 1, 8 };
+    table = empty_table;
+
+    printf("%" PRIu64 " dispatches\n", n);
+    printf("plugins  list ns/dispatch  table ns/dispatch\n");
+    for (unsigned p = 0; p < sizeof(plugins) / sizeof(plugins[0]); p++) {
+        setup(plugins[p]);
+
+        double start = now();
+        for (uint64_t i = 0; i < n; i++) {
+            dispatch_list(i, i, 4);
+        }
+        double t_list = now() - start;
+
+        start = now();
+        for (uint64_t i = 0; i < n; i++) {
+            if (__builtin_expect(cbs_enabled & (1ULL << CB_TYPE), 0)) {
+                dispatch_table(i, i, 4);
+            }
+        }
+        double t_table = now() - start;
+
+        printf("%7d  %17.2f  %17.2f\n", plugins[p], t_list / n * 1e9,
+               t_table / n * 1e9);
+    }
+    return sink == 42;
+}
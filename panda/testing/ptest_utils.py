@@ -102,7 +102,7 @@ if foo:
     search_string_file = search_string_file_pfx + "_search_strings.txt"
 
 
-def record_debian(cmds, replayname, arch):
+def record_debian(cmds, replayname, arch, qemu_args=""):
     progress("Creating setup recording %s [%s]" % (replayname, cmds))
     # create the replay to use for reference / test
     arch_data = SUPPORTED_ARCHES[arch]
@@ -113,8 +113,11 @@ def record_debian(cmds, replayname, arch):
     if not (os.path.exists(replaysdir) and os.path.isdir(replaysdir)):
         os.makedirs(replaysdir)
     cmd += " --replaybase=%s/%s" % (replaysdir,replayname)
-    progress(cmd)
-    sp.check_call(cmd.split())
+    progress(cmd + (" --qemu_args='%s'" % qemu_args if qemu_args else ""))
+    cmd = cmd.split()
+    if qemu_args:
+        cmd.append("--qemu_args=" + qemu_args)
+    sp.check_call(cmd)
 
         
 # run this replay with these args (plugins)
@@ -0,0 +1,71 @@
+#!/usr/bin/python
+
+# Interleave a savevm with incremental checkpoints. Scissors saves a snapshot
+# a quarter of the way in, which stops the dirty log the incremental
+# checkpoints are built from. We then run to the middle of the replay under
+# the checkpoint plugin, reverse-step, which restores a checkpoint taken
+# after the savevm, and check that the replay still runs on from there. A
+# checkpoint missing pages the guest dirtied diverges instead.
+
+import os
+import sys
+import struct
+import subprocess as sp
+
+thisdir = os.path.dirname(os.path.realpath(__file__))
+td = os.path.realpath(thisdir + "/../..")
+sys.path.append(td)
+
+from ptest_utils import *
+from reverse_step_bench import GdbRemote
+
+port = 4321
+num_steps = 3
+
+with open(replaydir + "/find-rr-nondet.log", "rb") as f:
+    num_instrs = struct.unpack("<Q", f.read(8))[0]
+
+savevm_instr = num_instrs / 4
+stop_instr = num_instrs / 2
+next_instr = num_instrs * 5 / 8
+
+arch_data = SUPPORTED_ARCHES["i386"]
+qemu = os.path.join(panda_build_dir, arch_data.dir, arch_data.binary)
+clear_dir(tmpoutdir)
+os.chdir(tmpoutdir)
+cmd = [qemu, "-display", "none", "-replay", replaydir + "/find",
+       "-S", "-gdb", "tcp::%d" % port,
+       "-panda", "checkpoint",
+       "-panda", "scissors:name=%s/snip,start=%d,end=%d"
+           % (tmpoutdir, savevm_instr, num_instrs * 3 / 4)]
+progress(" ".join(cmd))
+proc = sp.Popen(cmd, stdout=open(tmpfulloutfile, "w"), stderr=sp.STDOUT)
+
+results = []
+try:
+    gdb = GdbRemote(port)
+    gdb.panda_cmd("rrbreakpoint", str(stop_instr))
+    gdb.command("c")
+    results.append("stopped at instr %s" % gdb.panda_cmd("when"))
+
+    for i in range(num_steps):
+        gdb.command("bs")
+        results.append("reverse-step %d: at instr %s"
+                       % (i, gdb.panda_cmd("when")))
+
+    gdb.panda_cmd("rrbreakpoint", str(next_instr))
+    gdb.command("c")
+    when = gdb.panda_cmd("when")
+    results.append("continued to instr %s" % when)
+    ok = int(when) == next_instr
+except Exception as e:
+    error(str(e))
+    ok = False
+finally:
+    proc.kill()
+
+with open(tmpoutfile, "w") as f:
+    for line in results:
+        progress(line)
+        f.write(line + "\n")
+    f.write("Checkpoint savevm %s\n" % ("PASS" if ok else "FAIL"))
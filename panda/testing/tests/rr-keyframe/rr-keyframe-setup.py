@@ -0,0 +1,14 @@
+#!/usr/bin/python
+
+import os
+import sys
+
+thisdir = os.path.dirname(os.path.realpath(__file__))
+td = os.path.realpath(thisdir + "/../..")
+sys.path.append(td)
+
+from ptest_utils import *
+
+# keyframes often enough that some are taken while an interrupt is pending
+record_debian("find /usr/bin", "find", "i386",
+              qemu_args="-record-keyframes 200000")
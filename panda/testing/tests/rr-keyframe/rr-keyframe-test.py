@@ -0,0 +1,58 @@
+#!/usr/bin/python
+
+# Replay from keyframes taken while cpu->interrupt_request was nonzero.
+# Replay only logs changes to interrupt_request, so starting from such a
+# keyframe diverges unless the keyframe restores it.
+
+import os
+import sys
+import struct
+
+thisdir = os.path.dirname(os.path.realpath(__file__))
+td = os.path.realpath(thisdir + "/../..")
+sys.path.append(td)
+
+from ptest_utils import *
+
+# replay from at most this many of them
+num_tests = 5
+
+# RR_keyframe_header and RR_keyframe in panda/checkpoint.h
+header_fmt = "<8sIIQQ"
+keyframe_fmt = "<QQIiQQQQ"
+
+def read_keyframes(path):
+    with open(path, "rb") as f:
+        (magic, version, num_keyframes, index_pos, ram_size) = \
+            struct.unpack(header_fmt, f.read(struct.calcsize(header_fmt)))
+        assert magic == "PANDArrk" and version == 2
+        f.seek(index_pos)
+        size = struct.calcsize(keyframe_fmt)
+        return [struct.unpack(keyframe_fmt, f.read(size))
+                for i in range(num_keyframes)]
+
+keyframes = read_keyframes(replaydir + "/find-rr-keyframes")
+pending = [kf for kf in keyframes if kf[3] != 0][:num_tests]
+
+num_pass = 0
+for kf in pending:
+    (instr, log_pos, full, interrupt_request) = kf[:4]
+    try:
+        run_test_debian("-replay-from %d" % instr, "find", "i386")
+        msg = "Replay from keyframe @ %d (interrupt_request %#x) succeeded" \
+            % (instr, interrupt_request)
+        progress(msg)
+        num_pass += 1
+    except Exception as e:
+        msg = "Replay from keyframe @ %d (interrupt_request %#x) FAILED" \
+            % (instr, interrupt_request)
+        error(msg)
+        error(str(e))
+
+with open(tmpoutfile, "w") as f:
+    f.write("rr-keyframe-test results: %d pass %d fail\n"
+            % (num_pass, len(pending) - num_pass))
+    if pending and num_pass == len(pending):
+        f.write("Keyframes PASS\n")
+    else:
+        f.write("Keyframes FAIL\n")
@@ -4130,10 +4130,29 @@ DEF("record-from", HAS_ARG, QEMU_OPTION_record_from,
     "-record-from <snapshot>:<record-name>\n"
     "                load snapshot <snapshot> and begin recording\n", QEMU_ARCH_ALL)
 
+DEF("record-compress", 0, QEMU_OPTION_record_compress,
+    "-record-compress\n"
+    "                write the nondet log of recordings as compressed chunks\n", QEMU_ARCH_ALL)
+
+DEF("record-keyframes", HAS_ARG, QEMU_OPTION_record_keyframes,
+    "-record-keyframes <n>\n"
+    "                while recording, save a keyframe every <n> instructions\n"
+    "                that replays can start from (see -replay-from)\n", QEMU_ARCH_ALL)
+
 DEF("replay", HAS_ARG, QEMU_OPTION_replay,
     "-replay </path/to/snapshot-prefix>\n"
     "                replay the recording that starts at <snapshot>\n", QEMU_ARCH_ALL)
 
+DEF("replay-from", HAS_ARG, QEMU_OPTION_replay_from,
+    "-replay-from <instr>\n"
+    "                start the replay from the last keyframe at or before\n"
+    "                guest instruction <instr>\n", QEMU_ARCH_ALL)
+
+DEF("replay-chaining", 0, QEMU_OPTION_replay_chaining,
+    "-replay-chaining\n"
+    "                chain translated blocks during replay, leaving translated\n"
+    "                code only when the next logged event is due\n", QEMU_ARCH_ALL)
+
 DEF("pandalog", HAS_ARG, QEMU_OPTION_pandalog,
     "-pandalog <filename>\n"
     "                enable panda logging to file\n", QEMU_ARCH_ALL)
@@ -131,7 +131,7 @@ WORD_TYPE helper_le_ld_name(CPUArchState *env, target_ulong addr,
     }
 
     /* Handle an IO access.  */
-    if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
+    if (unlikely(tlb_addr & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH))) {
         if ((addr & (DATA_SIZE - 1)) != 0) {
             goto do_unaligned_access;
         }
@@ -199,7 +199,7 @@ WORD_TYPE helper_be_ld_name(CPUArchState *env, target_ulong addr,
     }
 
     /* Handle an IO access.  */
-    if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
+    if (unlikely(tlb_addr & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH))) {
         if ((addr & (DATA_SIZE - 1)) != 0) {
             goto do_unaligned_access;
         }
@@ -290,7 +290,7 @@ void helper_le_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
     }
 
     /* Handle an IO access.  */
-    if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
+    if (unlikely(tlb_addr & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH))) {
         if ((addr & (DATA_SIZE - 1)) != 0) {
             goto do_unaligned_access;
         }
@@ -366,7 +366,7 @@ void helper_be_st_name(CPUArchState *env, target_ulong addr, DATA_TYPE val,
     }
 
     /* Handle an IO access.  */
-    if (unlikely(tlb_addr & ~TARGET_PAGE_MASK)) {
+    if (unlikely(tlb_addr & ~(TARGET_PAGE_MASK | TLB_PANDA_WATCH))) {
         if ((addr & (DATA_SIZE - 1)) != 0) {
             goto do_unaligned_access;
         }
@@ -436,9 +436,17 @@ WORD_TYPE glue(helper_le_ld_name, _panda)(CPUArchState *env, target_ulong addr,
         retaddr = GETPC();
     }
 
-    panda_callbacks_before_mem_read(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (void *)haddr);
+    bool memcb = panda_memcb_wanted(cpu, addr, DATA_SIZE);
+    if (memcb && unlikely(panda_cbs_enabled & PANDA_CBS_BEFORE_MEM_READ)) {
+        panda_callbacks_before_mem_read(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (void *)haddr);
+    }
+    if (unlikely(panda_retry_access)) {
+        panda_exit_before_access(cpu, retaddr);
+    }
     WORD_TYPE ret = helper_le_ld_name(env, addr, oi, retaddr);
-    panda_callbacks_after_mem_read(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)ret, (void *)haddr);
+    if (memcb && unlikely(panda_cbs_enabled & PANDA_CBS_AFTER_MEM_READ)) {
+        panda_callbacks_after_mem_read(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)ret, (void *)haddr);
+    }
     return ret;
 }
 
@@ -465,9 +473,17 @@ void glue(helper_le_st_name, _panda)(CPUArchState *env, target_ulong addr,
         retaddr = GETPC();
     }
 
-    panda_callbacks_before_mem_write(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)val, (void *)haddr);
+    bool memcb = panda_memcb_wanted(cpu, addr, DATA_SIZE);
+    if (memcb && unlikely(panda_cbs_enabled & PANDA_CBS_BEFORE_MEM_WRITE)) {
+        panda_callbacks_before_mem_write(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)val, (void *)haddr);
+    }
+    if (unlikely(panda_retry_access)) {
+        panda_exit_before_access(cpu, retaddr);
+    }
     helper_le_st_name(env, addr, val, oi, retaddr);
-    panda_callbacks_after_mem_write(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)val, (void *)haddr);
+    if (memcb && unlikely(panda_cbs_enabled & PANDA_CBS_AFTER_MEM_WRITE)) {
+        panda_callbacks_after_mem_write(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)val, (void *)haddr);
+    }
 }
 
 #if DATA_SIZE > 1
@@ -493,9 +509,17 @@ WORD_TYPE glue(helper_be_ld_name, _panda)(CPUArchState *env, target_ulong addr,
         retaddr = GETPC();
     }
 
-    panda_callbacks_before_mem_read(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (void *)haddr);
+    bool memcb = panda_memcb_wanted(cpu, addr, DATA_SIZE);
+    if (memcb && unlikely(panda_cbs_enabled & PANDA_CBS_BEFORE_MEM_READ)) {
+        panda_callbacks_before_mem_read(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (void *)haddr);
+    }
+    if (unlikely(panda_retry_access)) {
+        panda_exit_before_access(cpu, retaddr);
+    }
     WORD_TYPE ret = helper_be_ld_name(env, addr, oi, retaddr);
-    panda_callbacks_after_mem_read(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)ret, (void *)haddr);
+    if (memcb && unlikely(panda_cbs_enabled & PANDA_CBS_AFTER_MEM_READ)) {
+        panda_callbacks_after_mem_read(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)ret, (void *)haddr);
+    }
     return ret;
 }
 
@@ -522,9 +546,17 @@ void glue(helper_be_st_name, _panda)(CPUArchState *env, target_ulong addr,
         retaddr = GETPC();
     }
 
-    panda_callbacks_before_mem_write(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)val, (void *)haddr);
+    bool memcb = panda_memcb_wanted(cpu, addr, DATA_SIZE);
+    if (memcb && unlikely(panda_cbs_enabled & PANDA_CBS_BEFORE_MEM_WRITE)) {
+        panda_callbacks_before_mem_write(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)val, (void *)haddr);
+    }
+    if (unlikely(panda_retry_access)) {
+        panda_exit_before_access(cpu, retaddr);
+    }
     helper_be_st_name(env, addr, val, oi, retaddr);
-    panda_callbacks_after_mem_write(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)val, (void *)haddr);
+    if (memcb && unlikely(panda_cbs_enabled & PANDA_CBS_AFTER_MEM_WRITE)) {
+        panda_callbacks_after_mem_write(cpu, cpu->panda_guest_pc, addr, DATA_SIZE, (uint64_t)val, (void *)haddr);
+    }
 }
 
 #endif /* DATA_SIZE > 1 */
@@ -11871,8 +11871,10 @@ void gen_intermediate_code(CPUARMState *env, TranslationBlock *tb)
 
 #ifdef CONFIG_SOFTMMU
         //mz let's count this instruction
-        // In LLVM mode we generate this more efficiently.
-        if ((rr_mode != RR_OFF || panda_update_pc) && !generate_llvm) {
+        // In LLVM mode we generate this more efficiently, unless the TCG
+        // translation may run as well (dual_exec_llvm).
+        if ((rr_mode != RR_OFF || panda_update_pc)
+                && (!generate_llvm || dual_exec_llvm)) {
             gen_op_update_panda_pc(dc->pc);
             gen_op_update_rr_icount();
         }
@@ -7045,8 +7045,9 @@ void gen_intermediate_code(CPUPPCState *env, struct TranslationBlock *tb)
 
 #ifdef CONFIG_SOFTMMU
         //mz let's count this instruction
-        // In LLVM mode we generate this more efficiently.
-        if (rr_mode != RR_OFF && !generate_llvm) {
+        // In LLVM mode we generate this more efficiently, unless the TCG
+        // translation may run as well (dual_exec_llvm).
+        if (rr_mode != RR_OFF && (!generate_llvm || dual_exec_llvm)) {
             gen_op_update_panda_pc(ctx.nip);
             gen_op_update_rr_icount();
         }
@@ -1307,6 +1307,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if (use_icount && !(cflags & CF_IGNORE_ICOUNT)) {
         cflags |= CF_USE_ICOUNT;
     }
+    if (rr_replay_chaining_enabled() && !(cflags & CF_NOCACHE)) {
+        cflags |= CF_RR_CHAIN;
+    }
 
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
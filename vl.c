@@ -146,6 +146,7 @@ extern void panda_cleanup(void);
 extern bool panda_add_arg(const char *, const char *);
 extern bool panda_load_plugin(const char *, const char *);
 extern void panda_unload_plugins(void);
+extern void panda_cb_profile_configure(void);
 extern char *panda_plugin_path(const char *name);
 void panda_set_os_name(char *os_name);
 extern void panda_callbacks_after_machine_init(void);
@@ -4171,6 +4172,9 @@ int main(int argc, char **argv, char **envp)
                 display_type = DT_NONE;
                 replay_name = optarg;
                 break;
+            case QEMU_OPTION_replay_chaining:
+                rr_replay_chaining = true;
+                break;
             case QEMU_OPTION_pandalog:
                 pandalog = 1;
                 pandalog_cc_init_write(optarg);
@@ -4179,6 +4183,21 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_record_from:
                 record_name = optarg;
                 break;
+            case QEMU_OPTION_record_compress:
+                rr_record_compress = true;
+                break;
+            case QEMU_OPTION_record_keyframes:
+                if (qemu_strtoull(optarg, NULL, 0, &rr_keyframe_interval) < 0) {
+                    error_report("invalid -record-keyframes interval");
+                    exit(1);
+                }
+                break;
+            case QEMU_OPTION_replay_from:
+                if (qemu_strtoull(optarg, NULL, 0, &rr_replay_from) < 0) {
+                    error_report("invalid -replay-from instruction count");
+                    exit(1);
+                }
+                break;
             case QEMU_OPTION_panda_arg:
                 // panda_add_arg() currently always return true
                 assert(panda_add_arg(NULL, optarg));
@@ -4257,6 +4276,7 @@ int main(int argc, char **argv, char **envp)
           abort();
       }
     }
+    panda_cb_profile_configure();
 
     // This is to support having a help option in the plugins. If
     // someone asked for help on a plugin, we don't want to start